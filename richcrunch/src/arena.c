@@ -1,16 +1,67 @@
+// For MAP_ANONYMOUS and madvise under strict C
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "arena.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define ARENA_VIRTUAL_ENABLED
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ARENA_VIRTUAL_ENABLED
+#endif
+
 #define ARENA_ALIGNMENT 16
 
+// How far ahead of what's in use a reserved range is committed, so that growing an arena seldom calls into the OS
+#define ARENA_COMMIT_STEP 0x100000U
+
 
 static uint32_t get_aligned_size(uint32_t size, uint32_t alignment) {
     return (size + alignment - 1) & ~(alignment - 1);
 }
 
 
+// Record the given number of bytes against the arena's current tag
+static void arena_record_tag(arena_t *arena, uint32_t size, bool new_block) {
+    arena_stats_t *stats = arena->stats;
+    stats->num_allocs += new_block;
+
+    const char *tag = arena->tag ? arena->tag : "untagged";
+    uint32_t t = 0;
+    while (t < stats->num_tags && stats->tags[t].tag != tag && strcmp(stats->tags[t].tag, tag) != 0) {
+        t++;
+    }
+    if (t == ARENA_STATS_MAX_TAGS) {
+        t = ARENA_STATS_MAX_TAGS - 1;
+        stats->tags[t].tag = "others";
+    }
+    else if (t == stats->num_tags) {
+        stats->tags[t].tag = tag;
+        stats->num_tags++;
+    }
+    stats->tags[t].num_allocs += new_block;
+    stats->tags[t].num_bytes += size;
+}
+
+
+// Record that the given number of bytes have just been taken from the arena, either for a new block or to extend one
+static void arena_record_alloc(arena_t *arena, uint32_t size, bool new_block) {
+    if (arena->stats) {
+        if (arena->next > arena->stats->high_water) {
+            arena->stats->high_water = arena->next;
+        }
+        arena_record_tag(arena, size, new_block);
+    }
+}
+
+
 arena_t arena_make(uint32_t size) {
     arena_t arena = {0};
     arena_init(&arena, size);
@@ -18,7 +69,8 @@ arena_t arena_make(uint32_t size) {
 }
 
 
-void arena_init(arena_t *arena, uint32_t total_size) {
+// Initialise an arena from the heap, returning false if the memory can't be had
+static bool arena_try_init(arena_t *arena, uint32_t total_size) {
     assert(arena);
     if (arena->base) {
         arena_deinit(arena);
@@ -27,32 +79,140 @@ void arena_init(arena_t *arena, uint32_t total_size) {
     total_size = get_aligned_size(total_size, ARENA_ALIGNMENT);
     void *block = calloc(total_size, 1);
     if (!block) {
-        abort();
+        return false;
     }
     assert(((uintptr_t)block & (ARENA_ALIGNMENT - 1)) == 0);
 
     arena->base = block;
     arena->next = 0;
     arena->end  = total_size;
+    arena->flags = arena_flags_none;
+    arena->committed = 0;
+    return true;
+}
+
+
+void arena_init(arena_t *arena, uint32_t total_size) {
+    if (!arena_try_init(arena, total_size)) {
+        abort();
+    }
+}
+
+
+static void arena_release_virtual(void *base, uint32_t size) {
+#if defined(ARENA_VIRTUAL_ENABLED) && defined(_WIN32)
+    VirtualFree(base, 0, MEM_RELEASE);
+#elif defined(ARENA_VIRTUAL_ENABLED)
+    munmap(base, size);
+#else
+    assert(false);
+#endif
+}
+
+
+// Reserve a range of address space for an arena, returning false if it can't be had
+static bool arena_reserve_virtual(arena_t *arena, uint32_t reserve_size, bool huge_pages) {
+#if defined(ARENA_VIRTUAL_ENABLED) && defined(_WIN32)
+    // Committing counts against the commit limit even before the pages are touched, so only reserve here, and
+    // commit as the arena grows. Transparent huge pages aren't available.
+    (void)huge_pages;
+    void *block = VirtualAlloc(0, reserve_size, MEM_RESERVE, PAGE_READWRITE);
+    if (block) {
+        *arena = (arena_t) {.base = block, .next = 0, .end = reserve_size, .flags = arena_flags_virtual | arena_flags_commit};
+        return true;
+    }
+#elif defined(ARENA_VIRTUAL_ENABLED)
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    map_flags |= MAP_NORESERVE;
+#endif
+    void *block = mmap(0, reserve_size, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+    if (block != MAP_FAILED) {
+        uint32_t flags = arena_flags_virtual;
+#ifdef MADV_HUGEPAGE
+        if (huge_pages && madvise(block, reserve_size, MADV_HUGEPAGE) == 0) {
+            flags |= arena_flags_huge_pages;
+        }
+#endif
+        *arena = (arena_t) {.base = block, .next = 0, .end = reserve_size, .flags = flags};
+        return true;
+    }
+#endif
+    return false;
+}
+
+
+arena_t arena_try_make_virtual(uint32_t reserve_size, bool huge_pages) {
+    reserve_size = get_aligned_size(reserve_size, ARENA_ALIGNMENT);
+
+    // Address space can run short in 32-bit processes, or under a limit on it
+    arena_t arena = {0};
+    for (uint32_t size = reserve_size; ; size /= 2) {
+        if (arena_reserve_virtual(&arena, size, huge_pages)) {
+            return arena;
+        }
+        if (size / 2 < ARENA_VIRTUAL_MIN_RESERVE_SIZE) {
+            break;
+        }
+    }
+
+    arena_try_init(&arena, reserve_size < ARENA_VIRTUAL_MIN_RESERVE_SIZE ? reserve_size : ARENA_VIRTUAL_MIN_RESERVE_SIZE);
+    return arena;
+}
+
+
+arena_t arena_make_virtual(uint32_t reserve_size, bool huge_pages) {
+    arena_t arena = arena_try_make_virtual(reserve_size, huge_pages);
+    if (!arena.base) {
+        abort();
+    }
+    return arena;
+}
+
+
+// Make sure everything up to the arena's next allocation is committed.
+// Only a range reserved on Windows needs this; elsewhere the OS commits pages as they're touched.
+static void arena_commit(arena_t *arena) {
+    if (!(arena->flags & arena_flags_commit) || arena->next <= arena->committed) {
+        return;
+    }
+#if defined(ARENA_VIRTUAL_ENABLED) && defined(_WIN32)
+    uint32_t committed = get_aligned_size(arena->next, ARENA_COMMIT_STEP);
+    if (committed > arena->end || committed < arena->next) {
+        committed = arena->end;
+    }
+    // Committing pages which already are is harmless, so it doesn't matter if a copy of the arena got there first
+    if (!VirtualAlloc((char *)arena->base + arena->committed, committed - arena->committed, MEM_COMMIT, PAGE_READWRITE)) {
+        abort();
+    }
+    arena->committed = committed;
+#endif
 }
 
 
 void arena_deinit(arena_t *arena) {
     assert(arena);
     if (arena->base) {
-        free(arena->base);
+        if (arena->flags & arena_flags_virtual) {
+            arena_release_virtual(arena->base, arena->end);
+        }
+        else {
+            free(arena->base);
+        }
     }
     arena->base = 0;
     arena->next = 0;
     arena->end  = 0;
+    arena->flags = arena_flags_none;
+    arena->committed = 0;
+    arena->stats = 0;
 }
 
 
-void *arena_alloc(arena_t *arena, uint32_t size) {
+static void *arena_take(arena_t *arena, uint32_t aligned_size) {
     assert(arena);
     assert(arena->base);
-    uint32_t aligned_size = get_aligned_size(size, ARENA_ALIGNMENT);
-    if (arena->next + aligned_size > arena->end) {
+    if (aligned_size > arena->end - arena->next) {
         abort();
     }
     
@@ -62,9 +222,22 @@ void *arena_alloc(arena_t *arena, uint32_t size) {
 }
 
 
+void *arena_alloc(arena_t *arena, uint32_t size) {
+    uint32_t aligned_size = get_aligned_size(size, ARENA_ALIGNMENT);
+    void *ptr = arena_take(arena, aligned_size);
+    arena_commit(arena);
+    arena_record_alloc(arena, aligned_size, true);
+    return ptr;
+}
+
+
 void *arena_calloc(arena_t *arena, uint32_t size) {
     void *ptr = arena_alloc(arena, size);
-    memset(ptr, 0, get_aligned_size(size, ARENA_ALIGNMENT));
+    uint32_t aligned_size = get_aligned_size(size, ARENA_ALIGNMENT);
+    memset(ptr, 0, aligned_size);
+    if (arena->stats) {
+        arena->stats->zeroed_bytes += aligned_size;
+    }
     return ptr;
 }
 
@@ -79,21 +252,33 @@ void *arena_realloc(arena_t *arena, void *oldptr, uint32_t old_size, uint32_t ne
     uint32_t old_aligned_size = get_aligned_size(old_size, ARENA_ALIGNMENT);
     uint32_t new_aligned_size = get_aligned_size(new_size, ARENA_ALIGNMENT);
     if ((char *)oldptr + old_aligned_size == (char *)arena->base + arena->next) {
-        arena->next += (new_aligned_size - old_aligned_size);
-        if (arena->next > arena->end) {
+        if (new_aligned_size - old_aligned_size > arena->end - arena->next) {
             abort();
         }
+        arena->next += (new_aligned_size - old_aligned_size);
+        arena_commit(arena);
         memset((char *)oldptr + old_aligned_size, 0, new_aligned_size - old_aligned_size);
+        arena_record_alloc(arena, new_aligned_size - old_aligned_size, false);
+        if (arena->stats) {
+            arena->stats->zeroed_bytes += new_aligned_size - old_aligned_size;
+        }
         return oldptr;
     }
     else {
-        if (arena->next + new_aligned_size > arena->end) {
+        if (new_aligned_size > arena->end - arena->next) {
             abort();
         }
         void *newptr = (char *)arena->base + arena->next;
         arena->next += new_aligned_size;
+        arena_commit(arena);
         memcpy(newptr, oldptr, old_aligned_size);
         memset((char *)newptr + old_aligned_size, 0, new_aligned_size - old_aligned_size);
+        arena_record_alloc(arena, new_aligned_size, true);
+        if (arena->stats) {
+            arena->stats->num_realloc_copies++;
+            arena->stats->realloc_copy_bytes += old_aligned_size;
+            arena->stats->zeroed_bytes += new_aligned_size - old_aligned_size;
+        }
         return newptr;
     }
 }
@@ -102,11 +287,37 @@ void *arena_realloc(arena_t *arena, void *oldptr, uint32_t old_size, uint32_t ne
 arena_t arena_alloc_subarena(arena_t *arena, uint32_t size) {
     assert(arena);
     size = get_aligned_size(size, ARENA_ALIGNMENT);
-    return (arena_t) {
-        .base = arena_alloc(arena, size),
+    uint32_t offset = arena->next;
+    arena_t subarena = {
+        .base = arena_take(arena, size),
         .next = 0,
-        .end = size
+        .end = size,
+        .flags = arena->flags & arena_flags_commit,     // the sub-arena commits its own range as it grows
+        .tag = arena->tag
     };
+
+    if (arena->stats) {
+        // The sub-arena only counts towards the high water mark as far as it's used, which is worked out from its
+        // own stats when they're reported
+        arena_record_tag(arena, size, true);
+
+        arena_stats_t *stats = calloc(1, sizeof(arena_stats_t));
+        if (!stats) {
+            abort();
+        }
+        stats->name = arena->tag ? arena->tag : "sub-arena";
+        stats->offset = offset;
+        stats->size = size;
+
+        arena_stats_t **link = &arena->stats->first_child;
+        while (*link) {
+            link = &(*link)->next_sibling;
+        }
+        *link = stats;
+        subarena.stats = stats;
+    }
+
+    return subarena;
 }
 
 
@@ -120,8 +331,107 @@ void arena_free(arena_t *arena, void *ptr, uint32_t size) {
 }
 
 
+arena_checkpoint_t arena_get_checkpoint(const arena_t *arena) {
+    assert(arena);
+    return (arena_checkpoint_t) {.next = arena->next};
+}
+
+
+void arena_rollback(arena_t *arena, arena_checkpoint_t checkpoint) {
+    assert(arena);
+    assert(checkpoint.next <= arena->next);
+    arena->next = checkpoint.next;
+}
+
+
 void arena_reset(arena_t *arena) {
     assert(arena);
     arena->next = 0;
 }
 
+
+
+void arena_attach_stats(arena_t *arena, arena_stats_t *stats, const char *name) {
+    assert(arena);
+    assert(stats);
+    *stats = (arena_stats_t) {
+        .name = name,
+        .size = arena->end,
+        .high_water = arena->next
+    };
+    arena->stats = stats;
+}
+
+
+void arena_detach_stats(arena_t *arena) {
+    assert(arena);
+    arena->stats = 0;
+}
+
+
+const char *arena_set_tag(arena_t *arena, const char *tag) {
+    assert(arena);
+    const char *prev = arena->tag;
+    arena->tag = tag;
+    return prev;
+}
+
+
+void arena_stats_deinit(arena_stats_t *stats) {
+    assert(stats);
+    arena_stats_t *child = stats->first_child;
+    while (child) {
+        arena_stats_t *next = child->next_sibling;
+        arena_stats_deinit(child);
+        free(child);
+        child = next;
+    }
+    stats->first_child = 0;
+}
+
+
+uint32_t arena_stats_get_high_water(const arena_stats_t *stats) {
+    uint32_t high_water = stats->high_water;
+    for (const arena_stats_t *child = stats->first_child; child; child = child->next_sibling) {
+        uint32_t child_high_water = child->offset + arena_stats_get_high_water(child);
+        if (child_high_water > high_water) {
+            high_water = child_high_water;
+        }
+    }
+    return high_water;
+}
+
+
+static void arena_stats_print_indented(const arena_stats_t *stats, FILE *file, int indent) {
+    uint32_t high_water = arena_stats_get_high_water(stats);
+    fprintf(file, "%*s%s: high water %u / %u bytes (%u%%), %u allocs, %u realloc copies (%llu bytes), %llu bytes zeroed\n",
+        indent, "",
+        stats->name ? stats->name : "arena",
+        high_water,
+        stats->size,
+        stats->size ? (uint32_t)((uint64_t)high_water * 100 / stats->size) : 0,
+        stats->num_allocs,
+        stats->num_realloc_copies,
+        (unsigned long long)stats->realloc_copy_bytes,
+        (unsigned long long)stats->zeroed_bytes
+    );
+
+    for (uint32_t t = 0; t < stats->num_tags; t++) {
+        fprintf(file, "%*s  [%s] %u allocs, %llu bytes\n",
+            indent, "",
+            stats->tags[t].tag,
+            stats->tags[t].num_allocs,
+            (unsigned long long)stats->tags[t].num_bytes
+        );
+    }
+
+    for (const arena_stats_t *child = stats->first_child; child; child = child->next_sibling) {
+        arena_stats_print_indented(child, file, indent + 2);
+    }
+}
+
+
+void arena_stats_print(const arena_stats_t *stats, FILE *file) {
+    assert(stats);
+    arena_stats_print_indented(stats, file, 0);
+}
@@ -1,18 +1,91 @@
 #ifndef ARENA_H_
 #define ARENA_H_
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+
+typedef struct arena_stats_t arena_stats_t;
 
 typedef struct arena_t {
     void *base;
     uint32_t next;
     uint32_t end;
+    uint32_t flags;         // arena_flags_t: how the memory was obtained, so arena_deinit can release it
+    uint32_t committed;     // with arena_flags_commit, how much of the range is known to be committed
+    arena_stats_t *stats;   // if set, where the arena's use is recorded
+    const char *tag;        // what the arena's allocations are recorded as in its stats
 } arena_t;
 
 
+typedef enum arena_flags_t {
+    arena_flags_none = 0,
+    arena_flags_virtual = 1 << 0,       // a reserved range of address space, committed by the OS as it's touched
+    arena_flags_huge_pages = 1 << 1,    // transparent huge pages were requested for the range
+    arena_flags_commit = 1 << 2         // the range is only reserved, and must be committed as the arena grows
+} arena_flags_t;
+
+
+// A saved position in an arena, which it can later be rolled back to
+typedef struct arena_checkpoint_t {
+    uint32_t next;
+} arena_checkpoint_t;
+
+
+// Optional instrumentation of an arena's use.
+//
+// Copies of an arena made to pass it by value share its stats, as they share its memory.
+// A sub-arena gets stats of its own, linked to its parent's, so that threads working in separate sub-arenas never
+// write to the same record. These are allocated on the heap, and freed by arena_stats_deinit.
+
+#define ARENA_STATS_MAX_TAGS 16
+
+typedef struct arena_tag_stats_t {
+    const char *tag;
+    uint32_t num_allocs;
+    uint64_t num_bytes;
+} arena_tag_stats_t;
+
+struct arena_stats_t {
+    const char *name;
+    uint32_t offset;                // for a sub-arena, where it starts in its parent
+    uint32_t size;                  // the size of the arena
+    uint32_t high_water;            // the most of the arena which has been in use at once, apart from sub-arenas,
+                                    // whose use is in their own stats
+    uint32_t num_allocs;
+    uint32_t num_realloc_copies;    // reallocs which couldn't grow in place, and had to copy the block
+    uint64_t realloc_copy_bytes;
+    uint64_t zeroed_bytes;
+    uint32_t num_tags;
+    arena_tag_stats_t tags[ARENA_STATS_MAX_TAGS];   // once full, the rest are recorded in the last one
+    arena_stats_t *first_child;     // the stats of sub-arenas allocated from this arena, in order
+    arena_stats_t *next_sibling;
+};
+
+
+// A size to reserve for a virtual arena which should never run out.
+// It costs only address space until it's used.
+#define ARENA_VIRTUAL_RESERVE_SIZE 0x80000000U
+
+// The smallest range a virtual arena will settle for, and the size of the regular arena made in its place where not
+// even that much address space can be reserved
+#define ARENA_VIRTUAL_MIN_RESERVE_SIZE 0x1000000U
+
+
 // Make a new arena
 arena_t arena_make(uint32_t size);
 
+// Make a new arena by reserving a range of address space, rather than allocating it up front.
+// Pages are only committed, already zeroed, when first touched, so the size can be much more than is expected to
+// be needed. Optionally, ask for transparent huge pages, to cut TLB misses on big inputs.
+// If the whole range can't be reserved, smaller ranges are tried, down to ARENA_VIRTUAL_MIN_RESERVE_SIZE. Where
+// virtual memory isn't available, or that fails too, this falls back to a regular arena of at most that size.
+arena_t arena_make_virtual(uint32_t reserve_size, bool huge_pages);
+
+// Make a new arena as arena_make_virtual does, but if no memory at all can be had, return an arena with null base
+// rather than aborting
+arena_t arena_try_make_virtual(uint32_t reserve_size, bool huge_pages);
+
 // Initialise an existing arena
 void arena_init(arena_t *arena, uint32_t total_size);
 
@@ -34,8 +107,33 @@ arena_t arena_alloc_subarena(arena_t *arena, uint32_t size);
 // Free a block from the arena, if it's the last
 void arena_free(arena_t *arena, void *ptr, uint32_t size);
 
+// Get a checkpoint at the arena's current position
+arena_checkpoint_t arena_get_checkpoint(const arena_t *arena);
+
+// Free everything allocated from the arena since the checkpoint was taken
+void arena_rollback(arena_t *arena, arena_checkpoint_t checkpoint);
+
 // Reset the arena to empty
 void arena_reset(arena_t *arena);
 
+// Start recording the arena's use in the given stats, which are cleared.
+// The high water mark starts from what's already allocated.
+void arena_attach_stats(arena_t *arena, arena_stats_t *stats, const char *name);
+
+// Stop recording the arena's use
+void arena_detach_stats(arena_t *arena);
+
+// Set the tag under which further allocations are recorded, returning the previous one
+const char *arena_set_tag(arena_t *arena, const char *tag);
+
+// Free the stats of any sub-arenas
+void arena_stats_deinit(arena_stats_t *stats);
+
+// Get the most of the arena which has been in use at once, including what its sub-arenas used
+uint32_t arena_stats_get_high_water(const arena_stats_t *stats);
+
+// Write a report of the stats, and those of any sub-arenas, to the given file
+void arena_stats_print(const arena_stats_t *stats, FILE *file);
+
 
 #endif // ifndef ARENA_H_
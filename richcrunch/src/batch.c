@@ -0,0 +1,281 @@
+#include "batch.h"
+#include "arena.h"
+#include "file.h"
+#include "huffman.h"
+#include "method.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct batch_job_t {
+    const char *type;
+    const char *input;
+    const char *output;
+    uint32_t input_size;
+    uint32_t output_size;
+    double time_ms;
+    bool cached;            // the output came from the cache
+    const char *error;      // why the job failed, or null if it succeeded
+} batch_job_t;
+
+#define TEMPLATE_ARRAY_NAME batch_job_array
+#define TEMPLATE_ARRAY_TYPE batch_job_t
+#include "array.template.h"
+
+
+typedef struct batch_t {
+    batch_job_array_span_t jobs;
+    lz_options_t lz_options;
+    bool verify;
+    bool huge_pages;
+    const cache_t *cache;
+
+    // Each worker has its own arenas, made the first time it runs a job, and reset for each one after that
+    arena_t arenas[THREAD_POOL_MAX_THREADS];
+    arena_t scratches[THREAD_POOL_MAX_THREADS];
+} batch_t;
+
+
+// Split the manifest into jobs, in place.
+// Returns false, having reported the line, if it isn't valid.
+static bool batch_parse_manifest(char *text, const char *manifest_filename, batch_job_array_t *jobs, arena_t *arena) {
+    uint32_t line = 0;
+    while (*text) {
+        line++;
+        char *end = text + strcspn(text, "\r\n");
+        char *next = end + strspn(end, "\r\n");
+        *end = 0;
+
+        const char *fields[4] = {0};
+        uint32_t num_fields = 0;
+        for (char *field = strtok(text, " \t"); field && num_fields < 4; field = strtok(0, " \t")) {
+            fields[num_fields++] = field;
+        }
+
+        if (num_fields > 0 && fields[0][0] != '#') {
+            if (num_fields != 3) {
+                fprintf(stderr, "%s:%u: expected '<type> <input> <output>'\n", manifest_filename, line);
+                return false;
+            }
+            batch_job_array_add(jobs, (batch_job_t) {.type = fields[0], .input = fields[1], .output = fields[2]}, arena);
+        }
+
+        text = next;
+    }
+    return true;
+}
+
+
+// Compress one job's input to its output, returning why it failed, or null if it succeeded
+static const char *batch_compress(const batch_t *batch, batch_job_t *job, arena_t *arena, arena_t scratch) {
+    // Map the input so that it's used in place; if it can't be mapped, read it into the arena instead.
+    // If it's the same file as the output, however they're named, it's read, so that writing the output can't
+    // truncate it under its mapping.
+    file_mapping_t src_mapping = {0};
+    if (file_is_distinct(job->input, job->output)) {
+        src_mapping = file_map_binary(job->input);
+    }
+    byte_array_view_t src = src_mapping.contents.view;
+    if (!src.data) {
+        file_read_result_t src_file = file_read_binary(job->input, arena);
+        if (src_file.error.type != file_error_none) {
+            return "can't read input";
+        }
+        src = src_file.contents;
+    }
+    job->input_size = src.num;
+
+    const char *error = 0;
+    byte_array_view_t compressed = {0};
+    file_mapping_t dest_mapping = {0};
+
+    bool use_cache = batch->cache && cache_is_enabled(batch->cache) &&
+        (strcmp(job->type, "lz") == 0 || strcmp(job->type, "huffman") == 0 || strcmp(job->type, "auto") == 0);
+    cache_key_t cache_key = {0};
+    if (use_cache) {
+        cache_key = cache_key_make(job->type, &batch->lz_options, src);
+        compressed = cache_lookup(batch->cache, cache_key, src.num, arena);
+        job->cached = (compressed.data != 0);
+    }
+
+    if (strcmp(job->type, "lz") == 0) {
+        if (!compressed.data) {
+            lz_parse_result_t lz = lz_parse(src, &batch->lz_options, arena, scratch);
+
+            // Serialise straight into the output file
+            dest_mapping = file_map_binary_for_output(job->output, lz_get_serialised_size(&lz));
+            compressed = dest_mapping.contents.data ?
+                lz_serialise_in_place(&lz, dest_mapping.contents) :
+                lz_serialise(&lz, arena);
+        }
+
+        if (batch->verify) {
+            byte_array_span_t expanded = byte_array_span_make(src.num, &scratch);
+            if (!lz_decompress(compressed, expanded) || memcmp(src.data, expanded.data, src.num) != 0) {
+                error = "verify failed";
+            }
+        }
+    }
+    else if (strcmp(job->type, "huffman") == 0) {
+        if (!compressed.data) {
+            compressed = huffman_serialise(src, arena, scratch);
+        }
+
+        if (batch->verify) {
+            byte_array_view_t expanded = huffman_deserialise(compressed, arena, scratch);
+            if (expanded.num != src.num || memcmp(src.data, expanded.data, src.num) != 0) {
+                error = "verify failed";
+            }
+        }
+    }
+    else if (strcmp(job->type, "auto") == 0) {
+        // Each method's output is verified as part of choosing between them
+        if (!compressed.data) {
+            compressed = method_choose(src, &batch->lz_options, arena, scratch).compressed;
+        }
+        if (!compressed.data) {
+            error = "verify failed";
+        }
+    }
+    else {
+        error = "unknown type";
+    }
+
+    // The input isn't needed any more, which matters if the output overwrites it
+    file_unmap(&src_mapping);
+
+    if (!error && use_cache && !job->cached) {
+        cache_store(batch->cache, cache_key, src.num, compressed, scratch);
+    }
+
+    if (!error) {
+        job->output_size = compressed.num;
+        if (!dest_mapping.contents.data && file_write_binary(job->output, compressed).type != file_error_none) {
+            error = "can't write output";
+        }
+    }
+
+    file_unmap(&dest_mapping);
+    return error;
+}
+
+
+static void batch_job(void *context, uint32_t j, uint32_t worker) {
+    batch_t *batch = context;
+    batch_job_t *job = batch_job_array_span_at(batch->jobs, j);
+
+    arena_t *arena = &batch->arenas[worker];
+    arena_t *scratch = &batch->scratches[worker];
+    if (!arena->base) {
+        *arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, batch->huge_pages);
+        *scratch = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, batch->huge_pages);
+    }
+    arena_reset(arena);
+
+    double start = get_time_ms();
+    job->error = batch_compress(batch, job, arena, *scratch);
+    job->time_ms = get_time_ms() - start;
+}
+
+
+bool batch_run(const char *manifest_filename, const char *results_filename, const batch_options_t *options) {
+    assert(manifest_filename);
+    assert(options);
+
+    arena_t arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, false);
+
+    file_read_result_t manifest = file_read_binary(manifest_filename, &arena);
+    if (manifest.error.type != file_error_none) {
+        fprintf(stderr, "Error reading manifest '%s'\n", manifest_filename);
+        arena_deinit(&arena);
+        return false;
+    }
+
+    // Make a terminated copy of the manifest to split into fields
+    char *text = arena_calloc(&arena, manifest.contents.num + 1);
+    memcpy(text, manifest.contents.data, manifest.contents.num);
+
+    batch_job_array_t jobs = batch_job_array_make(64, &arena);
+    if (!batch_parse_manifest(text, manifest_filename, &jobs, &arena)) {
+        arena_deinit(&arena);
+        return false;
+    }
+
+    FILE *results = results_filename ? fopen(results_filename, "w") : stdout;
+    if (!results) {
+        fprintf(stderr, "Error writing file '%s'\n", results_filename);
+        arena_deinit(&arena);
+        return false;
+    }
+
+    // Run as many jobs at once as there are threads.
+    // If there are more threads than jobs, the spare ones help with each job's parse instead.
+    uint32_t num_threads = min_uint32(max_uint32(options->lz_options.num_threads, 1), THREAD_POOL_MAX_THREADS);
+    batch_t batch = {
+        .jobs = jobs.span,
+        .lz_options = options->lz_options,
+        .verify = options->verify,
+        .huge_pages = options->huge_pages,
+        .cache = options->cache
+    };
+    batch.lz_options.num_threads = max_uint32(num_threads / max_uint32(jobs.num, 1), 1);
+
+    double start = get_time_ms();
+    thread_pool_run(num_threads, jobs.num, batch_job, &batch);
+    double time_ms = get_time_ms() - start;
+
+    if (options->cache) {
+        cache_evict(options->cache, arena);
+    }
+
+    uint32_t num_failed = 0;
+    uint64_t total_input_size = 0;
+    uint64_t total_output_size = 0;
+    fprintf(results, "# type input output result input_size output_size time_ms\n");
+    for (uint32_t j = 0; j < jobs.num; j++) {
+        const batch_job_t *job = batch_job_array_at(&jobs, j);
+        if (job->error) {
+            fprintf(results, "%s %s %s error %s\n", job->type, job->input, job->output, job->error);
+            num_failed++;
+        }
+        else {
+            fprintf(results, "%s %s %s %s %u %u %.1f\n",
+                job->type,
+                job->input,
+                job->output,
+                job->cached ? "cached" : "ok",
+                job->input_size,
+                job->output_size,
+                job->time_ms
+            );
+            total_input_size += job->input_size;
+            total_output_size += job->output_size;
+        }
+    }
+    fprintf(results, "# %u jobs, %u failed, %llu -> %llu bytes, %.1fms on %u threads\n",
+        jobs.num,
+        num_failed,
+        (unsigned long long)total_input_size,
+        (unsigned long long)total_output_size,
+        time_ms,
+        num_threads
+    );
+
+    if (results != stdout) {
+        fclose(results);
+    }
+
+    for (uint32_t w = 0; w < THREAD_POOL_MAX_THREADS; w++) {
+        if (batch.arenas[w].base) {
+            arena_deinit(&batch.scratches[w]);
+            arena_deinit(&batch.arenas[w]);
+        }
+    }
+    arena_deinit(&arena);
+
+    return num_failed == 0;
+}
+
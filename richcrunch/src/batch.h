@@ -0,0 +1,36 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "cache.h"
+#include "lz.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Batch mode: compress all the files listed in a manifest in one process.
+//
+// Each line of the manifest is a job, of the form:
+//     <type> <input> <output>
+// where type is 'lz', 'huffman' or 'auto', as on the command line. Blank lines and lines starting with '#' are ignored.
+// Filenames can't contain spaces.
+//
+// The jobs are shared between the threads, each taking the next job as soon as it finishes the last, and each
+// with its own arenas which are reused from one job to the next.
+// A line is written to the results for each job, in manifest order, giving its sizes and time, or why it failed.
+// Jobs whose output was found in the cache are marked 'cached' rather than 'ok'.
+
+typedef struct batch_options_t {
+    lz_options_t lz_options;    // num_threads is the number of jobs to run at once
+    bool verify;                // check that each job's output decompresses to its input
+    bool huge_pages;            // ask for transparent huge pages for the arenas
+    const cache_t *cache;       // where to look for and store outputs, or null for none
+} batch_options_t;
+
+
+// Run the jobs in the manifest, writing the results to the given file, or stdout if it's null.
+// Returns true if every job succeeded.
+bool batch_run(const char *manifest_filename, const char *results_filename, const batch_options_t *options);
+
+
+#endif // ifndef BATCH_H_
+
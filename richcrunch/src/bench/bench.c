@@ -0,0 +1,494 @@
+#include "arena.h"
+#include "byte_array.h"
+#include "file.h"
+#include "huffman.h"
+#include "lz.h"
+#include "refs.h"
+#include "utils.h"
+#include "version.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Benchmark each stage of compression over a corpus of typical inputs, reporting the results as JSON.
+//
+// The corpus is a set of synthetic inputs, made the same way on every run, plus any real files given on the
+// command line (by default titlescreen.bin and test_0.bin, as found in the test directory).
+// Each stage is run once with arena stats attached to find its peak memory use, and then timed over a number of
+// iterations, keeping the best and the mean. Speeds are given in MB of uncompressed data per second.
+// The lz parse is timed from refs made beforehand, so that it doesn't count the time to make them again; the
+// lz_parse_from_src stage times the two together, as lz_parse runs them. Each lz level is timed in the same way as the
+// lz_parse stage, alongside the size of its output.
+
+
+typedef struct bench_input_t {
+    const char *name;
+    const char *kind;           // 'synthetic' or 'file'
+    byte_array_view_t data;
+} bench_input_t;
+
+#define TEMPLATE_ARRAY_NAME bench_input_array
+#define TEMPLATE_ARRAY_TYPE bench_input_t
+#include "array.template.h"
+
+
+typedef enum bench_stage_t {
+    bench_stage_refs_make,
+    bench_stage_lz_parse,
+    bench_stage_lz_parse_all_lengths,
+    bench_stage_lz_parse_from_src,
+    bench_stage_lz_serialise,
+    bench_stage_lz_deserialise,
+    bench_stage_huffman_serialise,
+    bench_stage_huffman_deserialise,
+    bench_stage_count
+} bench_stage_t;
+
+static const char *bench_stage_names[bench_stage_count] = {
+    "refs_make",
+    "lz_parse",
+    "lz_parse_all_lengths",
+    "lz_parse_from_src",
+    "lz_serialise",
+    "lz_deserialise",
+    "huffman_serialise",
+    "huffman_deserialise"
+};
+
+
+// The lz parsers, in order of level as given on the command line
+static const lz_parser_t bench_levels[] = {lz_parser_greedy, lz_parser_lazy, lz_parser_optimal};
+static const char *bench_level_names[] = {"greedy", "lazy", "optimal"};
+#define BENCH_NUM_LEVELS 3
+
+
+// What each stage works from, made once for each input, outside the timings
+typedef struct bench_prepared_t {
+    byte_array_view_t src;
+    refs_t refs;
+    lz_parse_result_t lz;
+    byte_array_view_t lz_compressed;
+    byte_array_view_t huffman_compressed;
+} bench_prepared_t;
+
+
+typedef struct bench_result_t {
+    double best_ms;
+    double mean_ms;
+    uint32_t peak_arena_bytes;  // the most of the arena and scratch in use at once
+} bench_result_t;
+
+
+// A simple generator, so that the synthetic inputs are the same on every run
+static uint32_t bench_random(uint32_t *seed) {
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+
+// A screen dump in the layout of a 10K BBC Micro screen: 32 rows of 40 character cells, each 8 bytes.
+// A border and a few areas of repeated tiles on a mostly blank background, as in a typical title screen.
+static byte_array_view_t bench_make_screen(arena_t *arena) {
+    uint32_t seed = 1;
+    uint8_t tiles[16][8];
+    for (uint32_t t = 0; t < 16; t++) {
+        for (uint32_t b = 0; b < 8; b++) {
+            tiles[t][b] = (t == 0) ? 0 : (uint8_t)bench_random(&seed);
+        }
+    }
+
+    byte_array_span_t screen = byte_array_span_make(32 * 40 * 8, arena);
+    for (uint32_t row = 0; row < 32; row++) {
+        for (uint32_t col = 0; col < 40; col++) {
+            uint32_t tile = 0;
+            if (row == 0 || row == 31 || col == 0 || col == 39) {
+                tile = 1;
+            }
+            else if (row >= 4 && row < 10 && col >= 6 && col < 34) {
+                tile = 2 + (col + row) % 4;     // a logo
+            }
+            else if (row == 20 && col >= 10 && col < 30) {
+                tile = 6 + bench_random(&seed) % 10;    // a line of text
+            }
+            memcpy(screen.data + (row * 40 + col) * 8, tiles[tile], 8);
+        }
+    }
+    return screen.view;
+}
+
+
+// Something like assembled 6502 code: common instructions, operands from a small set of variables and labels,
+// and some sequences repeated from earlier, as with macros and unrolled loops
+static byte_array_view_t bench_make_6502(arena_t *arena) {
+    static const uint8_t opcodes[][2] = {
+        {0xA9, 2}, {0xA5, 2}, {0xAD, 3}, {0xBD, 3}, {0xB1, 2}, {0x85, 2}, {0x8D, 3}, {0x9D, 3},
+        {0x91, 2}, {0xA2, 2}, {0xA0, 2}, {0xE8, 1}, {0xC8, 1}, {0xCA, 1}, {0x88, 1}, {0x18, 1},
+        {0x38, 1}, {0x69, 2}, {0x65, 2}, {0xE9, 2}, {0xC9, 2}, {0xD0, 2}, {0xF0, 2}, {0x90, 2},
+        {0xB0, 2}, {0x20, 3}, {0x4C, 3}, {0x60, 1}, {0x48, 1}, {0x68, 1}, {0xAA, 1}, {0x8A, 1}
+    };
+    uint32_t num_opcodes = sizeof opcodes / sizeof *opcodes;
+
+    uint32_t seed = 2;
+    uint32_t size = 8192;
+    byte_array_span_t code = byte_array_span_make(size, arena);
+    uint32_t i = 0;
+    while (i < size) {
+        if (i > 64 && bench_random(&seed) % 8 == 0) {
+            // Repeat an earlier sequence
+            uint32_t length = min_uint32(6 + bench_random(&seed) % 16, size - i);
+            uint32_t from = bench_random(&seed) % (i - length);
+            memmove(code.data + i, code.data + from, length);
+            i += length;
+            continue;
+        }
+
+        const uint8_t *opcode = opcodes[bench_random(&seed) % num_opcodes];
+        code.data[i++] = opcode[0];
+        if (opcode[1] == 2 && i < size) {
+            // Zero page variables, immediate values and short branches are mostly small
+            code.data[i++] = (uint8_t)(0x70 + bench_random(&seed) % 32);
+        }
+        else if (opcode[1] == 3 && i + 1 < size) {
+            // Absolute addresses are labels in the code, or OS calls
+            uint32_t address = (bench_random(&seed) % 4 == 0) ?
+                0xFFE0 + bench_random(&seed) % 32 :
+                0x1900 + (bench_random(&seed) % 128) * 24;
+            code.data[i++] = (uint8_t)address;
+            code.data[i++] = (uint8_t)(address >> 8);
+        }
+    }
+    return code.view;
+}
+
+
+// Lookup tables of the kind kept alongside 6502 code: sine, quarter squares for multiplication, screen row addresses,
+// a multiplication table and reciprocals
+static byte_array_view_t bench_make_tables(arena_t *arena) {
+    byte_array_t tables = byte_array_make(2304, arena);
+
+    for (uint32_t i = 0; i < 256; i++) {
+        // Bhaskara's approximation of sine, for each half of the wave
+        int32_t degrees = (int32_t)(i * 360 / 256) % 180;
+        int32_t product = degrees * (180 - degrees);
+        int32_t sine = 127 * 4 * product / (40500 - product);
+        byte_array_add(&tables, (uint8_t)(128 + ((i < 128) ? sine : -sine)), arena);
+    }
+    for (uint32_t i = 0; i < 512; i++) {
+        byte_array_add(&tables, (uint8_t)(i * i / 4), arena);
+    }
+    for (uint32_t i = 0; i < 512; i++) {
+        byte_array_add(&tables, (uint8_t)((i * i / 4) >> 8), arena);
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        byte_array_add(&tables, (uint8_t)(0x3000 + (i / 8) * 640 + i % 8), arena);
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        byte_array_add(&tables, (uint8_t)((0x3000 + (i / 8) * 640 + i % 8) >> 8), arena);
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        byte_array_add(&tables, (uint8_t)((i >> 4) * (i & 15)), arena);
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        byte_array_add(&tables, (uint8_t)(65535 / (i + 1) >> 8), arena);
+    }
+    return tables.view;
+}
+
+
+// Data which doesn't compress, as the worst case
+static byte_array_view_t bench_make_noise(arena_t *arena) {
+    uint32_t seed = 3;
+    byte_array_span_t noise = byte_array_span_make(4096, arena);
+    for (uint32_t i = 0; i < noise.num; i++) {
+        noise.data[i] = (uint8_t)bench_random(&seed);
+    }
+    return noise.view;
+}
+
+
+// The refs options lz_parse would use
+static refs_options_t bench_get_refs_options(const lz_options_t *options) {
+    return (refs_options_t) {
+        .finder = options->finder,
+        .num_threads = options->num_threads,
+        .prune = options->prune
+    };
+}
+
+
+static void bench_run_stage(bench_stage_t stage, const bench_prepared_t *prepared, const lz_options_t *options, arena_t *arena, arena_t scratch) {
+    switch (stage) {
+        case bench_stage_refs_make: {
+            refs_options_t refs_options = bench_get_refs_options(options);
+            refs_make(prepared->src, &refs_options, arena, scratch);
+            break;
+        }
+        case bench_stage_lz_parse:
+            lz_parse_refs(&prepared->refs, options, arena, scratch);
+            break;
+        case bench_stage_lz_parse_all_lengths: {
+            // Every length of each ref, rather than the best in each length cost bucket, for comparison with lz_parse
+            lz_options_t all_lengths_options = *options;
+            all_lengths_options.all_lengths = true;
+            lz_parse_refs(&prepared->refs, &all_lengths_options, arena, scratch);
+            break;
+        }
+        case bench_stage_lz_parse_from_src:
+            lz_parse(prepared->src, options, arena, scratch);
+            break;
+        case bench_stage_lz_serialise:
+            lz_serialise(&prepared->lz, arena);
+            break;
+        case bench_stage_lz_deserialise:
+            lz_deserialise(prepared->lz_compressed, arena);
+            break;
+        case bench_stage_huffman_serialise:
+            huffman_serialise(prepared->src, arena, scratch);
+            break;
+        case bench_stage_huffman_deserialise:
+            huffman_deserialise(prepared->huffman_compressed, arena, scratch);
+            break;
+        default:
+            break;
+    }
+}
+
+
+static bench_result_t bench_stage(bench_stage_t stage, const bench_prepared_t *prepared, const lz_options_t *options, uint32_t num_iterations, arena_t *arena, arena_t *scratch) {
+    bench_result_t result = {0};
+
+    // Find the peak memory use in a run of its own, so that the stats don't slow the timed runs
+    arena_stats_t arena_stats;
+    arena_stats_t scratch_stats;
+    arena_reset(arena);
+    arena_attach_stats(arena, &arena_stats, "arena");
+    arena_attach_stats(scratch, &scratch_stats, "scratch");
+    bench_run_stage(stage, prepared, options, arena, *scratch);
+    result.peak_arena_bytes = arena_stats_get_high_water(&arena_stats) + arena_stats_get_high_water(&scratch_stats);
+    arena_stats_deinit(&arena_stats);
+    arena_stats_deinit(&scratch_stats);
+    arena_detach_stats(arena);
+    arena_detach_stats(scratch);
+
+    double total_ms = 0.0;
+    for (uint32_t n = 0; n < num_iterations; n++) {
+        arena_reset(arena);
+        double start = get_time_ms();
+        bench_run_stage(stage, prepared, options, arena, *scratch);
+        double time_ms = get_time_ms() - start;
+        total_ms += time_ms;
+        if (n == 0 || time_ms < result.best_ms) {
+            result.best_ms = time_ms;
+        }
+    }
+    result.mean_ms = total_ms / num_iterations;
+    return result;
+}
+
+
+static void bench_write_string(FILE *file, const char *s) {
+    fputc('"', file);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(file, "\\%c", *s);
+        }
+        else if ((unsigned char)*s < 0x20) {
+            fprintf(file, "\\u%04x", (unsigned char)*s);
+        }
+        else {
+            fputc(*s, file);
+        }
+    }
+    fputc('"', file);
+}
+
+
+static void bench_input(FILE *file, const bench_input_t *input, const lz_options_t *options, uint32_t num_iterations, arena_t *keep, arena_t *arena, arena_t *scratch) {
+    // Make what the later stages need from the earlier ones, once only
+    arena_reset(keep);
+    refs_options_t refs_options = bench_get_refs_options(options);
+    bench_prepared_t prepared = {.src = input->data};
+    prepared.refs = refs_make(input->data, &refs_options, keep, *scratch);
+    prepared.lz = lz_parse_refs(&prepared.refs, options, keep, *scratch);
+    prepared.lz_compressed = lz_serialise(&prepared.lz, keep);
+    prepared.huffman_compressed = huffman_serialise(input->data, keep, *scratch);
+
+    fprintf(file, "    {\n      \"name\": ");
+    bench_write_string(file, input->name);
+    fprintf(file, ",\n      \"kind\": \"%s\",\n", input->kind);
+    fprintf(file, "      \"size\": %u,\n", input->data.num);
+    fprintf(file, "      \"lz_size\": %u,\n", prepared.lz_compressed.num);
+    fprintf(file, "      \"lz_ratio\": %.4f,\n", (double)prepared.lz_compressed.num / input->data.num);
+    fprintf(file, "      \"huffman_size\": %u,\n", prepared.huffman_compressed.num);
+    fprintf(file, "      \"huffman_ratio\": %.4f,\n", (double)prepared.huffman_compressed.num / input->data.num);
+    fprintf(file, "      \"stages\": {\n");
+
+    for (uint32_t s = 0; s < bench_stage_count; s++) {
+        bench_result_t result = bench_stage((bench_stage_t)s, &prepared, options, num_iterations, arena, scratch);
+        double mb_per_s = (result.best_ms > 0.0) ? input->data.num / (result.best_ms * 1000.0) : 0.0;
+        fprintf(file, "        \"%s\": {\"best_ms\": %.4f, \"mean_ms\": %.4f, \"mb_per_s\": %.3f, \"peak_arena_bytes\": %u}%s\n",
+            bench_stage_names[s],
+            result.best_ms,
+            result.mean_ms,
+            mb_per_s,
+            result.peak_arena_bytes,
+            (s + 1 < bench_stage_count) ? "," : ""
+        );
+    }
+
+    fprintf(file, "      },\n      \"levels\": [\n");
+
+    for (uint32_t l = 0; l < BENCH_NUM_LEVELS; l++) {
+        lz_options_t level_options = *options;
+        level_options.parser = bench_levels[l];
+
+        arena_reset(arena);
+        lz_parse_result_t lz = lz_parse_refs(&prepared.refs, &level_options, arena, *scratch);
+        uint32_t lz_size = lz_get_serialised_size(&lz);
+
+        bench_result_t result = bench_stage(bench_stage_lz_parse, &prepared, &level_options, num_iterations, arena, scratch);
+        double mb_per_s = (result.best_ms > 0.0) ? input->data.num / (result.best_ms * 1000.0) : 0.0;
+        fprintf(file, "        {\"level\": %u, \"parser\": \"%s\", \"lz_size\": %u, \"lz_ratio\": %.4f, \"best_ms\": %.4f, \"mean_ms\": %.4f, \"mb_per_s\": %.3f}%s\n",
+            l,
+            bench_level_names[l],
+            lz_size,
+            (double)lz_size / input->data.num,
+            result.best_ms,
+            result.mean_ms,
+            mb_per_s,
+            (l + 1 < BENCH_NUM_LEVELS) ? "," : ""
+        );
+    }
+
+    fprintf(file, "      ]\n    }");
+}
+
+
+static void display_help(void) {
+    puts("Usage: richcrunch_bench [OPTIONS]... [<file>]...");
+    puts("Time each stage of compression over a synthetic corpus and the given files, reporting the results as JSON.");
+    puts("With no files, titlescreen.bin and test_0.bin are used if they are in the current directory.");
+    puts("");
+    puts("Possible options:");
+    puts("  -o <file>        Write the results to <file> rather than stdout");
+    puts("  --iterations N   Time each stage over N runs (default: 5)");
+    puts("  --threads N      Use up to N threads");
+    puts("  -finder <f>      Match finder to use for lz: 'pairs' (default) or 'sa' (suffix array)");
+    puts("  --prune          Drop match candidates which a longer one can replace at the same cost");
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *output_filename = 0;
+    uint32_t num_iterations = 5;
+    lz_options_t options = {0};
+
+    arena_t keep = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, false);
+    arena_t arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, false);
+    arena_t scratch = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, false);
+    arena_t corpus_arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, false);
+
+    bench_input_array_t inputs = bench_input_array_make(16, &corpus_arena);
+    bench_input_array_add(&inputs, (bench_input_t) {"screen", "synthetic", bench_make_screen(&corpus_arena)}, &corpus_arena);
+    bench_input_array_add(&inputs, (bench_input_t) {"6502", "synthetic", bench_make_6502(&corpus_arena)}, &corpus_arena);
+    bench_input_array_add(&inputs, (bench_input_t) {"tables", "synthetic", bench_make_tables(&corpus_arena)}, &corpus_arena);
+    bench_input_array_add(&inputs, (bench_input_t) {"noise", "synthetic", bench_make_noise(&corpus_arena)}, &corpus_arena);
+
+    bool any_files = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            display_help();
+            return 0;
+        }
+        else if (strcmp(argv[i], "-o") == 0) {
+            if (++i < argc) {
+                output_filename = argv[i];
+            }
+            else {
+                fprintf(stderr, "Missing output filename (-o <filename>)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--iterations") == 0) {
+            if (++i < argc && atoi(argv[i]) > 0) {
+                num_iterations = (uint32_t)atoi(argv[i]);
+            }
+            else {
+                fprintf(stderr, "Missing or invalid iteration count (--iterations N)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0) {
+            if (++i < argc && atoi(argv[i]) > 0) {
+                options.num_threads = (uint32_t)atoi(argv[i]);
+            }
+            else {
+                fprintf(stderr, "Missing or invalid thread count (--threads N)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--prune") == 0) {
+            options.prune = true;
+        }
+        else if (strcmp(argv[i], "-finder") == 0) {
+            if (++i < argc && strcmp(argv[i], "pairs") == 0) {
+                options.finder = refs_finder_pairs;
+            }
+            else if (i < argc && strcmp(argv[i], "sa") == 0) {
+                options.finder = refs_finder_suffix_array;
+            }
+            else {
+                fprintf(stderr, "Missing or unknown match finder (-finder pairs|sa)\n");
+                return 1;
+            }
+        }
+        else {
+            file_read_result_t file = file_read_binary(argv[i], &corpus_arena);
+            if (file.error.type != file_error_none || file.contents.num == 0) {
+                fprintf(stderr, "Error reading file '%s'\n", argv[i]);
+                return 1;
+            }
+            bench_input_array_add(&inputs, (bench_input_t) {argv[i], "file", file.contents}, &corpus_arena);
+            any_files = true;
+        }
+    }
+
+    if (!any_files) {
+        const char *default_files[] = {"titlescreen.bin", "test_0.bin"};
+        for (uint32_t f = 0; f < sizeof default_files / sizeof *default_files; f++) {
+            file_read_result_t file = file_read_binary(default_files[f], &corpus_arena);
+            if (file.error.type == file_error_none && file.contents.num > 0) {
+                bench_input_array_add(&inputs, (bench_input_t) {default_files[f], "file", file.contents}, &corpus_arena);
+            }
+        }
+    }
+
+    FILE *file = output_filename ? fopen(output_filename, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Error writing file '%s'\n", output_filename);
+        return 1;
+    }
+
+    fprintf(file, "{\n  \"version\": \"%s\",\n", VERSION);
+    fprintf(file, "  \"threads\": %u,\n", max_uint32(options.num_threads, 1));
+    fprintf(file, "  \"iterations\": %u,\n", num_iterations);
+    fprintf(file, "  \"inputs\": [\n");
+    for (uint32_t i = 0; i < inputs.num; i++) {
+        bench_input(file, bench_input_array_at(&inputs, i), &options, num_iterations, &keep, &arena, &scratch);
+        fprintf(file, "%s\n", (i + 1 < inputs.num) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    if (file != stdout) {
+        fclose(file);
+    }
+
+    arena_deinit(&corpus_arena);
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+    arena_deinit(&keep);
+
+    return 0;
+}
@@ -74,7 +74,7 @@ uint16_t bitreader_get_huffman_code(bitreader_t *bitreader, huffman_decoder_t hu
     uint16_t base = 0;
     for (uint32_t i = 0; i < huffman.num_codes_of_length.num; i++) {
         index = (index << 1) | bitreader_get_bit(bitreader);
-        uint8_t num = uint8_array_view_get(huffman.num_codes_of_length, i);
+        uint16_t num = uint16_array_view_get(huffman.num_codes_of_length, i);
         if (index < num) {
             return uint16_array_view_get(huffman.dictionary, base + index);
         }
@@ -0,0 +1,23 @@
+#include "bitreader64.h"
+
+
+bitreader64_t bitreader64_make(byte_array_view_t data) {
+    assert(data.data);
+    return (bitreader64_t) {
+        .data = data,
+        .buffer = 0,
+        .num_bits = 0,
+        .index = 0
+    };
+}
+
+
+void bitreader64_refill_slow(bitreader64_t *bitreader) {
+    assert(bitreader);
+    while (bitreader->num_bits <= 56) {
+        uint64_t byte = (bitreader->index < bitreader->data.num) ? bitreader->data.data[bitreader->index] : 0;
+        bitreader->buffer |= reverse_bits_uint64(byte) >> bitreader->num_bits;
+        bitreader->index++;
+        bitreader->num_bits += 8;
+    }
+}
@@ -0,0 +1,157 @@
+#ifndef BITREADER64_H_
+#define BITREADER64_H_
+
+#include "byte_array.h"
+#include "huffman.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// A faster bitreader for host-side decoding.
+//
+// It reads the same stream as bitreader_t, but keeps up to 64 bits buffered, refilling them a word at a time.
+// The buffer holds the next bit to be read in its most significant bit, so values can be taken from the top
+// with a single shift.
+// Reading beyond the end of the data returns zero bits.
+
+typedef struct bitreader64_t {
+    byte_array_view_t data;
+    uint64_t buffer;        // the next bits to be read, from the top down; the unused bits are zero
+    uint32_t num_bits;      // the number of bits in the buffer
+    uint32_t index;         // the index of the next byte to be loaded into the buffer
+} bitreader64_t;
+
+
+// Make a new bitreader
+bitreader64_t bitreader64_make(byte_array_view_t data);
+
+// Top up the buffer a byte at a time, when there's not a whole word left to load
+void bitreader64_refill_slow(bitreader64_t *bitreader);
+
+
+// Top up the buffer so that it holds at least 56 bits.
+// The reads only call this when they need more bits than the buffer has.
+static inline void bitreader64_refill(bitreader64_t *bitreader) {
+    assert(bitreader);
+    if (bitreader->num_bits > 56) {
+        return;
+    }
+
+    if (bitreader->index + 8 > bitreader->data.num) {
+        bitreader64_refill_slow(bitreader);
+        return;
+    }
+
+    // Bits are read from the bottom of each byte first, so a little-endian word with its bits reversed has them
+    // in the order they are read.
+    // We load as many whole bytes as fit; the part of the next byte which also gets added is added again, identically,
+    // by the next refill.
+    const uint8_t *p = bitreader->data.data + bitreader->index;
+    uint64_t word = 0;
+    for (uint32_t i = 0; i < 8; i++) {
+        word |= (uint64_t)p[i] << (i * 8);
+    }
+    bitreader->buffer |= reverse_bits_uint64(word) >> bitreader->num_bits;
+
+    uint32_t num_bytes = (63 - bitreader->num_bits) / 8;
+    bitreader->index += num_bytes;
+    bitreader->num_bits += num_bytes * 8;
+}
+
+
+// Discard the given number of bits from the buffer
+static inline void bitreader64_consume(bitreader64_t *bitreader, uint32_t numbits) {
+    assert(bitreader);
+    assert(numbits <= bitreader->num_bits && numbits < 64);
+    bitreader->buffer <<= numbits;
+    bitreader->num_bits -= numbits;
+}
+
+
+// Read a value of up to 32 bits from the stream, most significant bit first
+static inline uint32_t bitreader64_get_value(bitreader64_t *bitreader, uint32_t numbits) {
+    assert(bitreader);
+    assert(numbits <= 32);
+    if (numbits == 0) {
+        return 0;
+    }
+    if (bitreader->num_bits < numbits) {
+        bitreader64_refill(bitreader);
+    }
+    uint32_t value = (uint32_t)(bitreader->buffer >> (64 - numbits));
+    bitreader64_consume(bitreader, numbits);
+    return value;
+}
+
+
+// Read an elias gamma value from the stream.
+// As with bitreader_t, the result is truncated to 8 bits, so that 256 is read as 0.
+static inline uint8_t bitreader64_get_elias_gamma_value(bitreader64_t *bitreader) {
+    assert(bitreader);
+    if (bitreader->num_bits < 17) {
+        bitreader64_refill(bitreader);
+    }
+
+    // The value has as many bits after its leading 1 as there are zeros before it, so it can be read all at once.
+    // If the code runs beyond the bits in the buffer, top it up and look again.
+    // A valid code has no more than 8 zeros; more than this means the data is corrupt, so just make sure we stay
+    // within the 56 bits a refill guarantees.
+    uint32_t num_zeros = bitreader->buffer ? get_leading_zeros_uint64(bitreader->buffer) : 64;
+    if (num_zeros * 2 + 1 > bitreader->num_bits) {
+        bitreader64_refill(bitreader);
+        num_zeros = bitreader->buffer ? min_uint32(get_leading_zeros_uint64(bitreader->buffer), 27) : 27;
+    }
+    uint32_t numbits = num_zeros * 2 + 1;
+    uint8_t value = (uint8_t)(bitreader->buffer >> (64 - numbits));
+    bitreader64_consume(bitreader, numbits);
+    return value;
+}
+
+
+// Read a hybrid (fixed+elias) value from the stream
+static inline uint16_t bitreader64_get_hybrid_value(bitreader64_t *bitreader, uint32_t fixed_bits) {
+    assert(bitreader);
+    uint16_t value = (bitreader64_get_elias_gamma_value(bitreader) - 1) & 0xFF;
+    return (uint16_t)((value << fixed_bits) | bitreader64_get_value(bitreader, fixed_bits));
+}
+
+
+// Returns true if more bits have been read than there are in the data, i.e. some of them were padding
+static inline bool bitreader64_is_overrun(const bitreader64_t *bitreader) {
+    assert(bitreader);
+    return (uint64_t)bitreader->index * 8 - bitreader->num_bits > (uint64_t)bitreader->data.num * 8;
+}
+
+
+// Read a huffman coded value from the stream
+static inline uint16_t bitreader64_get_huffman_code(bitreader64_t *bitreader, const huffman_table_t *table) {
+    assert(bitreader);
+    assert(table);
+
+    // Codes are no longer than 15 bits
+    if (bitreader->num_bits < 15) {
+        bitreader64_refill(bitreader);
+    }
+
+    huffman_table_entry_t entry = huffman_table_entry_array_view_get(
+        table->entries,
+        (uint32_t)(bitreader->buffer >> (64 - table->num_bits))
+    );
+
+    if (entry.num_subtable_bits) {
+        // The code is longer than the primary table index, so look the rest up in the subtable
+        bitreader64_consume(bitreader, table->num_bits);
+        entry = huffman_table_entry_array_view_get(
+            table->entries,
+            entry.value + (uint32_t)(bitreader->buffer >> (64 - entry.num_subtable_bits))
+        );
+    }
+
+    bitreader64_consume(bitreader, entry.length);
+    return entry.value;
+}
+
+
+#endif // ifndef BITREADER64_H_
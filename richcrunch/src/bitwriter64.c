@@ -0,0 +1,62 @@
+#include "bitwriter64.h"
+#include "stats.h"
+
+
+bitwriter64_t bitwriter64_make(uint32_t initial_capacity, arena_t *arena) {
+    assert(arena);
+    return (bitwriter64_t) {
+        .data = byte_array_make(initial_capacity, arena),
+        .buffer = 0,
+        .num_bits = 0
+    };
+}
+
+
+bitwriter64_t bitwriter64_make_in_place(byte_array_span_t dest) {
+    assert(dest.data);
+    return (bitwriter64_t) {
+        .data = {
+            .data = dest.data,
+            .num = 0,
+            .capacity = dest.num
+        },
+        .buffer = 0,
+        .num_bits = 0
+    };
+}
+
+
+byte_array_view_t bitwriter64_flush(bitwriter64_t *bitwriter, arena_t *arena) {
+    assert(bitwriter);
+    assert(bitwriter->data.data);
+    STATS_ADD(stats_counter_bits_written, (uint64_t)bitwriter->data.num * 8 + bitwriter->num_bits);
+    uint64_t reversed = reverse_bits_uint64(bitwriter->buffer);
+    for (uint32_t i = 0; i < (bitwriter->num_bits + 7) / 8; i++) {
+        byte_array_add(&bitwriter->data, (uint8_t)(reversed >> (i * 8)), arena);
+    }
+    bitwriter->buffer = 0;
+    bitwriter->num_bits = 0;
+    return bitwriter->data.view;
+}
+
+
+bitwriter64_code_array_view_t bitwriter64_make_huffman_codes(uint16_array_view_t huffman_codes, arena_t *arena) {
+    assert(arena);
+    assert(huffman_codes.data);
+
+    // The canonical codes have an extra set bit above the code, to give the length.
+    // Unused symbols have no code, and are left with a length of zero.
+    bitwriter64_code_array_span_t codes = bitwriter64_code_array_span_make(huffman_codes.num, arena);
+    for (uint32_t i = 0; i < huffman_codes.num; i++) {
+        uint16_t huffman_code = uint16_array_view_get(huffman_codes, i);
+        if (huffman_code != 0) {
+            uint32_t length = get_bit_width(huffman_code) - 1;
+            bitwriter64_code_array_span_set(
+                codes,
+                i,
+                (bitwriter64_code_t) {.bits = huffman_code & ((1U << length) - 1), .length = length}
+            );
+        }
+    }
+    return codes.view;
+}
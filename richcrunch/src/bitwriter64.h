@@ -0,0 +1,105 @@
+#ifndef BITWRITER64_H_
+#define BITWRITER64_H_
+
+#include "arena.h"
+#include "byte_array.h"
+#include "uint16_array.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdint.h>
+
+
+// A faster bitwriter, producing exactly the same stream as bitwriter_t.
+//
+// Bits are gathered in a 64-bit accumulator, with the first bit written at the top, and flushed to the
+// data four bytes at a time. Call bitwriter64_flush at the end to write out the last partial bytes.
+
+typedef struct bitwriter64_t {
+    byte_array_t data;
+    uint64_t buffer;        // the bits waiting to be flushed, from the top down; the unused bits are zero
+    uint32_t num_bits;      // the number of bits in the buffer
+} bitwriter64_t;
+
+
+// A precomputed code: the bits to write, most significant first, and how many of them there are
+typedef struct bitwriter64_code_t {
+    uint32_t bits;
+    uint32_t length;
+} bitwriter64_code_t;
+
+#define TEMPLATE_ARRAY_NAME bitwriter64_code_array
+#define TEMPLATE_ARRAY_TYPE bitwriter64_code_t
+#include "array.template.h"
+
+
+// Make a new bitwriter
+bitwriter64_t bitwriter64_make(uint32_t initial_capacity, arena_t *arena);
+
+// Make a bitwriter which writes straight into the given memory, such as a mapped output file.
+// It must be big enough for the whole stream, and then no arena is needed: pass null to the other functions.
+bitwriter64_t bitwriter64_make_in_place(byte_array_span_t dest);
+
+// Write out any bits remaining in the accumulator, padding the last byte with zeros, and return the stream
+byte_array_view_t bitwriter64_flush(bitwriter64_t *bitwriter, arena_t *arena);
+
+// Make (code, length) pairs from a canonical huffman encoding, as returned by huffman_get_canonical_encoding
+bitwriter64_code_array_view_t bitwriter64_make_huffman_codes(uint16_array_view_t huffman_codes, arena_t *arena);
+
+
+// Add a value of up to 32 bits to the stream, most significant bit first
+static inline void bitwriter64_add_value(bitwriter64_t *bitwriter, uint32_t value, uint32_t numbits, arena_t *arena) {
+    assert(bitwriter);
+    assert(bitwriter->data.data);
+    assert(numbits <= 32);
+    if (numbits == 0) {
+        return;
+    }
+
+    if (bitwriter->num_bits + numbits > 64) {
+        // Move the first 32 bits to the data.
+        // Reversing the buffer puts them in the bottom half, with the first bit written at the bottom of the first byte.
+        uint64_t reversed = reverse_bits_uint64(bitwriter->buffer);
+        byte_array_grow(&bitwriter->data, bitwriter->data.num + 4, arena);
+        for (uint32_t i = 0; i < 4; i++) {
+            bitwriter->data.data[bitwriter->data.num++] = (uint8_t)(reversed >> (i * 8));
+        }
+        bitwriter->buffer <<= 32;
+        bitwriter->num_bits -= 32;
+    }
+
+    uint64_t bits = (uint64_t)(value & (0xFFFFFFFFU >> (32 - numbits)));
+    bitwriter->buffer |= bits << (64 - bitwriter->num_bits - numbits);
+    bitwriter->num_bits += numbits;
+}
+
+
+// Add a precomputed code to the stream
+static inline void bitwriter64_add_code(bitwriter64_t *bitwriter, bitwriter64_code_t code, arena_t *arena) {
+    bitwriter64_add_value(bitwriter, code.bits, code.length, arena);
+}
+
+
+// Add an elias gamma value to the stream.
+// The leading zeros are written along with the value, as a single code.
+static inline void bitwriter64_add_elias_gamma_value(bitwriter64_t *bitwriter, uint32_t value, arena_t *arena) {
+    assert(value > 0 && value <= 256);  // 256 will be read as 0
+    bitwriter64_add_value(bitwriter, value, get_elias_gamma_cost(value), arena);
+}
+
+
+// Add a hybrid (fixed+elias) value to the stream
+static inline void bitwriter64_add_hybrid_value(bitwriter64_t *bitwriter, uint32_t value, uint32_t fixed_bits, arena_t *arena) {
+    bitwriter64_add_elias_gamma_value(bitwriter, (value >> fixed_bits) + 1, arena);
+    bitwriter64_add_value(bitwriter, value, fixed_bits, arena);
+}
+
+
+// Add a huffman coded value to the stream, from the codes made by bitwriter64_make_huffman_codes
+static inline void bitwriter64_add_huffman_code(bitwriter64_t *bitwriter, bitwriter64_code_array_view_t huffman_codes, uint32_t value, arena_t *arena) {
+    bitwriter64_code_t code = bitwriter64_code_array_view_get(huffman_codes, value);
+    assert(code.length != 0);
+    bitwriter64_add_code(bitwriter, code, arena);
+}
+
+
+#endif // ifndef BITWRITER64_H_
@@ -0,0 +1,383 @@
+// For the POSIX directory and file time functions under strict C
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "cache.h"
+#include "file.h"
+#include "thread_pool.h"
+#include "version.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#define CACHE_ENABLED
+#define CACHE_SEPARATOR "\\"
+#elif defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#define CACHE_ENABLED
+#define CACHE_SEPARATOR "/"
+#endif
+
+
+// The cache entry format: a magic number, the size of the input and a checksum of the compressed output, all
+// little-endian, then the compressed output
+#define CACHE_ENTRY_MAGIC 0x32434352U   // "RCC2"
+#define CACHE_ENTRY_HEADER_SIZE 16
+#define CACHE_ENTRY_EXTENSION ".rcc"
+
+// Room for the path of a file in the cache directory, temporary ones included
+#define CACHE_MAX_ENTRY_PATH (CACHE_MAX_PATH + 512)
+
+
+// MurmurHash3 (x64, 128-bit), by Austin Appleby, placed in the public domain.
+// It's not cryptographic, but the chance of two different inputs giving the same 128-bit hash by accident is
+// negligible.
+
+static uint64_t rotate_left_uint64(uint64_t x, uint32_t r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t murmur3_mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+
+static uint64_t murmur3_read(const uint8_t *p, uint32_t num) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        value |= (uint64_t)p[i] << (i * 8);
+    }
+    return value;
+}
+
+
+static cache_key_t murmur3_hash(const uint8_t *data, uint32_t num, uint64_t seed) {
+    const uint64_t c1 = 0x87C37B91114253D5ULL;
+    const uint64_t c2 = 0x4CF5AD432745937FULL;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    uint32_t num_blocks = num / 16;
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        uint64_t k1 = murmur3_read(data + i * 16, 8);
+        uint64_t k2 = murmur3_read(data + i * 16 + 8, 8);
+
+        h1 ^= rotate_left_uint64(k1 * c1, 31) * c2;
+        h1 = (rotate_left_uint64(h1, 27) + h2) * 5 + 0x52DCE729;
+        h2 ^= rotate_left_uint64(k2 * c2, 33) * c1;
+        h2 = (rotate_left_uint64(h2, 31) + h1) * 5 + 0x38495AB5;
+    }
+
+    const uint8_t *tail = data + num_blocks * 16;
+    uint32_t num_tail = num & 15;
+    if (num_tail > 8) {
+        h2 ^= rotate_left_uint64(murmur3_read(tail + 8, num_tail - 8) * c2, 33) * c1;
+    }
+    if (num_tail > 0) {
+        h1 ^= rotate_left_uint64(murmur3_read(tail, min_uint32(num_tail, 8)) * c1, 31) * c2;
+    }
+
+    h1 ^= num;
+    h2 ^= num;
+    h1 += h2;
+    h2 += h1;
+    h1 = murmur3_mix(h1);
+    h2 = murmur3_mix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    return (cache_key_t) {{h1, h2}};
+}
+
+
+// Make each directory along the path, returning true if the whole path is then a directory
+static bool cache_make_dirs(char *path) {
+#if defined(CACHE_ENABLED)
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            char separator = *p;
+            *p = 0;
+#if defined(_WIN32)
+            _mkdir(path);
+#else
+            mkdir(path, 0777);
+#endif
+            *p = separator;
+        }
+    }
+
+#if defined(_WIN32)
+    _mkdir(path);
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    mkdir(path, 0777);
+    struct stat dir_stat;
+    return stat(path, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode);
+#endif
+#else
+    return false;
+#endif
+}
+
+
+cache_t cache_make(const char *dir, uint64_t max_size) {
+    cache_t cache = {.max_size = max_size};
+
+    int len = -1;
+    const char *env = 0;
+    if (dir) {
+        len = snprintf(cache.dir, CACHE_MAX_PATH, "%s", dir);
+    }
+    else if ((env = getenv("RICHCRUNCH_CACHE")) && *env) {
+        len = snprintf(cache.dir, CACHE_MAX_PATH, "%s", env);
+    }
+#if defined(_WIN32)
+    else if ((env = getenv("LOCALAPPDATA")) && *env) {
+        len = snprintf(cache.dir, CACHE_MAX_PATH, "%s\\richcrunch", env);
+    }
+#else
+    else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        len = snprintf(cache.dir, CACHE_MAX_PATH, "%s/richcrunch", env);
+    }
+    else if ((env = getenv("HOME")) && *env) {
+        len = snprintf(cache.dir, CACHE_MAX_PATH, "%s/.cache/richcrunch", env);
+    }
+#endif
+
+    // Leave room for an entry's filename after the directory
+    if (len <= 0 || len >= CACHE_MAX_PATH - 64 || !cache_make_dirs(cache.dir)) {
+        cache.dir[0] = 0;
+    }
+    return cache;
+}
+
+
+bool cache_is_enabled(const cache_t *cache) {
+    assert(cache);
+    return cache->dir[0] != 0;
+}
+
+
+cache_key_t cache_key_make(const char *type, const lz_options_t *options, byte_array_view_t src) {
+    assert(type);
+    assert(src.data || src.num == 0);
+
+    // Hash the input on its own, and then hash that together with everything else which affects the output.
+    // The number of threads doesn't change the output, so it isn't part of the key.
+    cache_key_t src_hash = murmur3_hash(src.data, src.num, 0);
+
+    char header[256];
+    bool uses_options = strcmp(type, "huffman") != 0;
+    int len = snprintf(header, sizeof(header), "richcrunch %s %u %s %u %u %d %d %016llx%016llx",
+        VERSION,
+        (uint32_t)OUTPUT_REVISION,
+        type,
+        (uses_options && options) ? (uint32_t)options->finder : 0,
+        (uses_options && options) ? (uint32_t)options->parser : 0,
+        (uses_options && options) ? options->prune : false,
+        (uses_options && options) ? options->all_lengths : false,
+        (unsigned long long)src_hash.hash[0],
+        (unsigned long long)src_hash.hash[1]
+    );
+    assert(len > 0 && len < (int)sizeof(header));
+    return murmur3_hash((const uint8_t *)header, (uint32_t)len, src.num);
+}
+
+
+// The checksum of an entry's output, to catch entries which were damaged after they were written
+static uint64_t cache_get_checksum(byte_array_view_t compressed) {
+    return murmur3_hash(compressed.data, compressed.num, CACHE_ENTRY_MAGIC).hash[0];
+}
+
+
+static void cache_get_entry_path(const cache_t *cache, cache_key_t key, char *path) {
+    snprintf(path, CACHE_MAX_ENTRY_PATH, "%s" CACHE_SEPARATOR "%016llx%016llx" CACHE_ENTRY_EXTENSION,
+        cache->dir,
+        (unsigned long long)key.hash[0],
+        (unsigned long long)key.hash[1]
+    );
+}
+
+
+byte_array_view_t cache_lookup(const cache_t *cache, cache_key_t key, uint32_t src_size, arena_t *arena) {
+    assert(cache);
+    assert(arena);
+    if (!cache_is_enabled(cache)) {
+        return (byte_array_view_t) {0};
+    }
+
+    char path[CACHE_MAX_ENTRY_PATH];
+    cache_get_entry_path(cache, key, path);
+    file_read_result_t entry = file_read_binary(path, arena);
+    if (entry.error.type != file_error_none ||
+        entry.contents.num < CACHE_ENTRY_HEADER_SIZE ||
+        murmur3_read(entry.contents.data, 4) != CACHE_ENTRY_MAGIC ||
+        murmur3_read(entry.contents.data + 4, 4) != src_size) {
+        return (byte_array_view_t) {0};
+    }
+
+    byte_array_view_t compressed = byte_array_view_make_subview(entry.contents, CACHE_ENTRY_HEADER_SIZE, entry.contents.num);
+    if (murmur3_read(entry.contents.data + 8, 8) != cache_get_checksum(compressed)) {
+        // It would only fail again, so make way for a good one
+        remove(path);
+        return (byte_array_view_t) {0};
+    }
+
+    // Mark the entry as recently used, so that it's the last to be evicted
+#if defined(CACHE_ENABLED) && defined(_WIN32)
+    _utime(path, 0);
+#elif defined(CACHE_ENABLED)
+    utime(path, 0);
+#endif
+
+    return compressed;
+}
+
+
+void cache_store(const cache_t *cache, cache_key_t key, uint32_t src_size, byte_array_view_t compressed, arena_t scratch) {
+    assert(cache);
+    assert(compressed.data);
+    if (!cache_is_enabled(cache)) {
+        return;
+    }
+
+    byte_array_span_t entry = byte_array_span_make(CACHE_ENTRY_HEADER_SIZE + compressed.num, &scratch);
+    uint64_t checksum = cache_get_checksum(compressed);
+    for (uint32_t i = 0; i < 4; i++) {
+        entry.data[i] = (uint8_t)(CACHE_ENTRY_MAGIC >> (i * 8));
+        entry.data[i + 4] = (uint8_t)(src_size >> (i * 8));
+    }
+    for (uint32_t i = 0; i < 8; i++) {
+        entry.data[i + 8] = (uint8_t)(checksum >> (i * 8));
+    }
+    memcpy(entry.data + CACHE_ENTRY_HEADER_SIZE, compressed.data, compressed.num);
+
+    // Write to a file which no other thread or process will be using, and then move it into place in one go
+    static thread_atomic_uint32_t counter = {0};
+    char path[CACHE_MAX_ENTRY_PATH];
+    char temp_path[CACHE_MAX_ENTRY_PATH + 32];
+    cache_get_entry_path(cache, key, path);
+#if defined(CACHE_ENABLED) && defined(_WIN32)
+    int pid = _getpid();
+#elif defined(CACHE_ENABLED)
+    int pid = (int)getpid();
+#else
+    int pid = 0;
+#endif
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.%u.tmp", path, pid, thread_atomic_add_uint32(&counter, 1));
+
+    if (file_write_binary(temp_path, entry.view).type != file_error_none || rename(temp_path, path) != 0) {
+        // Another run may have stored the same entry first
+        remove(temp_path);
+    }
+}
+
+
+typedef struct cache_entry_t {
+    char name[40];
+    uint64_t size;
+    int64_t time;
+} cache_entry_t;
+
+#define TEMPLATE_ARRAY_NAME cache_entry_array
+#define TEMPLATE_ARRAY_TYPE cache_entry_t
+#include "array.template.h"
+
+
+static bool cache_entry_compare_time(const cache_entry_t *a, const cache_entry_t *b) {
+    return a->time < b->time;
+}
+
+#define TEMPLATE_SORT_NAME cache_entry
+#define TEMPLATE_SORT_LESS_FN cache_entry_compare_time
+#include "sort.template.h"
+
+
+// Add an entry to the list if its name is that of a cache entry
+static void cache_add_entry(cache_entry_array_t *entries, const char *name, uint64_t size, int64_t time, arena_t *arena) {
+    size_t len = strlen(name);
+    size_t extension_len = strlen(CACHE_ENTRY_EXTENSION);
+    if (len == 32 + extension_len && strcmp(name + 32, CACHE_ENTRY_EXTENSION) == 0) {
+        cache_entry_t entry = {.size = size, .time = time};
+        memcpy(entry.name, name, len + 1);
+        cache_entry_array_add(entries, entry, arena);
+    }
+}
+
+
+void cache_evict(const cache_t *cache, arena_t scratch) {
+    assert(cache);
+    if (!cache_is_enabled(cache)) {
+        return;
+    }
+
+    // List the entries with their sizes and when they were last used
+    cache_entry_array_t entries = cache_entry_array_make(256, &scratch);
+    char path[CACHE_MAX_ENTRY_PATH];
+
+#if defined(CACHE_ENABLED) && defined(_WIN32)
+    snprintf(path, sizeof(path), "%s\\*" CACHE_ENTRY_EXTENSION, cache->dir);
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA(path, &find_data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            cache_add_entry(
+                &entries,
+                find_data.cFileName,
+                ((uint64_t)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow,
+                (int64_t)(((uint64_t)find_data.ftLastWriteTime.dwHighDateTime << 32) | find_data.ftLastWriteTime.dwLowDateTime),
+                &scratch
+            );
+        }
+        while (FindNextFileA(find, &find_data));
+        FindClose(find);
+    }
+#elif defined(CACHE_ENABLED)
+    DIR *dir = opendir(cache->dir);
+    if (dir) {
+        struct dirent *dir_entry;
+        while ((dir_entry = readdir(dir))) {
+            struct stat entry_stat;
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, dir_entry->d_name);
+            if (stat(path, &entry_stat) == 0 && S_ISREG(entry_stat.st_mode)) {
+                cache_add_entry(&entries, dir_entry->d_name, (uint64_t)entry_stat.st_size, (int64_t)entry_stat.st_mtime, &scratch);
+            }
+        }
+        closedir(dir);
+    }
+#endif
+
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < entries.num; i++) {
+        total_size += cache_entry_array_at(&entries, i)->size;
+    }
+
+    // Remove the oldest first
+    sort_cache_entry(entries.span);
+    for (uint32_t i = 0; i < entries.num && total_size > cache->max_size; i++) {
+        const cache_entry_t *entry = cache_entry_array_at(&entries, i);
+        snprintf(path, sizeof(path), "%s" CACHE_SEPARATOR "%s", cache->dir, entry->name);
+        if (remove(path) == 0) {
+            total_size -= entry->size;
+        }
+    }
+}
+
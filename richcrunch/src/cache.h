@@ -0,0 +1,59 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "arena.h"
+#include "byte_array.h"
+#include "lz.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// An on-disk cache of compressed outputs, so that unchanged inputs needn't be compressed again.
+//
+// Entries are keyed by a hash of the input, the compression type, the options which affect the output, and the
+// tool version and output revision. Each is a file in the cache directory named after its key, and is written to a
+// temporary file first and then renamed, so that concurrent runs never see a partial entry. Each entry holds a
+// checksum of its output, and one which doesn't match is treated as a miss.
+// A hit marks the entry as recently used; cache_evict then removes the least recently used entries until
+// the cache fits in its maximum size.
+
+#define CACHE_DEFAULT_MAX_SIZE (256U << 20)
+#define CACHE_MAX_PATH 1024
+
+
+typedef struct cache_t {
+    char dir[CACHE_MAX_PATH];   // empty if the cache is disabled
+    uint64_t max_size;
+} cache_t;
+
+
+typedef struct cache_key_t {
+    uint64_t hash[2];
+} cache_key_t;
+
+
+// Make a cache in the given directory, creating it if need be.
+// If dir is null, the default is used: $RICHCRUNCH_CACHE if set, otherwise a 'richcrunch' directory in the user's
+// cache directory. If no directory can be made, the cache is disabled and all lookups miss.
+cache_t cache_make(const char *dir, uint64_t max_size);
+
+// Returns true if the cache is enabled
+bool cache_is_enabled(const cache_t *cache);
+
+// Make the key for compressing the given input with the given type and options.
+// options may be null, and are ignored for types which don't use them.
+cache_key_t cache_key_make(const char *type, const lz_options_t *options, byte_array_view_t src);
+
+// Look up the compressed output for a key, reading it into the arena.
+// Returns a view with null data on a miss.
+byte_array_view_t cache_lookup(const cache_t *cache, cache_key_t key, uint32_t src_size, arena_t *arena);
+
+// Store the compressed output for a key
+void cache_store(const cache_t *cache, cache_key_t key, uint32_t src_size, byte_array_view_t compressed, arena_t scratch);
+
+// Remove the least recently used entries until the cache fits in its maximum size
+void cache_evict(const cache_t *cache, arena_t scratch);
+
+
+#endif // ifndef CACHE_H_
+
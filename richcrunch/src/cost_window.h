@@ -0,0 +1,56 @@
+#ifndef COST_WINDOW_H_
+#define COST_WINDOW_H_
+
+#include "utils.h"
+#include <stdint.h>
+
+
+// Finds the minimum cost over a range of positions, for the optimal parse.
+//
+// The parse sweeps backwards through the source, and a ref at position i can reach positions i+2...i+256.
+// Within each Elias gamma bucket of lengths the length cost is constant, so only the reachable position with the
+// lowest onward cost can win. This keeps a sparse table of minimums over the most recent 256 positions, so that
+// the minimum over any range of them is found with two lookups.
+//
+// Only the cost is kept. On the rare occasions that it gives a better parse, the caller can search the range
+// for the position it came from.
+
+#define COST_WINDOW_SIZE 256
+#define COST_WINDOW_NUM_LEVELS 8
+
+// The buckets below this are so short that it's cheaper for the parse to try their lengths directly
+#define COST_WINDOW_MIN_BUCKET 2
+#define COST_WINDOW_MIN_LENGTH_MINUS_ONE (1U << COST_WINDOW_MIN_BUCKET)
+
+
+typedef struct cost_window_t {
+    uint32_t costs[COST_WINDOW_NUM_LEVELS][COST_WINDOW_SIZE];
+} cost_window_t;
+
+
+// Add the cost at the given position. Positions must be pushed in decreasing order.
+static inline void cost_window_push(cost_window_t *window, uint32_t index, uint32_t cost) {
+    uint32_t slot = index % COST_WINDOW_SIZE;
+    window->costs[0][slot] = cost;
+
+    // Entries which would extend beyond the first pushed position are left stale, but are never read
+    for (uint32_t k = 1; k < COST_WINDOW_NUM_LEVELS; k++) {
+        uint32_t other = window->costs[k - 1][(slot + (1U << (k - 1))) % COST_WINDOW_SIZE];
+        window->costs[k][slot] = min_uint32(cost, other);
+        cost = window->costs[k][slot];
+    }
+}
+
+
+// Get the lowest cost over the inclusive range of positions [first, last].
+// The range must lie within the most recent COST_WINDOW_SIZE positions pushed.
+static inline uint32_t cost_window_get_min(const cost_window_t *window, uint32_t first, uint32_t last) {
+    uint32_t level = get_bit_width(last - first + 1) - 1;
+    return min_uint32(
+        window->costs[level][first % COST_WINDOW_SIZE],
+        window->costs[level][(last + 1 - (1U << level)) % COST_WINDOW_SIZE]
+    );
+}
+
+
+#endif // ifndef COST_WINDOW_H_
@@ -1,6 +1,24 @@
+// For mmap and ftruncate under strict C
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "file.h"
 #include <stdio.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define FILE_MAPPING_ENABLED
+#elif defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FILE_MAPPING_ENABLED
+#endif
+
 
 file_read_result_t file_read_binary(const char *filename, arena_t *arena) {
     assert(filename);
@@ -75,3 +93,173 @@ file_error_t file_write_binary(const char *filename, byte_array_view_t data) {
 
     return (file_error_t) {file_error_none};
 }
+
+
+
+// Map the given size of an open file into memory, returning null if it fails
+#if defined(FILE_MAPPING_ENABLED) && defined(_WIN32)
+static void *file_map_handle(HANDLE file, uint32_t size, bool writable) {
+    HANDLE mapping = CreateFileMappingA(file, 0, writable ? PAGE_READWRITE : PAGE_READONLY, 0, size, 0);
+    if (!mapping) {
+        return 0;
+    }
+
+    // The view keeps the file open until it's unmapped
+    void *ptr = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mapping);
+    return ptr;
+}
+#elif defined(FILE_MAPPING_ENABLED)
+static void *file_map_handle(int fd, uint32_t size, bool writable) {
+    // The mapping keeps the file open until it's unmapped
+    void *ptr = mmap(0, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    return (ptr != MAP_FAILED) ? ptr : 0;
+}
+#endif
+
+
+file_mapping_t file_map_binary(const char *filename) {
+    assert(filename);
+    void *ptr = 0;
+    uint32_t size = 0;
+
+#if defined(FILE_MAPPING_ENABLED) && defined(_WIN32)
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        return (file_mapping_t) {
+            .error = {file_error_not_found}
+        };
+    }
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && file_size.QuadPart <= UINT32_MAX) {
+        size = (uint32_t)file_size.QuadPart;
+        ptr = file_map_handle(file, size, false);
+    }
+    CloseHandle(file);
+#elif defined(FILE_MAPPING_ENABLED)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return (file_mapping_t) {
+            .error = {file_error_not_found}
+        };
+    }
+
+    // Only regular files can be mapped, and a mapping can't be empty
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0 && file_stat.st_size <= UINT32_MAX) {
+        size = (uint32_t)file_stat.st_size;
+        ptr = file_map_handle(fd, size, false);
+    }
+    close(fd);
+#endif
+
+    if (!ptr) {
+        return (file_mapping_t) {
+            .error = {file_error_read}
+        };
+    }
+
+    return (file_mapping_t) {
+        .contents = {
+            .data = ptr,
+            .num = size
+        }
+    };
+}
+
+
+file_mapping_t file_map_binary_for_output(const char *filename, uint32_t size) {
+    assert(filename);
+    void *ptr = 0;
+
+#if defined(FILE_MAPPING_ENABLED) && defined(_WIN32)
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        return (file_mapping_t) {
+            .error = {file_error_write}
+        };
+    }
+
+    // Mapping the file sets its size
+    ptr = (size > 0) ? file_map_handle(file, size, true) : 0;
+    CloseHandle(file);
+#elif defined(FILE_MAPPING_ENABLED)
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return (file_mapping_t) {
+            .error = {file_error_write}
+        };
+    }
+
+    if (size > 0 && ftruncate(fd, size) == 0) {
+        ptr = file_map_handle(fd, size, true);
+    }
+    close(fd);
+#endif
+
+    if (!ptr) {
+        return (file_mapping_t) {
+            .error = {file_error_write}
+        };
+    }
+
+    return (file_mapping_t) {
+        .contents = {
+            .data = ptr,
+            .num = size
+        }
+    };
+}
+
+
+bool file_is_distinct(const char *filename, const char *other_filename) {
+    assert(filename);
+    assert(other_filename);
+
+#if defined(FILE_MAPPING_ENABLED) && defined(_WIN32)
+    // Opening with no access still gives the volume and index of the file, whatever else has it open
+    const char *filenames[2] = {filename, other_filename};
+    BY_HANDLE_FILE_INFORMATION info[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        HANDLE file = CreateFileA(filenames[i], 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+        if (file == INVALID_HANDLE_VALUE) {
+            return GetLastError() == ERROR_FILE_NOT_FOUND;
+        }
+        bool got_info = GetFileInformationByHandle(file, &info[i]);
+        CloseHandle(file);
+        if (!got_info) {
+            return false;
+        }
+    }
+    return info[0].dwVolumeSerialNumber != info[1].dwVolumeSerialNumber ||
+        info[0].nFileIndexHigh != info[1].nFileIndexHigh ||
+        info[0].nFileIndexLow != info[1].nFileIndexLow;
+#elif defined(FILE_MAPPING_ENABLED)
+    struct stat file_stat;
+    struct stat other_stat;
+    if (stat(filename, &file_stat) != 0) {
+        return errno == ENOENT;
+    }
+    if (stat(other_filename, &other_stat) != 0) {
+        return errno == ENOENT;
+    }
+    return file_stat.st_dev != other_stat.st_dev || file_stat.st_ino != other_stat.st_ino;
+#else
+    // Nothing is mapped here, so nothing can be lost
+    return false;
+#endif
+}
+
+
+void file_unmap(file_mapping_t *mapping) {
+    assert(mapping);
+    if (mapping->contents.data) {
+#if defined(FILE_MAPPING_ENABLED) && defined(_WIN32)
+        UnmapViewOfFile(mapping->contents.data);
+#elif defined(FILE_MAPPING_ENABLED)
+        munmap(mapping->contents.data, mapping->contents.num);
+#endif
+    }
+    mapping->contents = (byte_array_span_t) {0};
+}
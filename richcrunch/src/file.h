@@ -1,6 +1,7 @@
 #ifndef FILE_H_
 #define FILE_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "arena.h"
 #include "byte_array.h"
@@ -25,11 +26,36 @@ typedef struct file_read_result_t {
 } file_read_result_t;
 
 
+// A file mapped into memory, so that its contents can be used in place, without copying them
+typedef struct file_mapping_t {
+    byte_array_span_t contents;     // only writable if the file was mapped for output
+    file_error_t error;
+} file_mapping_t;
+
+
 // Read a binary file into a memory buffer allocated from the given arena
 file_read_result_t file_read_binary(const char *filename, arena_t *arena);
 
 // Write a binary file from the given memory buffer
 file_error_t file_write_binary(const char *filename, byte_array_view_t data);
 
+// Map a binary file into memory for reading.
+// Where a file can't be mapped (for example, if it's empty, or mapping isn't supported), this returns an error,
+// and it should be read with file_read_binary instead.
+file_mapping_t file_map_binary(const char *filename);
+
+// Make a binary file of the given size and map it into memory, so that it can be written in place.
+// The file's contents are undefined until they're written.
+file_mapping_t file_map_binary_for_output(const char *filename, uint32_t size);
+
+// Unmap a mapped file, writing back any changes
+void file_unmap(file_mapping_t *mapping);
+
+// Check whether two filenames are known to name different files, going by the files themselves rather than the
+// names, so that links and different spellings of the same path are caught.
+// A filename which doesn't exist yet names a different file to any which does. Returns false if they're the same
+// file, or if it can't tell, in which case a file mapped from one mustn't be assumed to survive writing the other.
+bool file_is_distinct(const char *filename, const char *other_filename);
+
 
 #endif // ifndef FILE_H_
@@ -1,6 +1,7 @@
-#include "bitreader.h"
-#include "bitwriter.h"
+#include "bitreader64.h"
+#include "bitwriter64.h"
 #include "huffman.h"
+#include "stats.h"
 #include <stdbool.h>
 
 
@@ -163,7 +164,7 @@ uint8_array_view_t huffman_build_code_lengths(uint16_array_view_t symbol_counts,
     assert(arena);
     assert(symbol_counts.data);
 
-    // @todo: handle edge cases, e.g. zero or one symbols
+    // @todo: handle the edge case of zero symbols
     assert(symbol_counts.num > 1);
 
     // Create an array for holding the huffman tree
@@ -175,14 +176,20 @@ uint8_array_view_t huffman_build_code_lengths(uint16_array_view_t symbol_counts,
     // num_leafs is the number of symbols which are actually used (i.e. have non-zero count)
     uint32_t num_leafs = huffman_get_sorted_frequencies(symbol_counts, &tree);
 
-    // Now build the rest of the tree from the leaf nodes
-    huffman_build_tree(&tree);
-
-    // We now have a fully built tree, with its root node at tree.num-1.
-    // Now traverse the tree, getting the bit lengths of the symbols in the leaf nodes.
-    // We index this lengths array by symbol frequency order (as per the index in the tree)
+    // A lone symbol would be the root of the tree, with no code at all, so give it a one bit code.
+    // Otherwise, build the rest of the tree from the leaf nodes.
     uint8_array_span_t lengths = uint8_array_span_make(num_leafs, &scratch);
-    huffman_walk_tree(tree.view, lengths, tree.num - 1, 0);
+    if (num_leafs == 1) {
+        uint8_array_span_set(lengths, 0, 1);
+    }
+    else {
+        huffman_build_tree(&tree);
+
+        // We now have a fully built tree, with its root node at tree.num-1.
+        // Now traverse the tree, getting the bit lengths of the symbols in the leaf nodes.
+        // We index this lengths array by symbol frequency order (as per the index in the tree)
+        huffman_walk_tree(tree.view, lengths, tree.num - 1, 0);
+    }
 
     // If we have specified a max code length, apply length limiting
     if (max_code_length == 0) {
@@ -232,13 +239,32 @@ uint16_array_view_t huffman_get_canonical_encoding(uint8_array_view_t code_lengt
 }
 
 
+bool huffman_code_lengths_are_valid(uint8_array_view_t code_lengths) {
+    assert(code_lengths.data);
+
+    // Each code of length n takes up 2^(15-n) of the 2^15 codes of the longest length (the Kraft inequality)
+    uint32_t code_space = 0;
+    for (uint32_t i = 0; i < code_lengths.num; i++) {
+        uint32_t length = uint8_array_view_get(code_lengths, i);
+        if (length > 15) {
+            return false;
+        }
+        if (length > 0) {
+            code_space += 1U << (15 - length);
+        }
+    }
+    return code_space <= (1U << 15);
+}
+
+
 huffman_decoder_t huffman_decoder_make(uint8_array_view_t code_lengths, arena_t *arena) {
     assert(arena);
     assert(code_lengths.data);
+    assert(huffman_code_lengths_are_valid(code_lengths));
 
     // Count how many codes there are of each bit length
     // and build a dictionary of symbol values ordered by ascending canonical huffman code
-    uint8_array_span_t num_codes_of_length = uint8_array_span_make(16, arena);
+    uint16_array_span_t num_codes_of_length = uint16_array_span_make(16, arena);
     uint16_array_t dictionary = uint16_array_make(code_lengths.num, arena);
 
     uint32_t highest_code_length = 0;
@@ -247,8 +273,7 @@ huffman_decoder_t huffman_decoder_make(uint8_array_view_t code_lengths, arena_t
             uint8_t code_length = uint8_array_view_get(code_lengths, i);
 
             if (code_length == length) {
-                uint8_t *num_codes = uint8_array_span_at(num_codes_of_length, length - 1);
-                assert(*num_codes < 255);
+                uint16_t *num_codes = uint16_array_span_at(num_codes_of_length, length - 1);
                 (*num_codes)++;
                 highest_code_length = max_uint32(highest_code_length, length);
                 uint16_array_add(&dictionary, i, 0);
@@ -257,7 +282,7 @@ huffman_decoder_t huffman_decoder_make(uint8_array_view_t code_lengths, arena_t
     }
 
     return (huffman_decoder_t) {
-        .num_codes_of_length = (uint8_array_view_t) {
+        .num_codes_of_length = (uint16_array_view_t) {
             .data = num_codes_of_length.data,
             .num = highest_code_length
         },
@@ -266,10 +291,107 @@ huffman_decoder_t huffman_decoder_make(uint8_array_view_t code_lengths, arena_t
 }
 
 
+static void huffman_table_fill(huffman_table_entry_array_span_t entries, uint32_t first, uint32_t num, huffman_table_entry_t entry) {
+    for (uint32_t i = first; i < first + num; i++) {
+        huffman_table_entry_array_span_set(entries, i, entry);
+    }
+}
+
+
+huffman_table_t huffman_table_make(huffman_decoder_t decoder, arena_t *arena) {
+    assert(arena);
+    assert(decoder.num_codes_of_length.data);
+
+    uint32_t highest_code_length = decoder.num_codes_of_length.num;
+    uint32_t num_bits = max_uint32(min_uint32(highest_code_length, HUFFMAN_TABLE_MAX_BITS), 1);
+
+    // Codes longer than the primary table index share an entry for their first num_bits bits, which refers to a
+    // subtable indexed by the rest. Each subtable covers the longest code length, so that the unused parts of the
+    // code space consume the same number of bits as they would with huffman_decoder_t.
+    // First mark which primary entries need a subtable.
+    uint32_t num_subtable_bits = (highest_code_length > num_bits) ? highest_code_length - num_bits : 0;
+    bool has_subtable[1 << HUFFMAN_TABLE_MAX_BITS] = {0};
+    uint32_t code = 0;
+    for (uint32_t length = 1; length <= highest_code_length; length++) {
+        uint32_t num = uint16_array_view_get(decoder.num_codes_of_length, length - 1);
+        for (uint32_t i = 0; i < num; i++, code++) {
+            if (length > num_bits) {
+                has_subtable[code >> (length - num_bits)] = true;
+            }
+        }
+        code <<= 1;
+    }
+
+    uint32_t num_entries = 1U << num_bits;
+    for (uint32_t i = 0; i < (1U << num_bits); i++) {
+        if (has_subtable[i]) {
+            num_entries += 1U << num_subtable_bits;
+        }
+    }
+
+    huffman_table_entry_array_span_t entries = huffman_table_entry_array_span_make(num_entries, arena);
+
+    // Fill everything with invalid entries, and point to the subtables
+    huffman_table_fill(
+        entries,
+        0,
+        num_entries,
+        (huffman_table_entry_t) {.value = 0xFFFF, .length = (uint8_t)num_subtable_bits}
+    );
+
+    uint32_t next_subtable = 1U << num_bits;
+    for (uint32_t i = 0; i < (1U << num_bits); i++) {
+        huffman_table_entry_t entry = {.value = 0xFFFF, .length = (uint8_t)highest_code_length};
+        if (has_subtable[i]) {
+            entry = (huffman_table_entry_t) {.value = (uint16_t)next_subtable, .num_subtable_bits = (uint8_t)num_subtable_bits};
+            next_subtable += 1U << num_subtable_bits;
+        }
+        huffman_table_entry_array_span_set(entries, i, entry);
+    }
+
+    // Now fill in the entries for each code
+    code = 0;
+    uint32_t symbol_index = 0;
+    for (uint32_t length = 1; length <= highest_code_length; length++) {
+        uint32_t num = uint16_array_view_get(decoder.num_codes_of_length, length - 1);
+        for (uint32_t i = 0; i < num; i++, code++) {
+            uint16_t symbol = uint16_array_view_get(decoder.dictionary, symbol_index++);
+            if (length <= num_bits) {
+                huffman_table_fill(
+                    entries,
+                    code << (num_bits - length),
+                    1U << (num_bits - length),
+                    (huffman_table_entry_t) {.value = symbol, .length = (uint8_t)length}
+                );
+            }
+            else {
+                uint32_t subtable = huffman_table_entry_array_span_get(entries, code >> (length - num_bits)).value;
+                uint32_t remaining_length = length - num_bits;
+                uint32_t subcode = code & ((1U << remaining_length) - 1);
+                huffman_table_fill(
+                    entries,
+                    subtable + (subcode << (num_subtable_bits - remaining_length)),
+                    1U << (num_subtable_bits - remaining_length),
+                    (huffman_table_entry_t) {.value = symbol, .length = (uint8_t)remaining_length}
+                );
+            }
+        }
+        code <<= 1;
+    }
+
+    return (huffman_table_t) {
+        .entries = entries.view,
+        .num_bits = num_bits
+    };
+}
+
+
 byte_array_view_t huffman_serialise(byte_array_view_t src, arena_t *arena, arena_t scratch) {
     assert(arena);
     assert(src.data);
+    STATS_TIMER_BEGIN(stats_timer_huffman_serialise);
 
+    arena_set_tag(&scratch, "huffman");
     arena_t local = arena_alloc_subarena(&scratch, 0x10000);
 
     // Count source symbols
@@ -287,7 +409,10 @@ byte_array_view_t huffman_serialise(byte_array_view_t src, arena_t *arena, arena
     );
 
     // Get canonical huffman codes
-    uint16_array_view_t huff_codes = huffman_get_canonical_encoding(huff, &local); 
+    bitwriter64_code_array_view_t huff_codes = bitwriter64_make_huffman_codes(
+        huffman_get_canonical_encoding(huff, &local),
+        &local
+    );
 
     // When we serialise, we have to first encode the huffman tree itself, or, in this case,
     // the lengths of the huffman code for each symbol (from which we can deduce the canonical code)
@@ -308,22 +433,25 @@ byte_array_view_t huffman_serialise(byte_array_view_t src, arena_t *arena, arena
     );
 
     // Get canonical huffman codes for the dictionary
-    uint16_array_view_t huffdict_codes = huffman_get_canonical_encoding(huffdict, &local); 
+    bitwriter64_code_array_view_t huffdict_codes = bitwriter64_make_huffman_codes(
+        huffman_get_canonical_encoding(huffdict, &local),
+        &local
+    );
 
     // Make a bitwriter    
-    bitwriter_t writer = bitwriter_make(src.num, arena);
+    bitwriter64_t writer = bitwriter64_make(src.num, arena);
 
     // Write code lengths of dictionary symbols
     // They are 16 3-bit values (representing code lengths between 0 and 7)
     assert(huffdict.num == 16);
     for (uint32_t i = 0; i < huffdict.num; i++) {
-        bitwriter_add_value(&writer, uint8_array_view_get(huffdict, i), 3, arena);
+        bitwriter64_add_value(&writer, uint8_array_view_get(huffdict, i), 3, arena);
     }
 
     // Write huffman encoded dictionary
     assert(huff.num == 256);
     for (uint32_t i = 0; i < huff.num; i++) {
-        bitwriter_add_huffman_code(
+        bitwriter64_add_huffman_code(
             &writer,
             huffdict_codes,
             uint8_array_view_get(huff, i),
@@ -332,12 +460,12 @@ byte_array_view_t huffman_serialise(byte_array_view_t src, arena_t *arena, arena
     }
 
     // Write length of src data
-    bitwriter_add_value(&writer, src.num & 0xFF, 8, arena);
-    bitwriter_add_value(&writer, src.num >> 8, 8, arena);
+    bitwriter64_add_value(&writer, src.num & 0xFF, 8, arena);
+    bitwriter64_add_value(&writer, src.num >> 8, 8, arena);
 
     // Write huffman encoded data
     for (uint32_t i = 0; i < src.num; i++) {
-        bitwriter_add_huffman_code(
+        bitwriter64_add_huffman_code(
             &writer,
             huff_codes,
             byte_array_view_get(src, i),
@@ -345,54 +473,84 @@ byte_array_view_t huffman_serialise(byte_array_view_t src, arena_t *arena, arena
         );
     }
 
-    return writer.data.view;
+    byte_array_view_t serialised = bitwriter64_flush(&writer, arena);
+    STATS_TIMER_END(stats_timer_huffman_serialise);
+    return serialised;
 }
 
 
 byte_array_view_t huffman_deserialise(byte_array_view_t compressed, arena_t *arena, arena_t scratch) {
     assert(arena);
     assert(compressed.data);
+    STATS_TIMER_BEGIN(stats_timer_huffman_deserialise);
 
+    arena_set_tag(&scratch, "huffman");
     arena_t local = arena_alloc_subarena(&scratch, 0x10000);
 
     // Make bitreader from the compressed data
-    bitreader_t reader = bitreader_make(compressed);
+    bitreader64_t reader = bitreader64_make(compressed);
 
     // Read huffman tree used to compress dictionary
     uint8_t dict_lengths[16];
     for (uint32_t i = 0; i < 16; i++) {
-        dict_lengths[i] = bitreader_get_value(&reader, 3);
+        dict_lengths[i] = (uint8_t)bitreader64_get_value(&reader, 3);
+    }
+
+    // Anything from here on may be corrupt, so check the code lengths before they're used, and every code as it's
+    // read; reading past the end gives zeros, so that's only checked at the end
+    byte_array_view_t result = {0};
+    if (!huffman_code_lengths_are_valid((uint8_array_view_t) VIEW(dict_lengths))) {
+        STATS_TIMER_END(stats_timer_huffman_deserialise);
+        return result;
     }
 
     huffman_decoder_t dict_decoder = huffman_decoder_make(
         (uint8_array_view_t) VIEW(dict_lengths),
         &local
     );
+    huffman_table_t dict_table = huffman_table_make(dict_decoder, &local);
 
     uint8_t lengths[256];
     for (uint32_t i = 0; i < 256; i++) {
-        lengths[i] = bitreader_get_huffman_code(&reader, dict_decoder);
+        uint16_t length = bitreader64_get_huffman_code(&reader, &dict_table);
+        lengths[i] = (uint8_t)min_uint32(length, 0xFF);
+    }
+    if (!huffman_code_lengths_are_valid((uint8_array_view_t) VIEW(lengths))) {
+        STATS_TIMER_END(stats_timer_huffman_deserialise);
+        return result;
     }
 
     huffman_decoder_t decoder = huffman_decoder_make(
         (uint8_array_view_t) VIEW(lengths),
         &local
     );
+    huffman_table_t table = huffman_table_make(decoder, &local);
 
     // Get size to decompress
-    uint8_t sizelo = bitreader_get_value(&reader, 8);
-    uint8_t sizehi = bitreader_get_value(&reader, 8);
+    uint8_t sizelo = (uint8_t)bitreader64_get_value(&reader, 8);
+    uint8_t sizehi = (uint8_t)bitreader64_get_value(&reader, 8);
     uint32_t size = sizelo | (sizehi << 8);
-    byte_array_t result = byte_array_make(size, arena);
+    if (bitreader64_is_overrun(&reader)) {
+        STATS_TIMER_END(stats_timer_huffman_deserialise);
+        return result;
+    }
 
     // Read and expand huffman compressed data
-    for (uint32_t i = 0; i < size; i++) {
-        byte_array_add(
-            &result,
-            bitreader_get_huffman_code(&reader, decoder),
-            arena
-        );
+    arena_checkpoint_t checkpoint = arena_get_checkpoint(arena);
+    byte_array_span_t expanded = byte_array_span_make(size, arena);
+    bool valid = true;
+    for (uint32_t i = 0; i < size && valid; i++) {
+        uint16_t symbol = bitreader64_get_huffman_code(&reader, &table);
+        valid = (symbol <= 0xFF);
+        byte_array_span_set(expanded, i, (uint8_t)symbol);
+    }
+    if (valid && !bitreader64_is_overrun(&reader)) {
+        result = expanded.view;
+    }
+    else {
+        arena_rollback(arena, checkpoint);
     }
 
-    return result.view;
+    STATS_TIMER_END(stats_timer_huffman_deserialise);
+    return result;
 }
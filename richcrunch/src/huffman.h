@@ -5,6 +5,7 @@
 #include "byte_array.h"
 #include "uint16_array.h"
 #include "uint8_array.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 
@@ -23,16 +24,47 @@ uint16_array_view_t huffman_get_canonical_encoding(uint8_array_view_t code_lengt
 // the bounds of the dictionary size given by the number of codes for the current bit length.
 // See bitreader_get_huffman_value() for an example of how this is done.
 typedef struct huffman_decoder_t {
-    uint8_array_view_t num_codes_of_length;
+    uint16_array_view_t num_codes_of_length;
     uint16_array_view_t dictionary;
 } huffman_decoder_t;
 
+// The code lengths must be valid; see huffman_code_lengths_are_valid.
 huffman_decoder_t huffman_decoder_make(uint8_array_view_t code_lengths, arena_t *arena);
 
+// Check that code lengths could make a prefix code: none longer than 15 bits, and no more codes of each length than
+// there's room for
+bool huffman_code_lengths_are_valid(uint8_array_view_t code_lengths);
+
+// A faster way of looking up an alphabet symbol, by indexing a table with the next few bits of the stream.
+// The primary table is indexed by the next num_bits bits. Codes no longer than this have an entry giving the symbol
+// and code length. Longer codes share an entry giving the position of a subtable, which is then indexed by the
+// following num_subtable_bits bits, and gives the symbol and the remaining code length.
+// Bit sequences which aren't a valid code give the symbol 0xFFFF, consuming as many bits as huffman_decoder_t would.
+// See bitreader64_get_huffman_code() for how this is used.
+#define HUFFMAN_TABLE_MAX_BITS 10
+
+typedef struct huffman_table_entry_t {
+    uint16_t value;                 // the symbol, or the index of the subtable
+    uint8_t length;                 // the number of bits to consume
+    uint8_t num_subtable_bits;      // non-zero if this entry refers to a subtable
+} huffman_table_entry_t;
+
+#define TEMPLATE_ARRAY_NAME huffman_table_entry_array
+#define TEMPLATE_ARRAY_TYPE huffman_table_entry_t
+#include "array.template.h"
+
+typedef struct huffman_table_t {
+    huffman_table_entry_array_view_t entries;
+    uint32_t num_bits;
+} huffman_table_t;
+
+huffman_table_t huffman_table_make(huffman_decoder_t decoder, arena_t *arena);
+
 // Serialise a huffman encoded block to a bitstream
 byte_array_view_t huffman_serialise(byte_array_view_t src, arena_t *arena, arena_t scratch);
 
-// Deserialise a huffman encoded block from a bitstream
+// Deserialise a huffman encoded block from a bitstream.
+// The block is checked as it's read, and if it's corrupt, this returns a view with null data.
 byte_array_view_t huffman_deserialise(byte_array_view_t compressed, arena_t *arena, arena_t scratch);
 
 
@@ -1,9 +1,14 @@
-#include "bitreader.h"
-#include "bitwriter.h"
+#include "bitreader64.h"
+#include "bitwriter64.h"
+#include "cost_window.h"
 #include "lz.h"
 #include "refs.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "uint32_array.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 
 static uint32_t get_tally_cost(uint32_t value) {
@@ -20,38 +25,77 @@ static uint32_t get_token_cost(token_t t, uint32_t num_fixed_bits) {
 }
 
 
-lz_parse_result_t lz_parse(byte_array_view_t src, arena_t *arena, arena_t scratch) {
-    assert(arena);
-    assert(src.data);
+// Get the cost of the item at the given index, and the change in tally cost of putting a ref in front of it
+static uint32_t get_onward_ref_cost(const lz_item_t *item) {
+    if (token_is_literal(item->token)) {
+        return item->total_cost + get_tally_cost(1);
+    }
+    uint32_t tally = (item->tally % 256) + 1;
+    return item->total_cost + get_tally_cost(tally) - ((tally != 1) ? get_tally_cost(item->tally) : 0);
+}
 
-    // Reserve a piece of scratch space for holding the refs result
-    arena_t refs_arena = arena_alloc_subarena(&scratch, 0x400000);
-    refs_t refs = refs_make(src, &refs_arena, scratch);
 
-    // Parse the source data with differing numbers of fixed offset bits, and choose the best one at the end
-    lz_item_array_span_t items_array[8] = {0};
+// Perform a backwards sweep through the refs, finding the optimal parse for a given number of fixed offset bits.
+// If a cost window is given, only the best length in each length cost bucket is tried; otherwise all are.
+static void lz_sweep(const refs_t *refs, uint32_t num_fixed_bits, lz_item_array_span_t items, cost_window_t *window) {
+    uint32_t max_offset = 256 << num_fixed_bits;
+    uint32_t num = refs_num(refs);
 
-    for (uint32_t n = 0; n < 8; n++) {
-        uint32_t num_fixed_bits = n + 1;
+    if (window) {
+        cost_window_push(window, num, get_onward_ref_cost(lz_item_array_span_at(items, num)));
+    }
 
-        // Make a list of optimal tokens for each source index
-        // We reserve an extra element which represents the "off the end" element which previous elements can point to
-        lz_item_array_span_t items = lz_item_array_span_make(src.num + 1, &scratch);
-        items_array[n] = items;
+    uint64_t num_tokens = 0;
+    uint64_t num_relaxations = 0;
+    for (uint32_t i = num; i-- > 0;) {
+        lz_item_t *item = lz_item_array_span_at(items, i);
+        item->total_cost = UINT32_MAX;
 
-        uint32_t max_offset = 256 << num_fixed_bits;
+        refs_iterator_t it = refs_get_iterator(refs, i);
 
-        for (uint32_t i = src.num; i-- > 0;) {
-            lz_item_t *item = lz_item_array_span_at(items, i);
-            item->total_cost = UINT32_MAX;
+        // The refs are in order of increasing length and offset, so the lengths of each ref up to the length
+        // of the previous one cost no less, and have already been tried
+        uint32_t shortest_length_minus_one = 1;
 
-            token_array_view_t tokens = refs_get_tokens(&refs, i);
+        token_t token;
+        while (refs_iterator_next(&it, &token)) {
+            num_tokens++;
+            uint32_t longest_length_minus_one = token.length_minus_one;
 
-            for (uint32_t j = 0; j < tokens.num; j++) {
-                token_t token = token_array_view_get(tokens, j);
+            if (token_is_literal(token) || token.offset <= max_offset) {
+                if (window && token.length_minus_one >= COST_WINDOW_MIN_LENGTH_MINUS_ONE) {
+                    // The length cost is the same for every length-1 in [2^k, 2^(k+1)), so just try the best onward
+                    // position in each bucket, longest first.
+                    // The shortest lengths are cheaper to try directly, so we fall through to that afterwards.
+                    uint32_t offset_cost = get_hybrid_cost(token.offset - 1, num_fixed_bits);
+                    for (uint32_t k = get_bit_width(token.length_minus_one); k-- > COST_WINDOW_MIN_BUCKET;) {
+                        uint32_t first = i + max_uint32(1U << k, shortest_length_minus_one) + 1;
+                        uint32_t last = i + min_uint32((2U << k) - 1, token.length_minus_one) + 1;
+                        if (first > last) {
+                            break;
+                        }
+                        uint32_t token_cost = offset_cost + get_elias_gamma_cost(1U << k);
+                        uint32_t cost = token_cost + cost_window_get_min(window, first, last);
+                        num_relaxations++;
 
-                if (token_is_literal(token) || token.offset <= max_offset) {
+                        if (cost < item->total_cost) {
+                            // Find the longest length which gives this cost
+                            uint32_t next_index = last;
+                            while (token_cost + get_onward_ref_cost(lz_item_array_span_at(items, next_index)) != cost) {
+                                next_index--;
+                            }
+                            const lz_item_t *next_item = lz_item_array_span_at(items, next_index);
+                            item->token = token_make_ref(token.offset, (uint8_t)(next_index - i - 1));
+                            item->total_cost = cost;
+                            item->tally = token_is_literal(next_item->token) ? 1 : (next_item->tally % 256) + 1;
+                        }
+                    }
+                    token.length_minus_one = COST_WINDOW_MIN_LENGTH_MINUS_ONE - 1;
+                }
+
+                if (token_is_literal(token) || token.length_minus_one >= shortest_length_minus_one) {
                     do {
+                        num_relaxations++;
                         const lz_item_t *next_item = lz_item_array_span_at(items, i + token_get_length(token));
 
                         uint32_t tally = token_are_same_type(token, next_item->token) ?
@@ -70,35 +114,576 @@ lz_parse_result_t lz_parse(byte_array_view_t src, arena_t *arena, arena_t scratc
                             item->tally = tally;
                         }
                     }
-                    while (token.length_minus_one-- > 1);
+                    while (token.length_minus_one-- > shortest_length_minus_one);
                 }
+
+                shortest_length_minus_one = longest_length_minus_one + 1;
             }
         }
+
+        if (window) {
+            cost_window_push(window, i, get_onward_ref_cost(item));
+        }
     }
 
-    // Find the parse with the lowest cost
+    STATS_ADD(stats_counter_tokens_examined, num_tokens);
+    STATS_ADD(stats_counter_relaxations, num_relaxations);
+}
+
+
+typedef struct lz_sweep_context_t {
+    const refs_t *refs;
+    uint32_t first_n;       // the index of the parse run by job 0
+    lz_item_array_span_t items_array[LZ_MAX_FIXED_BITS];
+    cost_window_t *windows;
+} lz_sweep_context_t;
+
+
+static void lz_sweep_job(void *context, uint32_t n, uint32_t worker) {
+    lz_sweep_context_t *sweep = context;
+    lz_sweep(sweep->refs, sweep->first_n + n + 1, sweep->items_array[n], sweep->windows ? &sweep->windows[n] : 0);
+}
+
+
+// Fused parse implementation
+
+// Rather than sweeping through the refs once for each number of fixed offset bits, we can make a single sweep,
+// keeping the state for all eight side by side, one per "lane". Each token list is then only decoded once.
+// The state read from the next item when relaxing a candidate is packed into a single 64 byte structure-of-arrays,
+// so that all the lanes can be updated together with SIMD instructions.
+// The chosen tokens are only needed for the final walk, so they live in a separate array.
+
+#define LZ_NUM_LANES LZ_MAX_FIXED_BITS
+
+typedef struct lz_lanes_t {
+    uint32_t total_cost[LZ_NUM_LANES];
+    uint16_t tally[LZ_NUM_LANES];
+    uint8_t is_ref[LZ_NUM_LANES];
+    uint8_t join_cost[LZ_NUM_LANES];    // change in tally cost when a token of the same type is put in front
+} lz_lanes_t;
+
+#define TEMPLATE_ARRAY_NAME lz_lanes_array
+#define TEMPLATE_ARRAY_TYPE lz_lanes_t
+#include "array.template.h"
+
+
+typedef struct lz_lane_tokens_t {
+    token_t token[LZ_NUM_LANES];
+} lz_lane_tokens_t;
+
+#define TEMPLATE_ARRAY_NAME lz_lane_tokens_array
+#define TEMPLATE_ARRAY_TYPE lz_lane_tokens_t
+#include "array.template.h"
+
+
+static uint32_t get_join_cost(uint32_t tally) {
+    // A token of the same type put in front of an item extends its block, unless the block is already full,
+    // in which case it starts a new one
+    uint32_t new_tally = (tally % 256) + 1;
+    return get_tally_cost(new_tally) - ((new_tally != 1) ? get_tally_cost(tally) : 0);
+}
+
+
+static uint32_t lz_pack_token(token_t t) {
+    return token_is_literal(t) ? t.value : (t.offset | ((uint32_t)t.length_minus_one << 16));
+}
+
+
+static token_t lz_unpack_token(uint32_t packed) {
+    uint8_t length_minus_one = (uint8_t)(packed >> 16);
+    return length_minus_one ? token_make_ref((uint16_t)packed, length_minus_one) : token_make_literal((uint8_t)packed);
+}
+
+
+// A cost window (see cost_window.h) for all the lanes at once, with the lanes innermost so they can be updated together
+typedef struct lz_lanes_window_t {
+    uint32_t costs[COST_WINDOW_NUM_LEVELS][COST_WINDOW_SIZE][LZ_NUM_LANES];
+} lz_lanes_window_t;
+
+
+// Get the cost of the given lane, plus the change in tally cost of putting a ref in front of it
+static uint32_t get_onward_ref_lane_cost(const lz_lanes_t *lanes, uint32_t w) {
+    return lanes->total_cost[w] + (lanes->is_ref[w] ? lanes->join_cost[w] : get_tally_cost(1));
+}
+
+
+static void lz_lanes_window_push(lz_lanes_window_t *window, uint32_t index, const lz_lanes_t *lanes) {
+    uint32_t slot = index % COST_WINDOW_SIZE;
+    for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+        window->costs[0][slot][w] = get_onward_ref_lane_cost(lanes, w);
+    }
+
+    for (uint32_t k = 1; k < COST_WINDOW_NUM_LEVELS; k++) {
+        const uint32_t *a = window->costs[k - 1][slot];
+        const uint32_t *b = window->costs[k - 1][(slot + (1U << (k - 1))) % COST_WINDOW_SIZE];
+        for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+            window->costs[k][slot][w] = min_uint32(a[w], b[w]);
+        }
+    }
+}
+
+
+// If a window is given, only the best length in each length cost bucket is tried; otherwise all are
+static void lz_fused_sweep(const refs_t *refs, lz_lanes_array_span_t lanes_array, lz_lane_tokens_array_span_t tokens_array, lz_lanes_window_t *window) {
+    uint32_t num = refs_num(refs);
+
+    // The off-the-end sentinel is an empty literal block
+    lz_lanes_t *sentinel = lz_lanes_array_span_at(lanes_array, num);
+    for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+        sentinel->join_cost[w] = (uint8_t)get_join_cost(0);
+    }
+    if (window) {
+        lz_lanes_window_push(window, num, sentinel);
+    }
+
+    uint64_t num_tokens = 0;
+    uint64_t num_relaxations = 0;
+    for (uint32_t i = num; i-- > 0;) {
+        uint32_t best_cost[LZ_NUM_LANES];
+        uint32_t best_tally[LZ_NUM_LANES];
+        uint32_t best_token[LZ_NUM_LANES];
+        for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+            best_cost[w] = UINT32_MAX;
+            best_tally[w] = 0;
+            best_token[w] = 0;
+        }
+
+        refs_iterator_t it = refs_get_iterator(refs, i);
+
+        // The lengths of each ref up to the length of the previous one have already been tried (see lz_sweep)
+        uint32_t shortest_length_minus_one = 1;
+
+        token_t token;
+        while (refs_iterator_next(&it, &token)) {
+            num_tokens++;
+            uint32_t longest_length_minus_one = token.length_minus_one;
+            uint8_t is_ref = !token_is_literal(token);
+
+            // Lane w has num_fixed_bits = w+1, and so can reach offsets up to 512 << w.
+            // Get the first lane this token is valid for, and its offset cost in each lane.
+            uint32_t first_lane = (is_ref && token.offset > 512) ? get_bit_width(token.offset - 1) - 9 : 0;
+            if (first_lane >= LZ_NUM_LANES) {
+                continue;
+            }
+
+            uint32_t offset_cost[LZ_NUM_LANES] = {0};
+            for (uint32_t w = first_lane; w < LZ_NUM_LANES; w++) {
+                offset_cost[w] = is_ref ? get_hybrid_cost(token.offset - 1, w + 1) : 8;
+            }
+
+            if (window && token.length_minus_one >= COST_WINDOW_MIN_LENGTH_MINUS_ONE) {
+                // The length cost is the same for every length-1 in [2^k, 2^(k+1)), so just try the best onward
+                // position in each bucket, longest first.
+                // The shortest lengths are cheaper to try directly, so we fall through to that afterwards.
+                for (uint32_t k = get_bit_width(token.length_minus_one); k-- > COST_WINDOW_MIN_BUCKET;) {
+                    uint32_t first = i + max_uint32(1U << k, shortest_length_minus_one) + 1;
+                    uint32_t last = i + min_uint32((2U << k) - 1, token.length_minus_one) + 1;
+                    if (first > last) {
+                        break;
+                    }
+                    uint32_t length_cost = get_elias_gamma_cost(1U << k);
+                    num_relaxations += LZ_NUM_LANES - first_lane;
+
+                    uint32_t level = get_bit_width(last - first + 1) - 1;
+                    const uint32_t *a = window->costs[level][first % COST_WINDOW_SIZE];
+                    const uint32_t *b = window->costs[level][(last + 1 - (1U << level)) % COST_WINDOW_SIZE];
+
+                    uint32_t cost[LZ_NUM_LANES];
+                    uint32_t better_lanes = 0;
+                    for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+                        cost[w] = offset_cost[w] + length_cost + min_uint32(a[w], b[w]);
+                        better_lanes |= (uint32_t)((w >= first_lane) & (cost[w] < best_cost[w])) << w;
+                    }
+
+                    // Improvements are rare, so now find the longest length which gives the new cost in each lane
+                    while (better_lanes) {
+                        uint32_t w = get_trailing_zeros_uint32(better_lanes);
+                        better_lanes &= better_lanes - 1;
+
+                        uint32_t next_index = last;
+                        while (offset_cost[w] + length_cost + get_onward_ref_lane_cost(lz_lanes_array_span_at(lanes_array, next_index), w) != cost[w]) {
+                            next_index--;
+                        }
+                        const lz_lanes_t *next = lz_lanes_array_span_at(lanes_array, next_index);
+                        best_cost[w] = cost[w];
+                        best_tally[w] = next->is_ref[w] ? (next->tally[w] % 256) + 1 : 1;
+                        best_token[w] = lz_pack_token(token_make_ref(token.offset, (uint8_t)(next_index - i - 1)));
+                    }
+                }
+                token.length_minus_one = COST_WINDOW_MIN_LENGTH_MINUS_ONE - 1;
+            }
+
+            if (token_is_literal(token) || token.length_minus_one >= shortest_length_minus_one) {
+                do {
+                    num_relaxations += LZ_NUM_LANES - first_lane;
+                    const lz_lanes_t *next = lz_lanes_array_span_at(lanes_array, i + token_get_length(token));
+                    uint32_t length_cost = is_ref ? get_elias_gamma_cost(token.length_minus_one) : 0;
+                    uint32_t packed = lz_pack_token(token);
+
+                    for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+                        bool same_type = (next->is_ref[w] == is_ref);
+                        uint32_t cost = offset_cost[w] + length_cost + next->total_cost[w] + (same_type ? next->join_cost[w] : get_tally_cost(1));
+                        uint32_t tally = same_type ? (next->tally[w] % 256) + 1 : 1;
+                        bool is_better = (w >= first_lane) & (cost < best_cost[w]);
+                        best_cost[w] = is_better ? cost : best_cost[w];
+                        best_tally[w] = is_better ? tally : best_tally[w];
+                        best_token[w] = is_better ? packed : best_token[w];
+                    }
+                }
+                while (token.length_minus_one-- > shortest_length_minus_one);
+            }
+
+            shortest_length_minus_one = longest_length_minus_one + 1;
+        }
+
+        lz_lanes_t *lanes = lz_lanes_array_span_at(lanes_array, i);
+        lz_lane_tokens_t *lane_tokens = lz_lane_tokens_array_span_at(tokens_array, i);
+        for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+            token_t token = lz_unpack_token(best_token[w]);
+            lanes->total_cost[w] = best_cost[w];
+            lanes->tally[w] = (uint16_t)best_tally[w];
+            lanes->is_ref[w] = !token_is_literal(token);
+            lanes->join_cost[w] = (uint8_t)get_join_cost(best_tally[w]);
+            lane_tokens->token[w] = token;
+        }
+
+        if (window) {
+            lz_lanes_window_push(window, i, lanes);
+        }
+    }
+
+    STATS_ADD(stats_counter_tokens_examined, num_tokens);
+    STATS_ADD(stats_counter_relaxations, num_relaxations);
+}
+
+
+// Parse on the calling thread, putting the items for the best parse in the given span, and the cost of the best parse
+// for each number of fixed offset bits in costs.
+// Returns the number of fixed offset bits.
+static uint32_t lz_parse_fused(const refs_t *refs, bool all_lengths, lz_item_array_span_t items, uint32_t *costs, arena_t scratch) {
+    uint32_t num = refs_num(refs);
+
+    // We reserve an extra element which represents the "off the end" element which previous elements can point to
+    lz_lanes_array_span_t lanes_array = lz_lanes_array_span_make(num + 1, &scratch);
+    lz_lane_tokens_array_span_t tokens_array = lz_lane_tokens_array_span_make(num + 1, &scratch);
+    lz_lanes_window_t *window = all_lengths ? 0 : arena_alloc(&scratch, sizeof(lz_lanes_window_t));
+    lz_fused_sweep(refs, lanes_array, tokens_array, window);
+
+    // Find the lane with the lowest cost
+    const lz_lanes_t *first = lz_lanes_array_span_at(lanes_array, 0);
+    uint32_t best_lane = 0;
+    for (uint32_t w = 0; w < LZ_NUM_LANES; w++) {
+        costs[w] = first->total_cost[w];
+        if (first->total_cost[w] < first->total_cost[best_lane]) {
+            best_lane = w;
+        }
+    }
+
+    // Fill in the items along the best parse
+    for (uint32_t i = 0; i < num; ) {
+        const lz_lanes_t *lanes = lz_lanes_array_span_at(lanes_array, i);
+        token_t token = lz_lane_tokens_array_span_at(tokens_array, i)->token[best_lane];
+        lz_item_array_span_set(
+            items,
+            i,
+            (lz_item_t) {
+                .token = token,
+                .total_cost = lanes->total_cost[best_lane],
+                .tally = lanes->tally[best_lane]
+            }
+        );
+        i += token_get_length(token);
+    }
+
+    return best_lane + 1;
+}
+
+
+// Parse with the work shared between threads, putting the items for the best parse in the given span, and the cost of
+// the best parse for each number of fixed offset bits in costs.
+// Returns the number of fixed offset bits.
+static uint32_t lz_parse_concurrent(const refs_t *refs, bool all_lengths, uint32_t num_threads, lz_item_array_span_t items, uint32_t *costs, arena_t scratch) {
+    uint32_t num = refs_num(refs);
+    uint32_t batch_size = min_uint32(num_threads, LZ_MAX_FIXED_BITS);
+
+    // Parse the source data with differing numbers of fixed offset bits, and choose the best one.
+    // Each parse only reads the refs and writes its own items, so a batch of them, one per thread, can run concurrently.
+    // Only the batch in progress is kept alongside the best so far: its items are copied out, and the rest released.
+    lz_sweep_context_t context = {
+        .refs = refs,
+        .windows = all_lengths ? 0 : arena_alloc(&scratch, batch_size * sizeof(cost_window_t))
+    };
+
     uint32_t best_cost = UINT32_MAX;
     uint32_t best_n = 0;
-    for (uint32_t n = 0; n < 8; n++) {
-        uint32_t cost = lz_item_array_span_get(items_array[n], 0).total_cost;
-        if (cost < best_cost) {
-            best_cost = cost;
+    for (context.first_n = 0; context.first_n < LZ_MAX_FIXED_BITS; context.first_n += batch_size) {
+        uint32_t num_jobs = min_uint32(batch_size, LZ_MAX_FIXED_BITS - context.first_n);
+        arena_checkpoint_t checkpoint = arena_get_checkpoint(&scratch);
+
+        for (uint32_t n = 0; n < num_jobs; n++) {
+            // Make a list of optimal tokens for each source index
+            // We reserve an extra element which represents the "off the end" element which previous elements can point to
+            context.items_array[n] = lz_item_array_span_make(num + 1, &scratch);
+        }
+
+        thread_pool_run(num_threads, num_jobs, lz_sweep_job, &context);
+
+        // Keep the parse with the lowest cost
+        uint32_t batch_best_n = num_jobs;
+        for (uint32_t n = 0; n < num_jobs; n++) {
+            uint32_t cost = lz_item_array_span_get(context.items_array[n], 0).total_cost;
+            costs[context.first_n + n] = cost;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_n = context.first_n + n;
+                batch_best_n = n;
+            }
+        }
+        if (batch_best_n < num_jobs) {
+            memcpy(items.data, context.items_array[batch_best_n].data, (num + 1) * sizeof(lz_item_t));
+        }
+
+        arena_rollback(&scratch, checkpoint);
+    }
+
+    return best_n + 1;
+}
+
+
+// Greedy and lazy parses
+
+// Rather than trying every token, these take the longest ref at each index, which is much quicker, at some cost to
+// the size of the output. The items are filled in with the same costs and tallies as the optimal parse, so that
+// everything after the parse is the same.
+
+// Get the longest ref at an index whose offset can be written with the given number of fixed bits, or the literal if
+// there's no such ref which takes fewer bits than the literals it replaces
+static token_t lz_get_longest_ref(const refs_t *refs, uint32_t i, uint32_t num_fixed_bits) {
+    uint32_t max_offset = 256U << num_fixed_bits;
+    refs_iterator_t it = refs_get_iterator(refs, i);
+
+    // The literal comes first, then the refs in order of increasing length and offset
+    token_t literal;
+    bool has_literal = refs_iterator_next(&it, &literal);
+    assert(has_literal && token_is_literal(literal));
+
+    token_t longest = literal;
+    token_t token;
+    while (refs_iterator_next(&it, &token) && token.offset <= max_offset) {
+        longest = token;
+    }
+
+    if (!token_is_literal(longest) && get_token_cost(longest, num_fixed_bits) >= token_get_length(longest) * 8) {
+        return literal;
+    }
+    return longest;
+}
+
+
+// Get the literal at an index
+static token_t lz_get_literal(const refs_t *refs, uint32_t i) {
+    refs_iterator_t it = refs_get_iterator(refs, i);
+    token_t literal;
+    bool has_literal = refs_iterator_next(&it, &literal);
+    assert(has_literal && token_is_literal(literal));
+    return literal;
+}
+
+
+// Get the extra tally bits from putting out a token after a run of tokens of the given type and length
+static uint32_t lz_get_tally_change(bool run_is_literal, uint32_t run_length, token_t token) {
+    if (run_length % 256 == 0 || run_is_literal != token_is_literal(token)) {
+        return get_tally_cost(1);
+    }
+    return get_tally_cost(run_length % 256 + 1) - get_tally_cost(run_length % 256);
+}
+
+
+// Choose the tokens from the start for a given number of fixed offset bits, and then fill in their costs and tallies
+// from the end, as the optimal parse does. The starts span gets the index of each token.
+// Returns the cost of the parse.
+static uint32_t lz_greedy_sweep(const refs_t *refs, uint32_t num_fixed_bits, bool lazy, lz_item_array_span_t items, uint32_array_span_t starts) {
+    uint32_t num = refs_num(refs);
+    uint32_t num_starts = 0;
+
+    // The type and length of the run of tokens so far, for the lazy parse's tally costs
+    bool run_is_literal = false;
+    uint32_t run_length = 0;
+
+    for (uint32_t i = 0; i < num;) {
+        token_t token = lz_get_longest_ref(refs, i, num_fixed_bits);
+
+        // Put off the ref for a literal if the longest ref at the next index is longer, or if the literal and that ref
+        // cover the same bytes for fewer bits, counting the changes to the tallies
+        if (lazy && !token_is_literal(token) && i + 1 < num) {
+            token_t next = lz_get_longest_ref(refs, i + 1, num_fixed_bits);
+            if (!token_is_literal(next)) {
+                token_t literal = lz_get_literal(refs, i);
+                uint32_t length = token_get_length(token);
+                uint32_t next_length = token_get_length(next);
+                uint32_t cost =
+                    get_token_cost(token, num_fixed_bits) +
+                    lz_get_tally_change(run_is_literal, run_length, token);
+                uint32_t deferred_cost =
+                    get_token_cost(literal, num_fixed_bits) +
+                    lz_get_tally_change(run_is_literal, run_length, literal) +
+                    get_token_cost(next, num_fixed_bits) +
+                    get_tally_cost(1);
+                if (next_length > length || (next_length + 1 == length && deferred_cost < cost)) {
+                    token = literal;
+                }
+            }
+        }
+
+        if (run_length != 0 && run_is_literal == token_is_literal(token)) {
+            run_length++;
+        } else {
+            run_is_literal = token_is_literal(token);
+            run_length = 1;
+        }
+
+        lz_item_array_span_at(items, i)->token = token;
+        uint32_array_span_set(starts, num_starts++, i);
+        i += token_get_length(token);
+    }
+
+    // The "off the end" element, which the last token points to
+    lz_item_array_span_set(items, num, (lz_item_t) {0});
+
+    for (uint32_t n = num_starts; n-- > 0;) {
+        lz_item_t *item = lz_item_array_span_at(items, uint32_array_span_get(starts, n));
+        const lz_item_t *next_item = item + token_get_length(item->token);
+
+        uint32_t tally = token_are_same_type(item->token, next_item->token) ?
+            (next_item->tally % 256) + 1 :
+            1;
+
+        item->total_cost =
+            get_token_cost(item->token, num_fixed_bits) +
+            get_tally_cost(tally) +
+            next_item->total_cost -
+            ((tally != 1) ? get_tally_cost(next_item->tally) : 0);
+        item->tally = tally;
+    }
+
+    return lz_item_array_span_get(items, 0).total_cost;
+}
+
+
+// Make a greedy or lazy parse for each number of fixed offset bits, putting the items for the cheapest in the given
+// span, and the cost of each in costs.
+// Putting off a ref is decided from the next index alone, so it can still lose to the greedy parse further on; the lazy
+// parse makes both for each number of fixed offset bits, and keeps the cheaper.
+// Returns the number of fixed offset bits.
+static uint32_t lz_parse_greedy(const refs_t *refs, bool lazy, lz_item_array_span_t items, uint32_t *costs, arena_t scratch) {
+    uint32_array_span_t starts = uint32_array_span_make(refs_num(refs), &scratch);
+
+    uint32_t best_n = 0;
+    bool best_is_lazy = false;
+    bool n_is_lazy = false;
+    for (uint32_t n = 0; n < LZ_MAX_FIXED_BITS; n++) {
+        costs[n] = lz_greedy_sweep(refs, n + 1, false, items, starts);
+        n_is_lazy = false;
+        if (lazy) {
+            uint32_t lazy_cost = lz_greedy_sweep(refs, n + 1, true, items, starts);
+            n_is_lazy = lazy_cost < costs[n];
+            costs[n] = n_is_lazy ? lazy_cost : costs[n];
+        }
+        if (n == 0 || costs[n] < costs[best_n]) {
             best_n = n;
+            best_is_lazy = n_is_lazy;
         }
     }
 
-    // Now build the final token stream by walking the token list from the first element
-    lz_item_array_span_t items = items_array[best_n];
-    lz_item_array_t result = lz_item_array_make(src.num, arena);
-    for (uint32_t i = 0; i < src.num; i += token_get_length(lz_item_array_span_get(items, i).token)) {
+    // The items are left with the last parse, so make the cheapest again if it was another
+    if (best_n != LZ_MAX_FIXED_BITS - 1 || best_is_lazy != lazy) {
+        lz_greedy_sweep(refs, best_n + 1, best_is_lazy, items, starts);
+    }
+    return best_n + 1;
+}
+
+
+// Find the tokens for each index of the refs with the chosen parser, returning the number of fixed offset bits they
+// were found with. The cost of the best parse for each number of fixed offset bits goes in costs.
+static uint32_t lz_parse_items(const refs_t *refs, const lz_options_t *options, lz_item_array_span_t items, uint32_t *costs, arena_t scratch) {
+    uint32_t num_threads = options ? options->num_threads : 1;
+    bool all_lengths = options ? options->all_lengths : false;
+    lz_parser_t parser = options ? options->parser : lz_parser_optimal;
+
+    // The greedy and lazy parses are quick enough to run on the calling thread.
+    // Otherwise, on a single thread, the fused optimal parse is the fastest way; on more, share the parses for each
+    // number of fixed offset bits between the threads.
+    STATS_TIMER_BEGIN(stats_timer_lz_sweeps);
+    uint32_t num_fixed_bits =
+        (parser != lz_parser_optimal) ? lz_parse_greedy(refs, parser == lz_parser_lazy, items, costs, scratch) :
+        (num_threads > 1) ? lz_parse_concurrent(refs, all_lengths, num_threads, items, costs, scratch) :
+        lz_parse_fused(refs, all_lengths, items, costs, scratch);
+    STATS_TIMER_END(stats_timer_lz_sweeps);
+    return num_fixed_bits;
+}
+
+
+// Build the final token stream by walking the token list from the first element
+static lz_parse_result_t lz_collect_items(lz_item_array_span_t items, uint32_t num_fixed_bits, const uint32_t *costs, arena_t *arena) {
+    uint32_t num = items.num - 1;
+    lz_item_array_t result = lz_item_array_make(num, arena);
+    for (uint32_t i = 0; i < num; i += token_get_length(lz_item_array_span_get(items, i).token)) {
         lz_item_array_add(&result, lz_item_array_span_get(items, i), arena);
     }
 
-    return (lz_parse_result_t) {
+    lz_parse_result_t lz = {
         .items = result.view,
         .cost = lz_item_array_get(&result, 0).total_cost,
-        .num_fixed_bits = best_n + 1
+        .num_fixed_bits = num_fixed_bits
+    };
+    memcpy(lz.fixed_bits_costs, costs, sizeof(lz.fixed_bits_costs));
+    return lz;
+}
+
+
+lz_parse_result_t lz_parse(byte_array_view_t src, const lz_options_t *options, arena_t *arena, arena_t scratch) {
+    assert(arena);
+    assert(src.data);
+
+    refs_options_t refs_options = {
+        .finder = options ? options->finder : refs_finder_pairs,
+        .num_threads = options ? options->num_threads : 1,
+        .prune = options ? options->prune : false
     };
+
+    // The refs go in the destination arena, as only refs_make knows how big they will be.
+    // They are freed again before the result is added.
+    const char *tag = arena_set_tag(arena, "refs");
+    refs_t refs = refs_make(src, &refs_options, arena, scratch);
+    arena_set_tag(arena, "lz parse");
+    arena_set_tag(&scratch, "lz parse");
+
+    lz_item_array_span_t items = lz_item_array_span_make(src.num + 1, &scratch);
+    uint32_t costs[LZ_MAX_FIXED_BITS];
+    uint32_t num_fixed_bits = lz_parse_items(&refs, options, items, costs, scratch);
+
+    refs_free(&refs, arena);
+
+    lz_parse_result_t result = lz_collect_items(items, num_fixed_bits, costs, arena);
+    arena_set_tag(arena, tag);
+    return result;
+}
+
+
+lz_parse_result_t lz_parse_refs(const refs_t *refs, const lz_options_t *options, arena_t *arena, arena_t scratch) {
+    assert(refs);
+    assert(arena);
+
+    const char *tag = arena_set_tag(arena, "lz parse");
+    arena_set_tag(&scratch, "lz parse");
+
+    lz_item_array_span_t items = lz_item_array_span_make(refs_num(refs) + 1, &scratch);
+    uint32_t costs[LZ_MAX_FIXED_BITS];
+    uint32_t num_fixed_bits = lz_parse_items(refs, options, items, costs, scratch);
+
+    lz_parse_result_t result = lz_collect_items(items, num_fixed_bits, costs, arena);
+    arena_set_tag(arena, tag);
+    return result;
 }
 
 
@@ -158,16 +743,134 @@ void lz_dump(const lz_parse_result_t *lz, const char *filename) {
 }
 
 
-byte_array_view_t lz_serialise(const lz_parse_result_t *lz, arena_t *arena) {
+lz_analysis_t lz_analyse(const lz_parse_result_t *lz) {
     assert(lz);
-    assert(arena);
 
-    uint32_t num_blocks = lz_get_block_count(lz);
-    uint32_t num_bits = lz->cost + get_hybrid_cost(num_blocks, 8) + 4;
-    bitwriter_t writer = bitwriter_make((num_bits + 7) / 8, arena);
+    // This follows the layout written by lz_write
+    lz_analysis_t analysis = {0};
+    analysis.num_blocks = lz_get_block_count(lz);
+    analysis.header_bits = get_hybrid_cost(analysis.num_blocks, 8) + 3;
 
-    bitwriter_add_hybrid_value(&writer, num_blocks, 8, arena);
-    bitwriter_add_value(&writer, lz->num_fixed_bits - 1, 3, arena);
+    uint32_t i = 0;
+    while (i < lz->items.num) {
+        const lz_item_t *item = lz_item_array_view_at(lz->items, i);
+        uint32_t num = item->tally;
+        analysis.tally_bits += get_elias_gamma_cost(num);
+
+        if (token_is_literal(item->token)) {
+            analysis.num_literals += num;
+            analysis.literal_bits += num * 8;
+            i += num;
+        }
+        else {
+            for (uint32_t n = 0; n < num; n++, i++) {
+                item = lz_item_array_view_at(lz->items, i);
+                assert(!token_is_literal(item->token));
+                uint32_t offset = item->token.offset;
+                analysis.offset_prefix_bits += get_elias_gamma_cost(((offset - 1) >> lz->num_fixed_bits) + 1);
+                analysis.offset_fixed_bits += lz->num_fixed_bits;
+                analysis.length_bits += get_elias_gamma_cost(item->token.length_minus_one);
+                analysis.offset_histogram[get_bit_width(offset)]++;
+                analysis.length_histogram[item->token.length_minus_one + 1]++;
+            }
+            analysis.num_refs += num;
+        }
+    }
+
+    return analysis;
+}
+
+
+void lz_dump_analysis(const lz_parse_result_t *lz, const char *filename) {
+    assert(lz);
+
+    FILE *file = 0;
+    if (filename) {
+        file = fopen(filename, "w");
+    }
+    if (!file) {
+        file = stdout;
+    }
+
+    lz_analysis_t analysis = lz_analyse(lz);
+    uint32_t total_bits = analysis.header_bits + lz->cost;
+    assert(total_bits == analysis.header_bits + analysis.tally_bits + analysis.literal_bits +
+        analysis.offset_prefix_bits + analysis.offset_fixed_bits + analysis.length_bits);
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"serialised_size\": %u,\n", lz_get_serialised_size(lz));
+    fprintf(file, "  \"num_fixed_bits\": %u,\n", lz->num_fixed_bits);
+    fprintf(file, "  \"bits\": {\n");
+    fprintf(file, "    \"header\": %u,\n", analysis.header_bits);
+    fprintf(file, "    \"tallies\": %u,\n", analysis.tally_bits);
+    fprintf(file, "    \"literals\": %u,\n", analysis.literal_bits);
+    fprintf(file, "    \"offset_prefixes\": %u,\n", analysis.offset_prefix_bits);
+    fprintf(file, "    \"offset_fixed_bits\": %u,\n", analysis.offset_fixed_bits);
+    fprintf(file, "    \"lengths\": %u,\n", analysis.length_bits);
+    fprintf(file, "    \"total\": %u\n", total_bits);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"counts\": {\"blocks\": %u, \"literals\": %u, \"refs\": %u},\n",
+        analysis.num_blocks, analysis.num_literals, analysis.num_refs);
+
+    // The costs exclude the header, as the block count is only known for the chosen parse
+    fprintf(file, "  \"fixed_bits_costs\": [");
+    for (uint32_t n = 0; n < LZ_MAX_FIXED_BITS; n++) {
+        fprintf(file, "%s\n    {\"num_fixed_bits\": %u, \"bits\": %u, \"chosen\": %s}",
+            (n == 0) ? "" : ",",
+            n + 1,
+            lz->fixed_bits_costs[n],
+            (n + 1 == lz->num_fixed_bits) ? "true" : "false"
+        );
+    }
+    fprintf(file, "\n  ],\n");
+
+    // Offsets are grouped by bit width, and only the buckets which were used are listed
+    fprintf(file, "  \"offset_histogram\": [");
+    const char *separator = "\n";
+    for (uint32_t w = 1; w < 17; w++) {
+        if (analysis.offset_histogram[w] > 0) {
+            fprintf(file, "%s    {\"min\": %u, \"max\": %u, \"count\": %u}",
+                separator,
+                1U << (w - 1),
+                (1U << w) - 1,
+                analysis.offset_histogram[w]
+            );
+            separator = ",\n";
+        }
+    }
+    fprintf(file, "\n  ],\n");
+
+    fprintf(file, "  \"length_histogram\": [");
+    separator = "\n";
+    for (uint32_t length = 2; length < 257; length++) {
+        if (analysis.length_histogram[length] > 0) {
+            fprintf(file, "%s    {\"length\": %u, \"count\": %u}", separator, length, analysis.length_histogram[length]);
+            separator = ",\n";
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    if (file != stdout) {
+        fclose(file);
+    }
+}
+
+
+uint32_t lz_get_serialised_size(const lz_parse_result_t *lz) {
+    assert(lz);
+    // The header is the block count and the number of fixed offset bits; the cost of the parse is all the rest
+    uint32_t num_bits = get_hybrid_cost(lz_get_block_count(lz), 8) + 3 + lz->cost;
+    return (num_bits + 7) / 8;
+}
+
+
+// Write the lz result with the given bitwriter.
+// The arena may be null if the bitwriter already has room for the whole stream.
+static byte_array_view_t lz_write(const lz_parse_result_t *lz, bitwriter64_t *writer, arena_t *arena) {
+    STATS_TIMER_BEGIN(stats_timer_lz_serialise);
+    uint32_t num_blocks = lz_get_block_count(lz);
+    bitwriter64_add_hybrid_value(writer, num_blocks, 8, arena);
+    bitwriter64_add_value(writer, lz->num_fixed_bits - 1, 3, arena);
 
     uint32_t i = 0;
     while (i < lz->items.num) {
@@ -175,60 +878,212 @@ byte_array_view_t lz_serialise(const lz_parse_result_t *lz, arena_t *arena) {
         uint32_t num = item->tally;
 
         // Write number of things in this block
-        bitwriter_add_elias_gamma_value(&writer, num, arena);
+        bitwriter64_add_elias_gamma_value(writer, num, arena);
 
         if (token_is_literal(item->token)) {
             for (uint32_t n = 0; n < num; n++, i++) {
                 item = lz_item_array_view_at(lz->items, i);
                 assert(token_is_literal(item->token));
-                bitwriter_add_value(&writer, item->token.value, 8, arena);
+                bitwriter64_add_value(writer, item->token.value, 8, arena);
             }
         }
         else {
             for (uint32_t n = 0; n < num; n++, i++) {
                 item = lz_item_array_view_at(lz->items, i);
                 assert(!token_is_literal(item->token));
-                bitwriter_add_hybrid_value(&writer, item->token.offset - 1, lz->num_fixed_bits, arena);
-                bitwriter_add_elias_gamma_value(&writer, item->token.length_minus_one, arena);
+                bitwriter64_add_hybrid_value(writer, item->token.offset - 1, lz->num_fixed_bits, arena);
+                bitwriter64_add_elias_gamma_value(writer, item->token.length_minus_one, arena);
             }
         }
     }
 
-    return writer.data.view;
+    byte_array_view_t serialised = bitwriter64_flush(writer, arena);
+    STATS_TIMER_END(stats_timer_lz_serialise);
+    return serialised;
 }
 
 
-byte_array_view_t lz_deserialise(byte_array_view_t compressed, arena_t *arena) {
+byte_array_view_t lz_serialise(const lz_parse_result_t *lz, arena_t *arena) {
+    assert(lz);
     assert(arena);
-    byte_array_t buffer = byte_array_make(0x1000, arena);
-    bitreader_t reader = bitreader_make(compressed);
 
-    uint32_t num_blocks = bitreader_get_hybrid_value(&reader, 8);
-    uint32_t num_fixed_bits = bitreader_get_value(&reader, 3) + 1;
+    uint32_t size = lz_get_serialised_size(lz);
+    bitwriter64_t writer = bitwriter64_make(size, arena);
+    byte_array_view_t serialised = lz_write(lz, &writer, arena);
+    assert(serialised.num == size);
+    return serialised;
+}
+
+
+byte_array_view_t lz_serialise_in_place(const lz_parse_result_t *lz, byte_array_span_t dest) {
+    assert(lz);
+    assert(dest.num == lz_get_serialised_size(lz));
+
+    bitwriter64_t writer = bitwriter64_make_in_place(dest);
+    return lz_write(lz, &writer, 0);
+}
+
+
+// Copy a match of the given length from offset bytes back.
+// The fast paths copy in whole chunks, which may write up to LZ_COPY_SLACK bytes beyond the end of the match,
+// so they're only used when there is room for that before the end of the destination.
+#define LZ_COPY_SLACK 16
+
+static inline void lz_copy_match(uint8_t *out, uint32_t offset, uint32_t length, const uint8_t *end) {
+    const uint8_t *from = out - offset;
+    uint8_t *match_end = out + length;
+
+    if ((uint32_t)(end - match_end) < LZ_COPY_SLACK) {
+        while (out < match_end) {
+            *out++ = *from++;
+        }
+    }
+    else if (offset >= 16) {
+        // Each chunk is clear of the bytes it copies from
+        do {
+            memcpy(out, from, 16);
+            out += 16;
+            from += 16;
+        }
+        while (out < match_end);
+    }
+    else if (offset == 1) {
+        // A run of a single byte
+        memset(out, *from, length);
+    }
+    else {
+        // A short repeating pattern.
+        // Once a few bytes have been copied, the output repeats with a period of a multiple of offset which is at
+        // least 8, so we can copy from that far back in 8 byte chunks.
+        uint32_t period = (offset >= 8) ? offset : offset * ((7 + offset) / offset);
+        uint8_t *pattern_end = out + (period - offset);
+        while (out < match_end && out < pattern_end) {
+            *out++ = *from++;
+        }
+        from = out - period;
+        while (out < match_end) {
+            memcpy(out, from, 8);
+            out += 8;
+            from += 8;
+        }
+    }
+}
+
+
+static bool lz_decompress_into(byte_array_view_t compressed, byte_array_span_t dest) {
+    assert(compressed.data);
+    assert(dest.data || dest.num == 0);
+    bitreader64_t reader = bitreader64_make(compressed);
+    uint8_t *out = dest.data;
+    const uint8_t *end = dest.data + dest.num;
+
+    uint32_t num_blocks = bitreader64_get_hybrid_value(&reader, 8);
+    uint32_t num_fixed_bits = bitreader64_get_value(&reader, 3) + 1;
 
     bool is_literal = true;
     while (num_blocks--) {
-        uint32_t num_items = bitreader_get_elias_gamma_value(&reader);
+        uint32_t num_items = bitreader64_get_elias_gamma_value(&reader);
         if (num_items == 0) {
             num_items = 256;
             is_literal = !is_literal;
         }
         if (is_literal) {
-            for (uint32_t n = 0; n < num_items; n++) {
-                byte_array_add(&buffer, bitreader_get_value(&reader, 8), arena);
+            if (num_items > (uint32_t)(end - out)) {
+                return false;
+            }
+
+            // Take the literals four at a time where we can
+            uint32_t n = 0;
+            for (; n + 4 <= num_items; n += 4) {
+                uint32_t value = bitreader64_get_value(&reader, 32);
+                out[0] = (uint8_t)(value >> 24);
+                out[1] = (uint8_t)(value >> 16);
+                out[2] = (uint8_t)(value >> 8);
+                out[3] = (uint8_t)value;
+                out += 4;
+            }
+            for (; n < num_items; n++) {
+                *out++ = (uint8_t)bitreader64_get_value(&reader, 8);
             }
         }
         else {
             for (uint32_t n = 0; n < num_items; n++) {
-                uint32_t offset = bitreader_get_hybrid_value(&reader, num_fixed_bits) + 1;
-                uint32_t length = (uint32_t)bitreader_get_elias_gamma_value(&reader) + 1;
-                for (uint32_t i = 0; i < length; i++) {
-                    byte_array_add(&buffer, byte_array_get(&buffer, buffer.num - offset), arena);
+                uint32_t offset = bitreader64_get_hybrid_value(&reader, num_fixed_bits) + 1;
+                uint32_t length = (uint32_t)bitreader64_get_elias_gamma_value(&reader) + 1;
+                if (offset > (uint32_t)(out - dest.data) || length > (uint32_t)(end - out)) {
+                    return false;
                 }
+                lz_copy_match(out, offset, length, end);
+                out += length;
             }
         }
         is_literal = !is_literal;
     }
 
-    return buffer.view;
+    return out == end && !bitreader64_is_overrun(&reader);
+}
+
+
+bool lz_decompress(byte_array_view_t compressed, byte_array_span_t dest) {
+    STATS_TIMER_BEGIN(stats_timer_lz_decompress);
+    bool decompressed = lz_decompress_into(compressed, dest);
+    STATS_TIMER_END(stats_timer_lz_decompress);
+    return decompressed;
+}
+
+
+uint32_t lz_get_decompressed_size(byte_array_view_t compressed) {
+    assert(compressed.data);
+    bitreader64_t reader = bitreader64_make(compressed);
+    uint64_t size = 0;
+
+    // Every block takes at least one bit
+    uint32_t num_blocks = bitreader64_get_hybrid_value(&reader, 8);
+    uint32_t num_fixed_bits = bitreader64_get_value(&reader, 3) + 1;
+    if ((uint64_t)num_blocks > (uint64_t)compressed.num * 8) {
+        return 0;
+    }
+
+    bool is_literal = true;
+    while (num_blocks--) {
+        uint32_t num_items = bitreader64_get_elias_gamma_value(&reader);
+        if (num_items == 0) {
+            num_items = 256;
+            is_literal = !is_literal;
+        }
+        if (is_literal) {
+            // Skip the literals, four at a time where we can
+            uint32_t n = 0;
+            for (; n + 4 <= num_items; n += 4) {
+                bitreader64_get_value(&reader, 32);
+            }
+            for (; n < num_items; n++) {
+                bitreader64_get_value(&reader, 8);
+            }
+            size += num_items;
+        }
+        else {
+            for (uint32_t n = 0; n < num_items; n++) {
+                bitreader64_get_hybrid_value(&reader, num_fixed_bits);
+                size += (uint32_t)bitreader64_get_elias_gamma_value(&reader) + 1;
+            }
+        }
+        is_literal = !is_literal;
+
+        // Reading past the end gives zeros, which would otherwise be read as blocks until the count ran out
+        if (bitreader64_is_overrun(&reader) || size > UINT32_MAX) {
+            return 0;
+        }
+    }
+
+    return (uint32_t)size;
+}
+
+
+byte_array_view_t lz_deserialise(byte_array_view_t compressed, arena_t *arena) {
+    assert(arena);
+    byte_array_span_t dest = byte_array_span_make(lz_get_decompressed_size(compressed), arena);
+    bool ok = lz_decompress(compressed, dest);
+    assert(ok);
+    return dest.view;
 }
@@ -3,6 +3,7 @@
 
 #include "arena.h"
 #include "byte_array.h"
+#include "refs.h"
 #include "token.h"
 #include "utils.h"
 
@@ -20,25 +21,93 @@ typedef struct lz_item_t {
 
 
 
+// How the tokens are chosen from the refs.
+// The command line gives these as levels, fastest first: 0 for greedy, 1 for lazy, and 2 for optimal.
+typedef enum lz_parser_t {
+    lz_parser_optimal,          // the cheapest parse, trying every token at every index
+    lz_parser_greedy,           // the longest ref at each index
+    lz_parser_lazy,             // as greedy, but a literal first if the longest ref after it is longer, or covers the
+                                // same bytes for fewer bits; never worse than greedy
+} lz_parser_t;
+
+
+// Options for controlling the parse.
+// A zero-initialised lz_options_t gives the defaults.
+typedef struct lz_options_t {
+    refs_finder_t finder;
+    lz_parser_t parser;         // only the lz parse uses this; lzhuff is always optimal
+    uint32_t num_threads;       // 0 or 1 to run on the calling thread only
+    bool prune;                 // drop refs which a longer ref can replace at the same offset cost
+    bool all_lengths;           // try every length of each ref, rather than only the best in each length cost bucket
+} lz_options_t;
+
+
+// The parse is tried with every number of fixed offset bits from 1 up to this, keeping the cheapest
+#define LZ_MAX_FIXED_BITS 8
+
 typedef struct lz_parse_result_t {
     lz_item_array_view_t items;
     uint32_t cost;
     uint32_t num_fixed_bits;
+    uint32_t fixed_bits_costs[LZ_MAX_FIXED_BITS];   // the cost of the best parse for each number of fixed offset bits
 } lz_parse_result_t;
 
 
-// Perform an optimal lz parse
-lz_parse_result_t lz_parse(byte_array_view_t src, arena_t *arena, arena_t scratch);
+// Where the bits of a serialised lz result go, and the shape of its tokens
+typedef struct lz_analysis_t {
+    uint32_t header_bits;           // the block count and the number of fixed offset bits
+    uint32_t tally_bits;            // the count of tokens at the start of each block
+    uint32_t literal_bits;
+    uint32_t offset_prefix_bits;    // the elias gamma coded upper part of each offset
+    uint32_t offset_fixed_bits;     // the lower part of each offset, written as it is
+    uint32_t length_bits;
+    uint32_t num_blocks;
+    uint32_t num_literals;
+    uint32_t num_refs;
+    uint32_t offset_histogram[17];  // refs counted by the bit width of their offset
+    uint32_t length_histogram[257]; // refs counted by their length
+} lz_analysis_t;
+
+
+// Perform an lz parse: optimal, unless the options ask for a quicker one.
+// options may be null, in which case the defaults are used.
+lz_parse_result_t lz_parse(byte_array_view_t src, const lz_options_t *options, arena_t *arena, arena_t scratch);
+
+// Perform an lz parse using refs which have already been made, so that they can be shared with other parses.
+// The options which affect how refs are made are ignored.
+lz_parse_result_t lz_parse_refs(const refs_t *refs, const lz_options_t *options, arena_t *arena, arena_t scratch);
 
 // Dump the lz result in a readable format
 void lz_dump(const lz_parse_result_t *lz, const char *filename);
 
+// Work out where the bits of the serialised lz result go
+lz_analysis_t lz_analyse(const lz_parse_result_t *lz);
+
+// Write the analysis of the lz result as JSON, along with the cost of the parse for each number of fixed offset bits
+void lz_dump_analysis(const lz_parse_result_t *lz, const char *filename);
+
 // Serialise the lz result to a bitstream
 byte_array_view_t lz_serialise(const lz_parse_result_t *lz, arena_t *arena);
 
+// Get the size in bytes of the serialised lz result
+uint32_t lz_get_serialised_size(const lz_parse_result_t *lz);
+
+// Serialise the lz result straight into a destination of exactly the serialised size, such as a mapped output file.
+// The returned bitstream is the whole destination.
+byte_array_view_t lz_serialise_in_place(const lz_parse_result_t *lz, byte_array_span_t dest);
+
 // Deserialise the compressed bitstream
 byte_array_view_t lz_deserialise(byte_array_view_t compressed, arena_t *arena);
 
+// Get the size of the data the compressed bitstream expands to, without expanding it.
+// Returns 0 as soon as the bitstream is found to be corrupt, e.g. if it has more blocks than it has room for, or runs
+// out. It's only fully checked by lz_decompress, which fails on a corrupt bitstream given a size of 0.
+uint32_t lz_get_decompressed_size(byte_array_view_t compressed);
+
+// Decompress the bitstream into a destination of exactly the decompressed size.
+// Returns false if the data doesn't fill the destination exactly.
+bool lz_decompress(byte_array_view_t compressed, byte_array_span_t dest);
+
 
 
 
@@ -1,8 +1,12 @@
+#include "cost_window.h"
 #include "lzhuff.h"
 #include "refs.h"
+#include "stats.h"
+#include "thread_pool.h"
 #include "uint16_array.h"
 #include <assert.h>
 #include <stdbool.h>
+#include <string.h>
 
 
 static uint32_t lzhuff_find_unused_symbol(byte_array_view_t src) {
@@ -31,24 +35,121 @@ static uint32_t get_token_cost(token_t t, uint8_array_view_t lengths, uint16_t l
 }
 
 
-lzhuff_result_t lzhuff_parse(byte_array_view_t src, arena_t *arena, arena_t scratch) {
-    assert(src.data);
-    assert(arena);
+// Perform a backwards sweep through the refs, finding the optimal parse for a given number of fixed offset bits.
+// If a cost window is given, only the best length in each length cost bucket is tried; otherwise all are.
+static void lzhuff_sweep(const refs_t *refs, uint8_array_view_t lengths, uint16_t ref_symbol, uint32_t num_fixed_bits, lzhuff_item_array_span_t items, cost_window_t *window) {
+    uint32_t max_offset = 256 << num_fixed_bits;
+    uint32_t num = refs_num(refs);
 
-    // Find an unused symbol that will represent a reference
-    uint32_t ref_symbol = lzhuff_find_unused_symbol(src);
+    if (window) {
+        cost_window_push(window, num, lzhuff_item_array_span_get(items, num).total_cost);
+    }
 
-    // Reserve a piece of scratch space for holding the refs result
-    arena_t local_arena = arena_alloc_subarena(&scratch, 0x400000);
+    uint64_t num_tokens = 0;
+    uint64_t num_relaxations = 0;
+    for (uint32_t i = num; i-- > 0;) {
+        lzhuff_item_t *item = lzhuff_item_array_span_at(items, i);
+        item->total_cost = UINT32_MAX;
 
-    // Find all the back-references in the source data
-    refs_t refs = refs_make(src, &local_arena, scratch);
+        refs_iterator_t it = refs_get_iterator(refs, i);
+
+        // The refs are in order of increasing length and offset, so the lengths of each ref up to the length
+        // of the previous one cost no less, and have already been tried
+        uint32_t shortest_length_minus_one = 1;
+
+        token_t token;
+        while (refs_iterator_next(&it, &token)) {
+            num_tokens++;
+            uint32_t longest_length_minus_one = token.length_minus_one;
+
+            if (token_is_literal(token) || token.offset <= max_offset) {
+                if (window && token.length_minus_one >= COST_WINDOW_MIN_LENGTH_MINUS_ONE) {
+                    // The length cost is the same for every length-1 in [2^k, 2^(k+1)), so just try the best onward
+                    // position in each bucket, longest first.
+                    // The shortest lengths are cheaper to try directly, so we fall through to that afterwards.
+                    uint32_t ref_cost = uint8_array_view_get(lengths, ref_symbol) + get_hybrid_cost(token.offset - 1, num_fixed_bits);
+                    for (uint32_t k = get_bit_width(token.length_minus_one); k-- > COST_WINDOW_MIN_BUCKET;) {
+                        uint32_t first = i + max_uint32(1U << k, shortest_length_minus_one) + 1;
+                        uint32_t last = i + min_uint32((2U << k) - 1, token.length_minus_one) + 1;
+                        if (first > last) {
+                            break;
+                        }
+                        uint32_t token_cost = ref_cost + get_elias_gamma_cost(1U << k);
+                        uint32_t cost = token_cost + cost_window_get_min(window, first, last);
+                        num_relaxations++;
+
+                        if (cost < item->total_cost) {
+                            // Find the longest length which gives this cost
+                            uint32_t next_index = last;
+                            while (token_cost + lzhuff_item_array_span_get(items, next_index).total_cost != cost) {
+                                next_index--;
+                            }
+                            item->token = token_make_ref(token.offset, (uint8_t)(next_index - i - 1));
+                            item->total_cost = cost;
+                        }
+                    }
+                    token.length_minus_one = COST_WINDOW_MIN_LENGTH_MINUS_ONE - 1;
+                }
+
+                if (token_is_literal(token) || token.length_minus_one >= shortest_length_minus_one) {
+                    do {
+                        num_relaxations++;
+                        const lzhuff_item_t *next_item = lzhuff_item_array_span_at(items, i + token_get_length(token));
+
+                        uint32_t cost = next_item->total_cost + get_token_cost(token, lengths, ref_symbol, num_fixed_bits);
+                        
+                        if (cost < item->total_cost) {
+                            item->token = token;
+                            item->total_cost = cost;
+                        }
+                    }
+                    while (token.length_minus_one-- > shortest_length_minus_one);
+                }
+
+                shortest_length_minus_one = longest_length_minus_one + 1;
+            }
+        }
+
+        if (window) {
+            cost_window_push(window, i, item->total_cost);
+        }
+    }
+
+    STATS_ADD(stats_counter_tokens_examined, num_tokens);
+    STATS_ADD(stats_counter_relaxations, num_relaxations);
+}
+
+
+typedef struct lzhuff_sweep_context_t {
+    const refs_t *refs;
+    uint8_array_view_t lengths;
+    uint16_t ref_symbol;
+    uint32_t first_n;       // the index of the parse run by job 0
+    lzhuff_item_array_span_t items_array[8];
+    cost_window_t *windows;
+} lzhuff_sweep_context_t;
+
+
+static void lzhuff_sweep_job(void *context, uint32_t n, uint32_t worker) {
+    lzhuff_sweep_context_t *sweep = context;
+    lzhuff_sweep(sweep->refs, sweep->lengths, sweep->ref_symbol, sweep->first_n + n + 1, sweep->items_array[n], sweep->windows ? &sweep->windows[n] : 0);
+}
+
+
+// Find the optimal tokens for each index of the refs
+static void lzhuff_parse_items(const refs_t *refs, const lz_options_t *options, lzhuff_item_array_span_t items, arena_t scratch) {
+    // Find an unused symbol that will represent a reference
+    uint32_t ref_symbol = lzhuff_find_unused_symbol(refs->src);
 
     // Get symbol counts based on an initial greedy parse
     uint16_t counts[257] = {0};
-    for (uint32_t i = 0; i < refs_num(&refs); ) {
-        token_array_view_t tokens = refs_get_tokens(&refs, i);
-        token_t biggest = token_array_view_get(tokens, tokens.num - 1);
+    for (uint32_t i = 0; i < refs_num(refs); ) {
+        refs_iterator_t it = refs_get_iterator(refs, i);
+        token_t token;
+        token_t biggest;
+        while (refs_iterator_next(&it, &token)) {
+            biggest = token;
+        }
         if (token_is_literal(biggest)) {
             counts[biggest.value]++;
         }
@@ -60,69 +161,66 @@ lzhuff_result_t lzhuff_parse(byte_array_view_t src, arena_t *arena, arena_t scra
     }
 
     // Build huffman tree based on this initial symbol frequency estimate
+    arena_t lengths_arena = arena_alloc_subarena(&scratch, 0x400);
     uint8_array_view_t lengths = huffman_build_code_lengths(
         (uint16_array_view_t) VIEW(counts),
         0,
-        &local_arena,
+        &lengths_arena,
         scratch
     );
 
-    // Parse the source data with differing numbers of fixed offset bits, and choose the best one at the end
-    lzhuff_item_array_span_t items_array[8] = {0};
-
-    for (uint32_t n = 0; n < 8; n++) {
-        uint32_t num_fixed_bits = n + 1;
+    // Parse the source data with differing numbers of fixed offset bits, and choose the best one.
+    // Each parse only reads the refs and code lengths, and writes its own items, so a batch of them, one per thread,
+    // can run concurrently.
+    // Only the batch in progress is kept alongside the best so far: its items are copied out, and the rest released.
+    uint32_t num_threads = options ? options->num_threads : 1;
+    uint32_t batch_size = min_uint32(max_uint32(num_threads, 1), 8);
 
-        // Make a list of optimal tokens for each source index
-        // We reserve an extra element which represents the "off the end" element which previous elements can point to
-        lzhuff_item_array_span_t items = lzhuff_item_array_span_make(src.num + 1, &scratch);
-        items_array[n] = items;
-
-        uint32_t max_offset = 256 << num_fixed_bits;
-
-        for (uint32_t i = src.num; i-- > 0;) {
-            lzhuff_item_t *item = lzhuff_item_array_span_at(items, i);
-            item->total_cost = UINT32_MAX;
+    lzhuff_sweep_context_t context = {
+        .refs = refs,
+        .lengths = lengths,
+        .ref_symbol = ref_symbol,
+        .windows = (options && options->all_lengths) ? 0 : arena_alloc(&scratch, batch_size * sizeof(cost_window_t))
+    };
 
-            token_array_view_t tokens = refs_get_tokens(&refs, i);
+    STATS_TIMER_BEGIN(stats_timer_lzhuff_sweeps);
+    uint32_t best_cost = UINT32_MAX;
+    for (context.first_n = 0; context.first_n < 8; context.first_n += batch_size) {
+        uint32_t num_jobs = min_uint32(batch_size, 8 - context.first_n);
+        arena_checkpoint_t checkpoint = arena_get_checkpoint(&scratch);
 
-            for (uint32_t j = 0; j < tokens.num; j++) {
-                token_t token = token_array_view_get(tokens, j);
+        for (uint32_t n = 0; n < num_jobs; n++) {
+            // Make a list of optimal tokens for each source index
+            // We reserve an extra element which represents the "off the end" element which previous elements can point to
+            context.items_array[n] = lzhuff_item_array_span_make(items.num, &scratch);
+        }
 
-                if (token_is_literal(token) || token.offset <= max_offset) {
-                    do {
-                        const lzhuff_item_t *next_item = lzhuff_item_array_span_at(items, i + token_get_length(token));
+        thread_pool_run(num_threads, num_jobs, lzhuff_sweep_job, &context);
 
-                        uint32_t cost = next_item->total_cost + get_token_cost(token, lengths, ref_symbol, num_fixed_bits);
-                        
-                        if (cost < item->total_cost) {
-                            item->token = token;
-                            item->total_cost = cost;
-                        }
-                    }
-                    while (token.length_minus_one-- > 1);
-                }
+        // Keep the parse with the lowest cost
+        uint32_t batch_best_n = num_jobs;
+        for (uint32_t n = 0; n < num_jobs; n++) {
+            uint32_t cost = lzhuff_item_array_span_get(context.items_array[n], 0).total_cost;
+            if (cost < best_cost) {
+                best_cost = cost;
+                batch_best_n = n;
             }
         }
-    }
-
-    // Find the parse with the lowest cost
-    uint32_t best_cost = UINT32_MAX;
-    uint32_t best_n = 0;
-    for (uint32_t n = 0; n < 8; n++) {
-        uint32_t cost = lzhuff_item_array_span_get(items_array[n], 0).total_cost;
-        if (cost < best_cost) {
-            best_cost = cost;
-            best_n = n;
+        if (batch_best_n < num_jobs) {
+            memcpy(items.data, context.items_array[batch_best_n].data, items.num * sizeof(lzhuff_item_t));
         }
+
+        arena_rollback(&scratch, checkpoint);
     }
+    STATS_TIMER_END(stats_timer_lzhuff_sweeps);
+}
 
-    // Now build the final token stream by walking the token list from the first element
-    lzhuff_item_array_span_t items = items_array[best_n];
-    uint16_t new_counts[257] = {0};
 
-    lzhuff_item_array_t result = lzhuff_item_array_make(src.num, arena);
-    for (uint32_t i = 0; i < src.num; i += token_get_length(lzhuff_item_array_span_get(items, i).token)) {
+// Build the final token stream by walking the token list from the first element
+static lzhuff_result_t lzhuff_collect_items(lzhuff_item_array_span_t items, arena_t *arena) {
+    uint32_t num = items.num - 1;
+    lzhuff_item_array_t result = lzhuff_item_array_make(num, arena);
+    for (uint32_t i = 0; i < num; i += token_get_length(lzhuff_item_array_span_get(items, i).token)) {
         lzhuff_item_array_add(&result, lzhuff_item_array_span_get(items, i), arena);
     }
 
@@ -130,3 +228,48 @@ lzhuff_result_t lzhuff_parse(byte_array_view_t src, arena_t *arena, arena_t scra
         .items = result.view
     };
 }
+
+
+lzhuff_result_t lzhuff_parse(byte_array_view_t src, const lz_options_t *options, arena_t *arena, arena_t scratch) {
+    assert(src.data);
+    assert(arena);
+
+    // Find all the back-references in the source data
+    refs_options_t refs_options = {
+        .finder = options ? options->finder : refs_finder_pairs,
+        .num_threads = options ? options->num_threads : 1,
+        .prune = options ? options->prune : false
+    };
+
+    // The refs go in the destination arena, as only refs_make knows how big they will be.
+    // They are freed again before the result is added.
+    const char *tag = arena_set_tag(arena, "refs");
+    refs_t refs = refs_make(src, &refs_options, arena, scratch);
+    arena_set_tag(arena, "lzhuff parse");
+    arena_set_tag(&scratch, "lzhuff parse");
+
+    lzhuff_item_array_span_t items = lzhuff_item_array_span_make(src.num + 1, &scratch);
+    lzhuff_parse_items(&refs, options, items, scratch);
+
+    refs_free(&refs, arena);
+
+    lzhuff_result_t result = lzhuff_collect_items(items, arena);
+    arena_set_tag(arena, tag);
+    return result;
+}
+
+
+lzhuff_result_t lzhuff_parse_refs(const refs_t *refs, const lz_options_t *options, arena_t *arena, arena_t scratch) {
+    assert(refs);
+    assert(arena);
+
+    const char *tag = arena_set_tag(arena, "lzhuff parse");
+    arena_set_tag(&scratch, "lzhuff parse");
+
+    lzhuff_item_array_span_t items = lzhuff_item_array_span_make(refs_num(refs) + 1, &scratch);
+    lzhuff_parse_items(refs, options, items, scratch);
+
+    lzhuff_result_t result = lzhuff_collect_items(items, arena);
+    arena_set_tag(arena, tag);
+    return result;
+}
@@ -4,6 +4,7 @@
 #include "arena.h"
 #include "byte_array.h"
 #include "huffman.h"
+#include "lz.h"
 #include "token.h"
 #include "uint8_array.h"
 #include <stdint.h>
@@ -25,8 +26,13 @@ typedef struct lzhuff_result_t {
 } lzhuff_result_t;
 
 
-// Perform a lz+huffman parse
-lzhuff_result_t lzhuff_parse(byte_array_view_t src, arena_t *arena, arena_t scratch);
+// Perform a lz+huffman parse.
+// options may be null, in which case the defaults are used.
+lzhuff_result_t lzhuff_parse(byte_array_view_t src, const lz_options_t *options, arena_t *arena, arena_t scratch);
+
+// Perform a lz+huffman parse using refs which have already been made, so that they can be shared with other parses.
+// The options which affect how refs are made are ignored.
+lzhuff_result_t lzhuff_parse_refs(const refs_t *refs, const lz_options_t *options, arena_t *arena, arena_t scratch);
 
 
 #endif // ifndef LZHUFF_H_
@@ -1,18 +1,22 @@
 #include "arena.h"
+#include "batch.h"
+#include "cache.h"
 #include "file.h"
 #include "huffman.h"
 #include "lz.h"
+#include "method.h"
+#include "serve.h"
+#include "stats.h"
+#include "version.h"
 #ifdef TESTS_ENABLED
 #include "test/test.h"
 #endif
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
-#define VERSION "0.1"
-
-
 static void display_version(void) {
     puts("richcrunch " VERSION);
     puts("Developed and maintained by Rich Talbot-Watkins");
@@ -28,17 +32,73 @@ static void display_help(void) {
     puts("  lz           Use lz style back-reference compression");
     puts("  huffman      Use huffman tree compression");
     puts("  lzhuff       Use huffman combined with lz compression");
+    puts("  auto         Try every type at once, keeping the smallest output which verifies");
+    puts("               (-log reports the sizes, and which was chosen)");
+    puts("  batch        Run the jobs in the manifest <input>, one 'TYPE <input> <output>' per line,");
+    puts("               writing the results to <output> (or stdout)");
+    puts("");
+    puts("Usage: richcrunch --serve <socket> [OPTIONS]...");
+    puts("Stay running, compressing files as requests come in on the local socket <socket>.");
+    puts("  --connect <socket>");
+    puts("               Send TYPE <input> <output> to the server at <socket>, rather than compressing here");
+    puts("               (--verify asks the server to verify; --shutdown stops the server)");
     puts("");
     puts("Possible options:");
     puts("  -d <file>    Output beebasm includeable file with details");
     puts("  -log <file>  Output verbose listing with compression details");
+    puts("  -analysis <file>");
+    puts("               Output a JSON breakdown of where the bits go, with offset and length histograms (lz)");
+    puts("  -finder <f>  Match finder to use for lz: 'pairs' (default) or 'sa' (suffix array)");
+    puts("  --level N    lz parse: 0 greedy (fastest), 1 lazy, or 2 optimal (smallest, default)");
+    puts("               (for a server, give it with --serve)");
+    puts("  --threads N  Use up to N threads");
+    puts("  --prune      Drop match candidates which a longer one can replace at the same cost (faster)");
     puts("  --verify     Verifies that the compressed data is correct");
+    puts("  --huge-pages Ask for transparent huge pages for working memory");
+    puts("  --mem-stats  Report memory use for each phase of the compression");
+#ifdef STATS_ENABLED
+    puts("  --stats      Report the time spent in each phase, and counts of the work done in the inner loops");
+    puts("  --stats-json Report the same as --stats, as JSON");
+#endif
+    puts("  --no-cache   Always compress, rather than using a cached result from an earlier run");
+    puts("  --cache-dir <dir>");
+    puts("               Keep cached results in <dir> (default: $RICHCRUNCH_CACHE, or 'richcrunch' in");
+    puts("               the user's cache directory)");
     puts("");
     puts("  --version to display version and author information");
     puts("  --help to display this help again");
 }
 
 
+// Memory use is reported separately for each phase of the compression
+typedef struct mem_stats_t {
+    bool enabled;
+    arena_stats_t arena;
+    arena_stats_t scratch;
+} mem_stats_t;
+
+
+static void mem_stats_begin(mem_stats_t *stats, arena_t *arena, arena_t *scratch) {
+    if (stats->enabled) {
+        arena_attach_stats(arena, &stats->arena, "arena");
+        arena_attach_stats(scratch, &stats->scratch, "scratch");
+    }
+}
+
+
+static void mem_stats_end(mem_stats_t *stats, const char *phase, arena_t *arena, arena_t *scratch) {
+    if (stats->enabled) {
+        printf("Memory use for %s:\n", phase);
+        arena_stats_print(&stats->arena, stdout);
+        arena_stats_print(&stats->scratch, stdout);
+        arena_stats_deinit(&stats->arena);
+        arena_stats_deinit(&stats->scratch);
+        arena_detach_stats(arena);
+        arena_detach_stats(scratch);
+    }
+}
+
+
 int main(int argc, char *argv[]) {
 #ifdef TESTS_ENABLED
     if (argc == 2 && strcmp(argv[1], "--test") == 0) {
@@ -55,14 +115,28 @@ int main(int argc, char *argv[]) {
         compression_type_none,
         compression_type_lz,
         compression_type_huffman,
-        compression_type_lzhuff
+        compression_type_lzhuff,
+        compression_type_auto,
+        compression_type_batch
     } compression_type_t;
 
     compression_type_t type = compression_type_none;
     const char *input_filename = 0;
     const char *output_filename = 0;
     const char *log_filename = 0;
+    const char *analysis_filename = 0;
     bool verify = false;
+    bool huge_pages = false;
+    mem_stats_t mem_stats = {0};
+    bool print_stats = false;
+    bool stats_json = false;
+    bool use_cache = true;
+    const char *cache_dir = 0;
+    const char *serve_path = 0;
+    const char *connect_path = 0;
+    bool shutdown_server = false;
+    bool level_given = false;
+    lz_options_t lz_options = {0};
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--help") == 0) {
@@ -76,6 +150,53 @@ int main(int argc, char *argv[]) {
         else if (strcmp(argv[i], "--verify") == 0) {
             verify = true;
         }
+        else if (strcmp(argv[i], "--huge-pages") == 0) {
+            huge_pages = true;
+        }
+        else if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats.enabled = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats-json") == 0) {
+#ifdef STATS_ENABLED
+            print_stats = true;
+            stats_json = (strcmp(argv[i], "--stats-json") == 0);
+#else
+            fprintf(stderr, "Warning: %s needs a build with STATS_ENABLED defined\n", argv[i]);
+#endif
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = false;
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0) {
+            if (++i < argc) {
+                cache_dir = argv[i];
+            }
+            else {
+                fprintf(stderr, "Missing cache directory (--cache-dir <dir>)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--serve") == 0) {
+            if (++i < argc) {
+                serve_path = argv[i];
+            }
+            else {
+                fprintf(stderr, "Missing socket path (--serve <socket>)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--connect") == 0) {
+            if (++i < argc) {
+                connect_path = argv[i];
+            }
+            else {
+                fprintf(stderr, "Missing socket path (--connect <socket>)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--shutdown") == 0) {
+            shutdown_server = true;
+        }
         else if (strcmp(argv[i], "-log") == 0) {
             if (++i < argc) {
                 log_filename = argv[i];
@@ -85,6 +206,55 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
         }
+        else if (strcmp(argv[i], "-analysis") == 0) {
+            if (++i < argc) {
+                analysis_filename = argv[i];
+            }
+            else {
+                fprintf(stderr, "Missing analysis filename (-analysis <filename>)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0) {
+            if (++i < argc && atoi(argv[i]) > 0) {
+                lz_options.num_threads = (uint32_t)atoi(argv[i]);
+            }
+            else {
+                fprintf(stderr, "Missing or invalid thread count (--threads N)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--level") == 0) {
+            level_given = true;
+            if (++i < argc && strcmp(argv[i], "0") == 0) {
+                lz_options.parser = lz_parser_greedy;
+            }
+            else if (i < argc && strcmp(argv[i], "1") == 0) {
+                lz_options.parser = lz_parser_lazy;
+            }
+            else if (i < argc && strcmp(argv[i], "2") == 0) {
+                lz_options.parser = lz_parser_optimal;
+            }
+            else {
+                fprintf(stderr, "Missing or invalid level (--level 0|1|2)\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--prune") == 0) {
+            lz_options.prune = true;
+        }
+        else if (strcmp(argv[i], "-finder") == 0) {
+            if (++i < argc && strcmp(argv[i], "pairs") == 0) {
+                lz_options.finder = refs_finder_pairs;
+            }
+            else if (i < argc && strcmp(argv[i], "sa") == 0) {
+                lz_options.finder = refs_finder_suffix_array;
+            }
+            else {
+                fprintf(stderr, "Missing or unknown match finder (-finder pairs|sa)\n");
+                return 1;
+            }
+        }
         else if (type == compression_type_none && strcmp(argv[i], "lz") == 0) {
             type = compression_type_lz;
         }
@@ -94,6 +264,12 @@ int main(int argc, char *argv[]) {
         else if (type == compression_type_none && strcmp(argv[i], "lzhuff") == 0) {
             type = compression_type_lzhuff;
         }
+        else if (type == compression_type_none && strcmp(argv[i], "auto") == 0) {
+            type = compression_type_auto;
+        }
+        else if (type == compression_type_none && strcmp(argv[i], "batch") == 0) {
+            type = compression_type_batch;
+        }
         else if (!input_filename) {
             input_filename = argv[i];
         }
@@ -106,6 +282,23 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (serve_path) {
+        serve_options_t serve_options = {
+            .lz_options = lz_options,
+            .huge_pages = huge_pages
+        };
+        return serve_run(serve_path, &serve_options) ? 0 : 1;
+    }
+
+    if (connect_path && shutdown_server) {
+        char reply[SERVE_MAX_LINE];
+        if (!serve_send(connect_path, "shutdown", reply, sizeof(reply))) {
+            fprintf(stderr, "Can't reach a server at '%s'\n", connect_path);
+            return 1;
+        }
+        return 0;
+    }
+
     if (type == compression_type_none) {
         fprintf(stderr, "Compression type not specified: richcrunch --help to see options\n");
         return 1;
@@ -115,63 +308,197 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Missing input filename\n");
         return 1;
     }
+
+    if (connect_path) {
+        const char *type_name =
+            (type == compression_type_lz) ? "lz" :
+            (type == compression_type_huffman) ? "huffman" :
+            (type == compression_type_auto) ? "auto" :
+            0;
+        if (!type_name || !output_filename) {
+            fprintf(stderr, "The server needs a type of lz, huffman or auto, an input and an output\n");
+            return 1;
+        }
+        if (level_given) {
+            fprintf(stderr, "The server's level is chosen when it's started (--serve <socket> --level N)\n");
+            return 1;
+        }
+        char reply[SERVE_MAX_LINE];
+        if (!serve_send_job(connect_path, type_name, verify, input_filename, output_filename, reply, sizeof(reply))) {
+            fprintf(stderr, "Can't reach a server at '%s'\n", connect_path);
+            return 1;
+        }
+        puts(reply);
+        return (strncmp(reply, "ok", 2) == 0) ? 0 : 1;
+    }
+
+    if (analysis_filename && type != compression_type_lz) {
+        fprintf(stderr, "Warning: -analysis is only available for lz\n");
+    }
+
+    cache_t cache = use_cache ? cache_make(cache_dir, CACHE_DEFAULT_MAX_SIZE) : (cache_t) {0};
+
+    if (type == compression_type_batch) {
+        batch_options_t batch_options = {
+            .lz_options = lz_options,
+            .verify = verify,
+            .huge_pages = huge_pages,
+            .cache = &cache
+        };
+        bool ok = batch_run(input_filename, output_filename, &batch_options);
+        if (print_stats) {
+            stats_print(stdout, stats_json);
+        }
+        return ok ? 0 : 1;
+    }
     else if (!output_filename) {
         fprintf(stderr, "Warning: missing output filename\n");
     }
 
-    arena_t arena = arena_make(0x1000000);
-    arena_t scratch = arena_make(0x1000000);
+    // Reserve plenty of address space; only what's used gets committed
+    arena_t arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, huge_pages);
+    arena_t scratch = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, huge_pages);
 
-    file_read_result_t src_file = file_read_binary(input_filename, &arena);
-    if (src_file.error.type != file_error_none) {
-        fprintf(stderr, "Error reading file '%s'\n", input_filename);
-        return 1;
+    // Map the input file so that it's used in place; if it can't be mapped, read it into the arena instead.
+    // Writing the output would truncate the input under its mapping if they're the same file, however they're
+    // named, so then it's read too.
+    mem_stats_begin(&mem_stats, &arena, &scratch);
+    STATS_TIMER_BEGIN(stats_timer_read);
+    file_mapping_t src_mapping = {0};
+    if (!output_filename || file_is_distinct(input_filename, output_filename)) {
+        src_mapping = file_map_binary(input_filename);
+    }
+    byte_array_view_t src = src_mapping.contents.view;
+    if (!src.data) {
+        file_read_result_t src_file = file_read_binary(input_filename, &arena);
+        if (src_file.error.type != file_error_none) {
+            fprintf(stderr, "Error reading file '%s'\n", input_filename);
+            return 1;
+        }
+        src = src_file.contents;
     }
+    STATS_TIMER_END(stats_timer_read);
+    mem_stats_end(&mem_stats, "reading", &arena, &scratch);
 
     byte_array_view_t compressed = {0};
+    file_mapping_t dest_mapping = {0};
+
+    // A previous run's output can be used if it was for the same input and options.
+    // The compression itself is needed for the log or analysis, so don't look it up then, but still store the result.
+    const char *cache_type =
+        (type == compression_type_lz) ? "lz" :
+        (type == compression_type_huffman) ? "huffman" :
+        (type == compression_type_auto) ? "auto" :
+        0;
+    bool store = false;
+    cache_key_t cache_key = {0};
+    if (cache_is_enabled(&cache) && cache_type) {
+        cache_key = cache_key_make(cache_type, &lz_options, src);
+        if (!log_filename && !(analysis_filename && type == compression_type_lz)) {
+            compressed = cache_lookup(&cache, cache_key, src.num, &arena);
+        }
+        store = !compressed.data;
+    }
 
     if (type == compression_type_lz) {
 
-        // Perform lz compression
-        lz_parse_result_t lz = lz_parse(src_file.contents, &arena, scratch);
-        if (log_filename) {
-            lz_dump(&lz, log_filename);
+        if (!compressed.data) {
+            // Perform lz compression
+            mem_stats_begin(&mem_stats, &arena, &scratch);
+            lz_parse_result_t lz = lz_parse(src, &lz_options, &arena, scratch);
+            mem_stats_end(&mem_stats, "lz parse", &arena, &scratch);
+            if (log_filename) {
+                lz_dump(&lz, log_filename);
+            }
+            if (analysis_filename) {
+                lz_dump_analysis(&lz, analysis_filename);
+            }
+            // The size of the output is known up front, so map the output file and serialise straight into it
+            mem_stats_begin(&mem_stats, &arena, &scratch);
+            if (output_filename) {
+                dest_mapping = file_map_binary_for_output(output_filename, lz_get_serialised_size(&lz));
+            }
+            compressed = dest_mapping.contents.data ?
+                lz_serialise_in_place(&lz, dest_mapping.contents) :
+                lz_serialise(&lz, &arena);
+            mem_stats_end(&mem_stats, "lz serialise", &arena, &scratch);
         }
-        compressed = lz_serialise(&lz, &arena);
         if (verify) {
-            byte_array_view_t expanded = lz_deserialise(compressed, &arena);
-            bool same = (src_file.contents.num == expanded.num &&
-                memcmp(src_file.contents.data, expanded.data, src_file.contents.num) == 0);
+            mem_stats_begin(&mem_stats, &arena, &scratch);
+            // We know how big the result should be, so decompress straight into a buffer of that size
+            byte_array_span_t expanded = byte_array_span_make(src.num, &scratch);
+            bool same = lz_decompress(compressed, expanded) &&
+                memcmp(src.data, expanded.data, src.num) == 0;
             if (!same) {
                 fprintf(stderr, "Unknown error attempting to compress file\n");
+                store = false;
             }
+            mem_stats_end(&mem_stats, "lz verify", &arena, &scratch);
         }
     }
     else if (type == compression_type_huffman) {
 
-        // Perform huffman compression
-        compressed = huffman_serialise(src_file.contents, &arena, scratch);
+        if (!compressed.data) {
+            // Perform huffman compression
+            mem_stats_begin(&mem_stats, &arena, &scratch);
+            compressed = huffman_serialise(src, &arena, scratch);
+            mem_stats_end(&mem_stats, "huffman serialise", &arena, &scratch);
+        }
         if (verify) {
+            mem_stats_begin(&mem_stats, &arena, &scratch);
             byte_array_view_t expanded = huffman_deserialise(compressed, &arena, scratch);
-            bool same = (src_file.contents.num == expanded.num &&
-                memcmp(src_file.contents.data, expanded.data, src_file.contents.num) == 0);
+            bool same = (src.num == expanded.num &&
+                memcmp(src.data, expanded.data, src.num) == 0);
             if (!same) {
                 fprintf(stderr, "Unknown error attempting to compress file\n");
+                store = false;
             }
+            mem_stats_end(&mem_stats, "huffman verify", &arena, &scratch);
         }
     }
     else if (type == compression_type_lzhuff) {
 
         // Perform lzhuff compression
     }
+    else if (type == compression_type_auto) {
 
-    if (output_filename) {
+        if (!compressed.data) {
+            // Try every method, each output being verified as it's made
+            mem_stats_begin(&mem_stats, &arena, &scratch);
+            method_result_t result = method_choose(src, &lz_options, &arena, scratch);
+            mem_stats_end(&mem_stats, "auto", &arena, &scratch);
+            if (log_filename) {
+                method_dump(&result, log_filename);
+            }
+            compressed = result.compressed;
+            if (!compressed.data) {
+                fprintf(stderr, "Unknown error attempting to compress file\n");
+                store = false;
+            }
+        }
+    }
+
+    if (output_filename && !dest_mapping.contents.data && compressed.data) {
+        STATS_TIMER_BEGIN(stats_timer_write);
         file_error_t dest_file = file_write_binary(output_filename, compressed);
+        STATS_TIMER_END(stats_timer_write);
         if (dest_file.type != file_error_none) {
             fprintf(stderr, "Error writing file '%s'\n", output_filename);
         }
     }
 
+    if (store) {
+        cache_store(&cache, cache_key, src.num, compressed, scratch);
+        cache_evict(&cache, scratch);
+    }
+
+    file_unmap(&dest_mapping);
+    file_unmap(&src_mapping);
+
+    if (print_stats) {
+        stats_print(stdout, stats_json);
+    }
+
     arena_deinit(&scratch);
     arena_deinit(&arena);
 
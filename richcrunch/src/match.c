@@ -0,0 +1,139 @@
+#include "match.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MATCH_X86
+#include <immintrin.h>
+#endif
+
+#if defined(MATCH_X86) && (defined(__GNUC__) || defined(__clang__))
+#define MATCH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define MATCH_TARGET(isa)
+#endif
+
+
+// Scalar implementation.
+// On little-endian machines, compare 8 bytes at a time; the first mismatching byte is then
+// given by the lowest set bit of the XOR of the two words.
+
+static uint32_t match_get_length_scalar(const uint8_t *a, const uint8_t *b, uint32_t max_length) {
+    uint32_t length = 0;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length + 8 <= max_length) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + length, 8);
+        memcpy(&wb, b + length, 8);
+        uint64_t diff = wa ^ wb;
+        if (diff) {
+            return length + get_trailing_zeros_uint64(diff) / 8;
+        }
+        length += 8;
+    }
+#endif
+    while (length < max_length && a[length] == b[length]) {
+        length++;
+    }
+    return length;
+}
+
+
+#ifdef MATCH_X86
+
+// SSE2 implementation: compare 16 bytes at a time.
+// The byte compare mask has a zero bit for each mismatch, so the first mismatch is the lowest set bit of its inverse.
+
+MATCH_TARGET("sse2")
+static uint32_t match_get_length_sse2(const uint8_t *a, const uint8_t *b, uint32_t max_length) {
+    uint32_t length = 0;
+    while (length + 16 <= max_length) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + length));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + length));
+        uint32_t mismatches = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+        if (mismatches) {
+            return length + get_trailing_zeros_uint32(mismatches);
+        }
+        length += 16;
+    }
+    return length + match_get_length_scalar(a + length, b + length, max_length - length);
+}
+
+
+// AVX2 implementation: compare 32 bytes at a time
+
+MATCH_TARGET("avx2")
+static uint32_t match_get_length_avx2(const uint8_t *a, const uint8_t *b, uint32_t max_length) {
+    uint32_t length = 0;
+    while (length + 32 <= max_length) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + length));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + length));
+        uint32_t mismatches = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (mismatches) {
+            return length + get_trailing_zeros_uint32(mismatches);
+        }
+        length += 32;
+    }
+    return length + match_get_length_sse2(a + length, b + length, max_length - length);
+}
+
+
+static bool match_cpu_has_sse2(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] >> 26) & 1;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+
+static bool match_cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+    // AVX2 needs the CPU to support it, and the OS to save the YMM registers
+    int info[4];
+    __cpuid(info, 1);
+    bool has_osxsave = (info[2] >> 27) & 1;
+    bool has_avx = (info[2] >> 28) & 1;
+    if (!has_osxsave || !has_avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // ifdef MATCH_X86
+
+
+match_length_fn_t match_get_length_fn_for(match_impl_t impl) {
+    switch (impl) {
+        case match_impl_scalar:
+            return match_get_length_scalar;
+#ifdef MATCH_X86
+        case match_impl_sse2:
+            return match_cpu_has_sse2() ? match_get_length_sse2 : 0;
+        case match_impl_avx2:
+            return match_cpu_has_avx2() ? match_get_length_avx2 : 0;
+#endif
+        default:
+            return 0;
+    }
+}
+
+
+match_length_fn_t match_get_length_fn(void) {
+    for (uint32_t impl = match_impl_count; impl-- > 0;) {
+        match_length_fn_t fn = match_get_length_fn_for(impl);
+        if (fn) {
+            return fn;
+        }
+    }
+    return match_get_length_scalar;
+}
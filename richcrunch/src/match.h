@@ -0,0 +1,28 @@
+#ifndef MATCH_H_
+#define MATCH_H_
+
+#include <stdint.h>
+
+
+// A function which returns the length of the common prefix of a and b, up to max_length bytes
+typedef uint32_t (*match_length_fn_t)(const uint8_t *a, const uint8_t *b, uint32_t max_length);
+
+
+// The available implementations of the match length kernel
+typedef enum match_impl_t {
+    match_impl_scalar,
+    match_impl_sse2,
+    match_impl_avx2,
+    match_impl_count
+} match_impl_t;
+
+
+// Get the given implementation of the match length kernel, or null if the CPU doesn't support it
+match_length_fn_t match_get_length_fn_for(match_impl_t impl);
+
+// Get the fastest implementation of the match length kernel supported by the CPU.
+// This is cheap, but not free, so callers should get it once rather than in their inner loops.
+match_length_fn_t match_get_length_fn(void);
+
+
+#endif // ifndef MATCH_H_
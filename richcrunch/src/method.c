@@ -0,0 +1,165 @@
+#include "huffman.h"
+#include "lzhuff.h"
+#include "method.h"
+#include "refs.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct method_context_t {
+    byte_array_view_t src;
+    const refs_t *refs;
+    lz_options_t options;
+    uint32_t num_threads[method_count];     // the threads each method can use, including the one running it
+    byte_array_view_t outputs[method_count];
+    method_report_t reports[method_count];
+
+    // Each method has its own arenas, as they run at the same time
+    arena_t arenas[method_count];
+    arena_t scratches[method_count];
+} method_context_t;
+
+
+const char *method_get_name(method_t method) {
+    switch (method) {
+        case method_lz:         return "lz";
+        case method_lzhuff:     return "lzhuff";
+        case method_huffman:    return "huffman";
+        default:                return "unknown";
+    }
+}
+
+
+static void method_job(void *context, uint32_t job, uint32_t worker) {
+    method_context_t *methods = context;
+    byte_array_view_t src = methods->src;
+    arena_t *arena = &methods->arenas[job];
+    arena_t scratch = methods->scratches[job];
+    method_report_t *report = &methods->reports[job];
+    lz_options_t options = methods->options;
+    options.num_threads = methods->num_threads[job];
+
+    double start = get_time_ms();
+    if (job == method_lz) {
+        lz_parse_result_t lz = lz_parse_refs(methods->refs, &options, arena, scratch);
+        byte_array_view_t compressed = lz_serialise(&lz, arena);
+        byte_array_span_t expanded = byte_array_span_make(src.num, &scratch);
+        report->verified = lz_decompress(compressed, expanded) && memcmp(src.data, expanded.data, src.num) == 0;
+        report->size = compressed.num;
+        methods->outputs[job] = compressed;
+    }
+    else if (job == method_lzhuff) {
+        lzhuff_result_t lzhuff = lzhuff_parse_refs(methods->refs, &options, arena, scratch);
+        report->estimated = true;
+        report->size = (lzhuff_item_array_view_get(lzhuff.items, 0).total_cost + 7) / 8;
+    }
+    else if (job == method_huffman) {
+        byte_array_view_t compressed = huffman_serialise(src, arena, scratch);
+        byte_array_view_t expanded = huffman_deserialise(compressed, arena, scratch);
+        report->verified = expanded.num == src.num && memcmp(src.data, expanded.data, src.num) == 0;
+        report->size = compressed.num;
+        methods->outputs[job] = compressed;
+    }
+    report->time_ms = get_time_ms() - start;
+}
+
+
+method_result_t method_choose(byte_array_view_t src, const lz_options_t *options, arena_t *arena, arena_t scratch) {
+    assert(arena);
+    assert(src.data);
+
+    uint32_t num_threads = max_uint32(options ? options->num_threads : 1, 1);
+
+    refs_options_t refs_options = {
+        .finder = options ? options->finder : refs_finder_pairs,
+        .num_threads = num_threads,
+        .prune = options ? options->prune : false
+    };
+
+    // The refs go in the destination arena, as only refs_make knows how big they will be.
+    // They are freed again before the result is added.
+    const char *tag = arena_set_tag(arena, "refs");
+    refs_t refs = refs_make(src, &refs_options, arena, scratch);
+    arena_set_tag(arena, tag);
+
+    // The methods run at the same time, and share the threads between them, so that no more than num_threads run
+    // at once. Huffman is quick and only ever uses one, so the two parses share the rest.
+    // With fewer threads than methods, some methods wait for others to finish, each then using the one thread.
+    method_context_t context = {
+        .src = src,
+        .refs = &refs,
+        .options = options ? *options : (lz_options_t) {0}
+    };
+    for (uint32_t m = 0; m < method_count; m++) {
+        context.num_threads[m] = 1;
+    }
+    if (num_threads >= method_count) {
+        context.num_threads[method_lz] = num_threads / 2;
+        context.num_threads[method_lzhuff] = (num_threads - 1) / 2;
+    }
+
+    arena_set_tag(&scratch, "method");
+    uint32_t method_arena_size = ((scratch.end - scratch.next) / (method_count * 2)) & ~15U;
+    for (uint32_t m = 0; m < method_count; m++) {
+        context.arenas[m] = arena_alloc_subarena(&scratch, method_arena_size);
+        context.scratches[m] = arena_alloc_subarena(&scratch, method_arena_size);
+    }
+
+    thread_pool_run(min_uint32(num_threads, method_count), method_count, method_job, &context);
+
+    refs_free(&refs, arena);
+
+    // Keep the smallest output which verified
+    method_result_t result = {.method = method_count};
+    memcpy(result.reports, context.reports, sizeof(result.reports));
+    for (uint32_t m = 0; m < method_count; m++) {
+        const method_report_t *report = &context.reports[m];
+        if (report->verified && (result.method == method_count || report->size < result.reports[result.method].size)) {
+            result.method = (method_t)m;
+        }
+    }
+
+    if (result.method != method_count) {
+        byte_array_view_t output = context.outputs[result.method];
+        byte_array_span_t compressed = byte_array_span_make(output.num, arena);
+        memcpy(compressed.data, output.data, output.num);
+        result.compressed = compressed.view;
+    }
+
+    return result;
+}
+
+
+void method_dump(const method_result_t *result, const char *filename) {
+    FILE *file = 0;
+    if (filename) {
+        file = fopen(filename, "w");
+    }
+    if (!file) {
+        file = stdout;
+    }
+
+    fprintf(file, "Method     Size   Verified  Time\n");
+    for (uint32_t m = 0; m < method_count; m++) {
+        const method_report_t *report = &result->reports[m];
+        fprintf(file, "%-8s %6u%s  %-8s  %.1fms%s\n",
+            method_get_name((method_t)m),
+            report->size,
+            report->estimated ? "*" : " ",
+            report->verified ? "yes" : "no",
+            report->time_ms,
+            (m == result->method) ? "  <- chosen" : ""
+        );
+    }
+    if (result->method == method_count) {
+        fprintf(file, "No method verified\n");
+    }
+    fprintf(file, "* estimated from the parse; this method can't be written yet\n");
+
+    if (file != stdout) {
+        fclose(file);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef METHOD_H_
+#define METHOD_H_
+
+#include "arena.h"
+#include "byte_array.h"
+#include "lz.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Automatic choice of compression method.
+//
+// Every method is run on the same input at once, the lz parses sharing a single set of refs, and the smallest
+// output which decompresses back to the input is kept.
+// lzhuff can't be serialised yet, so its size is only an estimate from the parse, and it's never chosen.
+
+// The methods, in the order their jobs are started: the slowest first
+typedef enum method_t {
+    method_lz,
+    method_lzhuff,
+    method_huffman,
+    method_count
+} method_t;
+
+
+typedef struct method_report_t {
+    uint32_t size;          // the size of the output in bytes, or 0 if the method failed
+    bool verified;          // the output decompressed back to the input
+    bool estimated;         // the size is only an estimate, as there's no output to check
+    double time_ms;
+} method_report_t;
+
+
+typedef struct method_result_t {
+    method_t method;                        // the method chosen
+    byte_array_view_t compressed;           // its output, or null data if no method verified
+    method_report_t reports[method_count];  // how each method did
+} method_result_t;
+
+
+// Get the name of a method, as given on the command line
+const char *method_get_name(method_t method);
+
+// Compress with every method, keeping the smallest verified output.
+// options may be null, in which case the defaults are used. The threads are shared between the methods.
+method_result_t method_choose(byte_array_view_t src, const lz_options_t *options, arena_t *arena, arena_t scratch);
+
+// Write a report of how each method did, and which was chosen
+void method_dump(const method_result_t *result, const char *filename);
+
+
+#endif // ifndef METHOD_H_
@@ -1,4 +1,9 @@
+#include "match.h"
 #include "refs.h"
+#include "stats.h"
+#include "suffix_array.h"
+#include "thread_pool.h"
+#include "uint32_array.h"
 #include <stdbool.h>
 
 
@@ -61,82 +66,430 @@ static indices_view_t sequence_cache_get_indices(const sequence_cache_t *sc, uin
 }
 
 
+// suffix_finder implementation
+
+// suffix_finder finds matches by querying a suffix array of the source data.
+// All the suffixes which share a prefix of a given length with the current one occupy a contiguous interval
+// of ranks, so the nearest previous match of at least that length is the latest source index seen so far
+// within that interval.
+// To find this quickly, we keep a segment tree over the ranks which holds the latest source index (plus one,
+// so that zero means none) seen within each range of ranks. Each query or update is then O(log n).
+// The suffix array itself is read-only, so can be shared between threads, but each thread needs its own tree.
+
+typedef struct suffix_finder_t {
+    const suffix_array_t *sa;
+    uint32_array_span_t latest;
+} suffix_finder_t;
+
+
+static suffix_finder_t suffix_finder_make(const suffix_array_t *sa, arena_t *arena) {
+    assert(sa);
+    assert(arena);
+    return (suffix_finder_t) {
+        .sa = sa,
+        .latest = uint32_array_span_make(sa->suffixes.num * 2, arena)
+    };
+}
+
+
+// Reset the tree so that it holds all the source indices before the given one
+static void suffix_finder_reset(suffix_finder_t *sf, uint32_t index) {
+    assert(sf);
+    uint32_t num = sf->sa->suffixes.num;
+    memset(sf->latest.data, 0, sf->latest.num * sizeof(uint32_t));
+    for (uint32_t i = 0; i < index; i++) {
+        uint32_array_span_set(sf->latest, uint32_array_view_get(sf->sa->ranks, i) + num, i + 1);
+    }
+    for (uint32_t node = num; node-- > 1;) {
+        uint32_array_span_set(
+            sf->latest,
+            node,
+            max_uint32(uint32_array_span_get(sf->latest, node * 2), uint32_array_span_get(sf->latest, node * 2 + 1))
+        );
+    }
+}
+
+
+static void suffix_finder_add_index(suffix_finder_t *sf, uint32_t index) {
+    assert(sf);
+    uint32_t num = sf->sa->suffixes.num;
+    uint32_t node = uint32_array_view_get(sf->sa->ranks, index) + num;
+    uint32_array_span_set(sf->latest, node, index + 1);
+    while (node > 1) {
+        node /= 2;
+        uint32_array_span_set(
+            sf->latest,
+            node,
+            max_uint32(uint32_array_span_get(sf->latest, node * 2), uint32_array_span_get(sf->latest, node * 2 + 1))
+        );
+    }
+}
+
+
+static uint32_t suffix_finder_get_latest(const suffix_finder_t *sf, suffix_array_interval_t interval) {
+    assert(sf);
+    uint32_t num = sf->sa->suffixes.num;
+    uint32_t latest = 0;
+    for (uint32_t first = interval.first + num, end = interval.last + 1 + num; first < end; first /= 2, end /= 2) {
+        if (first & 1) {
+            latest = max_uint32(latest, uint32_array_span_get(sf->latest, first++));
+        }
+        if (end & 1) {
+            latest = max_uint32(latest, uint32_array_span_get(sf->latest, --end));
+        }
+    }
+    return latest;
+}
+
+
+// Pruning
+
+// Refs are added in order of increasing length and offset, and the offset cost never decreases with offset.
+// So if a ref costs the same as the following (longer) one for every number of fixed offset bits, the following ref
+// can be used in its place at no extra cost, and it can be dropped.
+// This leaves at most one ref per offset cost class, each the longest available with offsets in that class.
+// The cheapest offset cost for every length is unchanged, but the parse may break ties differently, which can
+// change how the tokens group into literal and ref runs, so the result may differ by a few bits either way.
+
+static uint64_t refs_get_offset_cost_class(uint16_t offset) {
+    // Put together the gamma code width for each number of fixed bits, as in get_hybrid_cost.
+    // Offsets beyond the range of a number of fixed bits get a class of their own.
+    uint64_t offset_class = 0;
+    for (uint32_t num_fixed_bits = 1; num_fixed_bits <= 8; num_fixed_bits++) {
+        uint32_t value = ((offset - 1U) >> num_fixed_bits) + 1;
+        offset_class = (offset_class << 8) | ((value <= 256) ? get_bit_width(value) : 0xFF);
+    }
+    return offset_class;
+}
+
+
+static uint32_t refs_prune_tokens(token_t *tokens, uint32_t num) {
+    uint32_t num_kept = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        if (i + 1 == num ||
+            refs_get_offset_cost_class(tokens[i].offset) != refs_get_offset_cost_class(tokens[i + 1].offset)) {
+            tokens[num_kept++] = tokens[i];
+        }
+    }
+    return num_kept;
+}
+
+
 // refs implementation
 
+// Offsets are held in 16 bits, so matches any further back than this can't be used
+#define REFS_MAX_OFFSET UINT16_MAX
+
 // For each element in the source data, we build a range of equivalent forms.
 // This is either a literal, or a reference to a previous run of values (with offset and length).
 // The idea here is that longer matches are better, but shorter offsets are preferable.
 // So look at all the matches backwards from the current position.
 // Only add a match if it is longer than the current longest one found.
 // We only add the longest match; when parsing we can look at the cost of all the shorter length matches.
+//
+// The token list for each index depends only on the source data, so the indices can be split into segments
+// and built concurrently. Each worker thread appends the encoded refs of the segments it builds to its own stream,
+// and these are stitched together in segment order at the end, so the result doesn't depend on the threading.
+
+
+// A contiguous run of source indices which is built as a single job
+typedef struct refs_segment_t {
+    uint32_t start;
+    uint32_t end;
+    uint32_t worker;
+    uint32_t data_start;
+    uint32_t data_end;
+} refs_segment_t;
+
+#define TEMPLATE_ARRAY_NAME refs_segment_array
+#define TEMPLATE_ARRAY_TYPE refs_segment_t
+#include "array.template.h"
 
-refs_t refs_make(byte_array_view_t src, arena_t *arena, arena_t scratch) {
-    // Use the scratch arena for the byte_pair_cache as we discard it when we exit
-    sequence_cache_t sequence_cache = sequence_cache_make(src, &scratch);
 
-    range_array_span_t ranges = range_array_span_make(src.num, arena);
-    token_array_t tokens = token_array_make(src.num * 16, arena);
+// The state owned by each worker thread
+typedef struct refs_worker_t {
+    arena_t *arena;
+    token_array_t tokens;       // the refs for the current index, before encoding
+    byte_array_t data;
+    suffix_finder_t suffix_finder;
+} refs_worker_t;
 
-    for (uint32_t i = 0; i < src.num; i++) {
-        uint32_t token_array_start = tokens.num;
+#define TEMPLATE_ARRAY_NAME refs_worker_array
+#define TEMPLATE_ARRAY_TYPE refs_worker_t
+#include "array.template.h"
 
-        // Add literal token
-        token_array_add(
-            &tokens,
-            token_make_literal(byte_array_view_get(src, i)),
-            arena
-        );
 
-        // Now find all the references
-        // They will be stored from shortest to longest
+// The state shared between all workers
+typedef struct refs_builder_t {
+    byte_array_view_t src;
+    refs_finder_t finder;
+    bool prune;
+    sequence_cache_t sequence_cache;
+    suffix_array_t suffix_array;
+    match_length_fn_t match_length;
+    uint32_array_span_t starts;     // start of each index in its worker's stream
+    refs_segment_array_span_t segments;
+    refs_worker_array_span_t workers;
+} refs_builder_t;
+
+
+// Returns the number of entries scanned to find the current index, for the stats
+static uint32_t refs_add_pair_matches(token_array_t *tokens, byte_array_view_t src, uint32_t i, const sequence_cache_t *sequence_cache, match_length_fn_t match_length, arena_t *arena) {
+    uint32_t key = byte_array_view_get(src, i) | (byte_array_view_get(src, i + 1) << 8);
+    indices_view_t indices = sequence_cache_get_indices(sequence_cache, key);
+
+    uint32_t best_length = 1;
+
+    // We have a list of all the indices containing the current two byte pair.
+    // The current index will be in this list, so find it, and then iterate backwards to the start for previous matches.
+    uint32_t match_index = indices_view_find(indices, i);
+    uint32_t num_pairs_scanned = match_index + 1;
+    while (match_index-- > 0) {
+        uint32_t j = indices_view_get(indices, match_index);
+        if (i - j > REFS_MAX_OFFSET) {
+            break;
+        }
+
+        // i is the higher of the two vertices, so this is the upper limit of the length we can compare to
+        // Meanwhile 256 is the fixed upper limit as we use a byte for the length.
+        uint32_t dist_to_end = src.num - i;
+        uint32_t max_length = (dist_to_end < 256) ? dist_to_end : 256;
+
+        // We already know the first two bytes match
+        uint32_t length = 2 + match_length(src.data + i + 2, src.data + j + 2, max_length - 2);
+
+        if (length > best_length) {
+            token_array_add(tokens, token_make_ref(i - j, length - 1), arena);
+            best_length = length;
+        }
+    }
+    return num_pairs_scanned;
+}
+
+
+static void refs_add_suffix_array_matches(token_array_t *tokens, byte_array_view_t src, uint32_t i, const suffix_finder_t *suffix_finder, arena_t *arena) {
+    const suffix_array_t *sa = suffix_finder->sa;
+    uint32_t rank = uint32_array_view_get(sa->ranks, i);
+    uint32_t max_length = min_uint32(src.num - i, 256);
+
+    // Look for the nearest previous match of at least a given length.
+    // Whatever length it actually matches, the next match we want is the nearest which is longer still,
+    // so each step yields exactly one new token.
+    for (uint32_t length = 2; length <= max_length; ) {
+        suffix_array_interval_t interval = suffix_array_get_interval(sa, rank, length);
+        uint32_t latest = suffix_finder_get_latest(suffix_finder, interval);
+        if (latest == 0) {
+            break;
+        }
+
+        // Any longer match will be further back still
+        uint32_t j = latest - 1;
+        if (i - j > REFS_MAX_OFFSET) {
+            break;
+        }
+
+        uint32_t match_length = min_uint32(suffix_array_get_lcp(sa, rank, uint32_array_view_get(sa->ranks, j)), max_length);
+        assert(match_length >= length);
+
+        token_array_add(tokens, token_make_ref(i - j, match_length - 1), arena);
+        length = match_length + 1;
+    }
+}
+
+
+static void refs_encode_tokens(byte_array_t *data, token_array_view_t tokens, arena_t *arena) {
+    token_t previous = token_make_literal(0);
+    for (uint32_t i = 0; i < tokens.num; i++) {
+        token_t token = token_array_view_get(tokens, i);
+        uint32_t previous_offset = token_is_literal(previous) ? 0 : previous.offset;
+        assert(!token_is_literal(token));
+        assert(token.length_minus_one > previous.length_minus_one);
+        assert(token.offset >= previous_offset);
+
+        byte_array_add(data, token.length_minus_one - previous.length_minus_one, arena);
+        uint32_t offset_increase = token.offset - previous_offset;
+        while (offset_increase >= 0x80) {
+            byte_array_add(data, (uint8_t)(offset_increase | 0x80), arena);
+            offset_increase >>= 7;
+        }
+        byte_array_add(data, (uint8_t)offset_increase, arena);
+
+        previous = token;
+    }
+    byte_array_add(data, 0, arena);
+}
+
+
+static void refs_build_segment(void *context, uint32_t segment_index, uint32_t worker_index) {
+    const refs_builder_t *builder = context;
+    byte_array_view_t src = builder->src;
+    refs_segment_t *segment = refs_segment_array_span_at(builder->segments, segment_index);
+    refs_worker_t *worker = refs_worker_array_span_at(builder->workers, worker_index);
+
+    if (builder->finder == refs_finder_suffix_array) {
+        suffix_finder_reset(&worker->suffix_finder, segment->start);
+    }
+
+    segment->worker = worker_index;
+    segment->data_start = worker->data.num;
+
+    uint64_t num_pairs_scanned = 0;
+    for (uint32_t i = segment->start; i < segment->end; i++) {
+        // Find all the references.
+        // They will be stored from shortest to longest; the literal token is implicit.
+        worker->tokens.num = 0;
         if (i < src.num - 1) {
-            uint32_t key = byte_array_view_get(src, i) | (byte_array_view_get(src, i + 1) << 8);
-            indices_view_t indices = sequence_cache_get_indices(&sequence_cache, key);
-
-            uint32_t best_length = 1;
-
-            // We have a list of all the indices containing the current two byte pair.
-            // The current index will be in this list, so find it, and then iterate backwards to the start for previous matches.
-            uint32_t match_index = indices_view_find(indices, i);
-            while (match_index-- > 0) {
-                uint32_t j = indices_view_get(indices, match_index);
-
-                // i is the higher of the two vertices, so this is the upper limit of the length we can compare to
-                // Meanwhile 256 is the fixed upper limit as we use a byte for the length.
-                uint32_t dist_to_end = src.num - i;
-                uint32_t max_length = (dist_to_end < 256) ? dist_to_end : 256;
-
-                uint32_t length = 2;
-                while (length < max_length && byte_array_view_get(src, i + length) == byte_array_view_get(src, j + length)) {
-                    length++;
-                }
-
-                if (length > best_length) {
-                    token_array_add(&tokens, token_make_ref(i - j, length - 1), arena);
-                    best_length = length;
-                }
+            if (builder->finder == refs_finder_suffix_array) {
+                refs_add_suffix_array_matches(&worker->tokens, src, i, &worker->suffix_finder, worker->arena);
+            }
+            else {
+                num_pairs_scanned += refs_add_pair_matches(&worker->tokens, src, i, &builder->sequence_cache, builder->match_length, worker->arena);
             }
         }
 
-        // Set the index range for this source data index
-        range_array_span_set(
-            ranges,
-            i,
-            (range_t) {
-                .start = token_array_start,
-                .end = tokens.num
-            }
+        if (builder->finder == refs_finder_suffix_array) {
+            suffix_finder_add_index(&worker->suffix_finder, i);
+        }
+
+        if (builder->prune) {
+            worker->tokens.num = refs_prune_tokens(worker->tokens.data, worker->tokens.num);
+        }
+
+        // For now the start is relative to the worker's stream; it is fixed up when the segments are stitched together.
+        uint32_array_span_set(builder->starts, i, worker->data.num);
+        refs_encode_tokens(&worker->data, worker->tokens.view, worker->arena);
+    }
+
+    segment->data_end = worker->data.num;
+    STATS_ADD(stats_counter_pairs_scanned, num_pairs_scanned);
+}
+
+
+refs_t refs_make(byte_array_view_t src, const refs_options_t *options, arena_t *arena, arena_t scratch) {
+    STATS_TIMER_BEGIN(stats_timer_refs_make);
+    refs_finder_t finder = options ? options->finder : refs_finder_pairs;
+    bool prune = options ? options->prune : false;
+    uint32_t num_threads = min_uint32(max_uint32(options ? options->num_threads : 1, 1), THREAD_POOL_MAX_THREADS);
+
+    // Use the scratch arena for the match finder as we discard it when we exit
+    arena_set_tag(&scratch, "refs finder");
+    refs_builder_t builder = {
+        .src = src,
+        .finder = finder,
+        .prune = prune,
+        .match_length = match_get_length_fn()
+    };
+
+    if (finder == refs_finder_suffix_array) {
+        STATS_TIMER_BEGIN(stats_timer_suffix_array_make);
+        builder.suffix_array = suffix_array_make(src, 256, &scratch);
+        STATS_TIMER_END(stats_timer_suffix_array_make);
+    }
+    else {
+        STATS_TIMER_BEGIN(stats_timer_sequence_cache_make);
+        builder.sequence_cache = sequence_cache_make(src, &scratch);
+        STATS_TIMER_END(stats_timer_sequence_cache_make);
+    }
+
+    // Give each thread a few segments to balance the load, but don't make them too small
+    uint32_t num_segments = (num_threads == 1) ? 1 : max_uint32(min_uint32(num_threads * 4, src.num / 256), 1);
+    builder.segments = refs_segment_array_span_make(num_segments, &scratch);
+    for (uint32_t n = 0; n < num_segments; n++) {
+        refs_segment_t *segment = refs_segment_array_span_at(builder.segments, n);
+        segment->start = (uint32_t)((uint64_t)src.num * n / num_segments);
+        segment->end = (uint32_t)((uint64_t)src.num * (n + 1) / num_segments);
+    }
+
+    builder.workers = refs_worker_array_span_make(num_threads, &scratch);
+    for (uint32_t w = 0; w < num_threads; w++) {
+        refs_worker_t *worker = refs_worker_array_span_at(builder.workers, w);
+        if (finder == refs_finder_suffix_array) {
+            worker->suffix_finder = suffix_finder_make(&builder.suffix_array, &scratch);
+        }
+    }
+
+    builder.starts = uint32_array_span_make(src.num, &scratch);
+
+    // Share out the rest of the scratch space between the workers.
+    // Each holds the refs for the index being built, and a stream which grows as they are encoded.
+    arena_t worker_arenas[THREAD_POOL_MAX_THREADS];
+    arena_set_tag(&scratch, "refs worker");
+    uint32_t worker_arena_size = ((scratch.end - scratch.next) / num_threads) & ~15U;
+    for (uint32_t w = 0; w < num_threads; w++) {
+        refs_worker_t *worker = refs_worker_array_span_at(builder.workers, w);
+        worker_arenas[w] = arena_alloc_subarena(&scratch, worker_arena_size);
+        worker->arena = &worker_arenas[w];
+        worker->tokens = token_array_make(256, worker->arena);
+        worker->data = byte_array_make(src.num * 4 / num_threads, worker->arena);
+    }
+
+    STATS_TIMER_BEGIN(stats_timer_refs_find);
+    thread_pool_run(num_threads, num_segments, refs_build_segment, &builder);
+    STATS_TIMER_END(stats_timer_refs_find);
+
+    // Stitch the segments together in order, rebasing their starts onto the final stream
+    uint32_t num_bytes = 0;
+    for (uint32_t n = 0; n < num_segments; n++) {
+        const refs_segment_t *segment = refs_segment_array_span_at(builder.segments, n);
+        num_bytes += segment->data_end - segment->data_start;
+    }
+
+    uint32_array_span_t block_starts = uint32_array_span_make((src.num + REFS_BLOCK_SIZE - 1) / REFS_BLOCK_SIZE, arena);
+    uint16_array_span_t starts = uint16_array_span_make(src.num, arena);
+    byte_array_span_t data = byte_array_span_make(num_bytes, arena);
+
+    uint32_t data_num = 0;
+    for (uint32_t n = 0; n < num_segments; n++) {
+        const refs_segment_t *segment = refs_segment_array_span_at(builder.segments, n);
+        const refs_worker_t *worker = refs_worker_array_span_at(builder.workers, segment->worker);
+
+        memcpy(
+            data.data + data_num,
+            worker->data.data + segment->data_start,
+            segment->data_end - segment->data_start
         );
+
+        for (uint32_t i = segment->start; i < segment->end; i++) {
+            uint32_t start = uint32_array_span_get(builder.starts, i) - segment->data_start + data_num;
+            if (i % REFS_BLOCK_SIZE == 0) {
+                uint32_array_span_set(block_starts, i / REFS_BLOCK_SIZE, start);
+            }
+
+            // An index has at most 255 refs of at most 4 bytes each, so a block always fits in 64k
+            uint32_t start_in_block = start - uint32_array_span_get(block_starts, i / REFS_BLOCK_SIZE);
+            assert(start_in_block <= UINT16_MAX);
+            uint16_array_span_set(starts, i, (uint16_t)start_in_block);
+        }
+
+        data_num += segment->data_end - segment->data_start;
     }
 
+    STATS_TIMER_END(stats_timer_refs_make);
     return (refs_t) {
-        .ranges = ranges.view,
-        .tokens = tokens.view
+        .src = src,
+        .block_starts = block_starts.view,
+        .starts = starts.view,
+        .data = data.view
     };
 }
 
 
-token_array_view_t refs_get_tokens(const refs_t *refs, uint32_t index) {
-    range_t range = range_array_view_get(refs->ranges, index);
-    return token_array_view_make_subview(refs->tokens, range.start, range.end);
+void refs_free(refs_t *refs, arena_t *arena) {
+    assert(refs);
+    assert(arena);
+    arena_free(arena, (void *)refs->data.data, refs->data.num);
+    arena_free(arena, (void *)refs->starts.data, refs->starts.num * sizeof(uint16_t));
+    arena_free(arena, (void *)refs->block_starts.data, refs->block_starts.num * sizeof(uint32_t));
+    *refs = (refs_t) {0};
+}
+
+
+token_array_view_t refs_get_tokens(const refs_t *refs, uint32_t index, arena_t *arena) {
+    token_array_t tokens = token_array_make(4, arena);
+    refs_iterator_t it = refs_get_iterator(refs, index);
+    token_t token;
+    while (refs_iterator_next(&it, &token)) {
+        token_array_add(&tokens, token, arena);
+    }
+    return tokens.view;
 }
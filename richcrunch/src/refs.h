@@ -4,40 +4,114 @@
 #include "arena.h"
 #include "byte_array.h"
 #include "token.h"
+#include "uint16_array.h"
+#include "uint32_array.h"
 #include <assert.h>
+#include <stdbool.h>
 
 
-// A [start, end) pair of indices
-typedef struct range_t {
-    uint32_t start;
-    uint32_t end;
-} range_t;
+// The available match finders.
+// Both produce identical results; they differ only in speed on different kinds of data.
+typedef enum refs_finder_t {
+    refs_finder_pairs,          // scan back through previous occurrences of each byte pair
+    refs_finder_suffix_array    // query a suffix array, which stays fast on highly repetitive data
+} refs_finder_t;
 
 
-// Define range array types
-#define TEMPLATE_ARRAY_NAME range_array
-#define TEMPLATE_ARRAY_TYPE range_t
-#include "array.template.h"
+// Options for building refs
+typedef struct refs_options_t {
+    refs_finder_t finder;
+    uint32_t num_threads;       // 0 or 1 to build on the calling thread only
+    bool prune;                 // drop refs which a longer ref can replace at the same offset cost
+} refs_options_t;
 
 
+// This is the manager object which maps source data indices to possible token representations.
+//
+// Each index has a literal token (the source byte itself) followed by refs in order of increasing length
+// and offset. These are stored compactly as a byte stream: for each ref, the increase in length_minus_one
+// as a single byte, then the increase in offset as a little-endian base 128 varint. A zero byte ends the list.
+// To find the list for an index, we keep the start of each block of REFS_BLOCK_SIZE indices, and the start
+// of each index relative to its block.
+
+#define REFS_BLOCK_SIZE 64
 
-// This is the manager object which maps source data indices to possible token representations
 typedef struct refs_t {
-    range_array_view_t ranges;
-    token_array_view_t tokens;
+    byte_array_view_t src;
+    uint32_array_view_t block_starts;
+    uint16_array_view_t starts;
+    byte_array_view_t data;
 } refs_t;
 
 
-// Make an initialised refs_t from the data provided
-refs_t refs_make(byte_array_view_t data, arena_t *arena, arena_t scratch);
+// Iterator over the tokens for an index
+typedef struct refs_iterator_t {
+    const uint8_t *next;        // the next encoded ref
+    token_t token;              // the last token returned
+    bool started;
+} refs_iterator_t;
+
+
+// Make an initialised refs_t from the data provided.
+// options may be null, in which case the defaults are used.
+// The result is allocated last in the arena, so it can be discarded with refs_free when no longer needed.
+refs_t refs_make(byte_array_view_t data, const refs_options_t *options, arena_t *arena, arena_t scratch);
 
-// Get a list of tokens for the given index
-token_array_view_t refs_get_tokens(const refs_t *refs, uint32_t index);
+// Free the refs, if they are the last allocations in the arena
+void refs_free(refs_t *refs, arena_t *arena);
+
+// Get a list of tokens for the given index, decoded into the arena
+token_array_view_t refs_get_tokens(const refs_t *refs, uint32_t index, arena_t *arena);
 
 // Get number of indices
 static inline uint32_t refs_num(const refs_t *refs) {
     assert(refs);
-    return refs->ranges.num;
+    return refs->src.num;
+}
+
+// Get an iterator over the tokens for the given index.
+// Nothing is returned until the first call to refs_iterator_next.
+static inline refs_iterator_t refs_get_iterator(const refs_t *refs, uint32_t index) {
+    assert(refs);
+    uint32_t start = uint32_array_view_get(refs->block_starts, index / REFS_BLOCK_SIZE) + uint16_array_view_get(refs->starts, index);
+    assert(start < refs->data.num);
+    return (refs_iterator_t) {
+        .next = refs->data.data + start,
+        .token = token_make_literal(byte_array_view_get(refs->src, index))
+    };
+}
+
+// Get the next token from the iterator, returning false if there are no more.
+// The literal is always first.
+static inline bool refs_iterator_next(refs_iterator_t *it, token_t *token) {
+    assert(it);
+    assert(token);
+    if (!it->started) {
+        it->started = true;
+        *token = it->token;
+        return true;
+    }
+
+    uint32_t length_increase = *it->next;
+    if (length_increase == 0) {
+        return false;
+    }
+    it->next++;
+
+    uint32_t offset_increase = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *it->next++;
+        offset_increase |= (uint32_t)(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+
+    uint32_t offset = (token_is_literal(it->token) ? 0 : it->token.offset) + offset_increase;
+    it->token = token_make_ref((uint16_t)offset, (uint8_t)(it->token.length_minus_one + length_increase));
+    *token = it->token;
+    return true;
 }
 
 
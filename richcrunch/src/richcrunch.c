@@ -0,0 +1,247 @@
+#include "richcrunch.h"
+#include "arena.h"
+#include "huffman.h"
+#include "lz.h"
+#include "lzhuff.h"
+#include "method.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include "version.h"
+#include <assert.h>
+#include <stdlib.h>
+
+
+// The most a huffman block can hold, as its size is stored in 16 bits
+#define RICHCRUNCH_HUFFMAN_MAX_SIZE 0xFFFFU
+
+// A bound on the working memory an lz parse needs for each byte of input, which is about 140 bytes in practice.
+// Inputs which would need more than a context's arenas hold are turned away, rather than running out part way.
+#define RICHCRUNCH_LZ_BYTES_PER_INPUT_BYTE 256U
+
+
+struct richcrunch_context_t {
+    thread_mutex_t lock;        // held for each call, so that calls on the same context run one at a time
+    lz_options_t lz_options;
+    arena_t arena;              // the output of the last call
+    arena_t scratch;
+};
+
+
+const char *richcrunch_get_version(void) {
+    return VERSION;
+}
+
+
+const char *richcrunch_get_error_string(richcrunch_error_t error) {
+    switch (error) {
+        case richcrunch_error_none:             return "no error";
+        case richcrunch_error_invalid_argument: return "invalid argument";
+        case richcrunch_error_unsupported:      return "not supported by this codec";
+        case richcrunch_error_too_large:        return "input too large for this codec";
+        case richcrunch_error_corrupt:          return "corrupt data";
+        default:                                return "unknown error";
+    }
+}
+
+
+richcrunch_context_t *richcrunch_create(const richcrunch_options_t *options) {
+    richcrunch_context_t *context = calloc(1, sizeof(richcrunch_context_t));
+    if (!context) {
+        return 0;
+    }
+    if (!thread_mutex_init(&context->lock)) {
+        free(context);
+        return 0;
+    }
+
+    bool huge_pages = options ? options->huge_pages : false;
+    context->lz_options = (lz_options_t) {
+        .finder = (options && options->finder == richcrunch_finder_suffix_array) ? refs_finder_suffix_array : refs_finder_pairs,
+        .num_threads = options ? options->num_threads : 1,
+        .prune = options ? options->prune : false,
+        .parser =
+            !options ? lz_parser_optimal :
+            (options->parser == richcrunch_parser_greedy) ? lz_parser_greedy :
+            (options->parser == richcrunch_parser_lazy) ? lz_parser_lazy :
+            lz_parser_optimal
+    };
+    context->arena = arena_try_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, huge_pages);
+    context->scratch = arena_try_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, huge_pages);
+    if (!context->arena.base || !context->scratch.base) {
+        richcrunch_destroy(context);
+        return 0;
+    }
+    return context;
+}
+
+
+void richcrunch_destroy(richcrunch_context_t *context) {
+    if (context) {
+        arena_deinit(&context->scratch);
+        arena_deinit(&context->arena);
+        thread_mutex_deinit(&context->lock);
+        free(context);
+    }
+}
+
+
+// Check the arguments common to every call, and the input size each codec can take
+static richcrunch_error_t richcrunch_check_input(const richcrunch_context_t *context, richcrunch_codec_t codec, const void *src, size_t src_size) {
+    if (!context || !src || src_size == 0) {
+        return richcrunch_error_invalid_argument;
+    }
+    if (codec > richcrunch_codec_auto) {
+        return richcrunch_error_invalid_argument;
+    }
+    if ((uint64_t)src_size >= UINT32_MAX) {
+        return richcrunch_error_too_large;
+    }
+    // The arenas may be smaller than asked for, where address space is short
+    uint32_t arena_size = min_uint32(context->arena.end, context->scratch.end);
+    if (codec != richcrunch_codec_huffman && src_size > arena_size / RICHCRUNCH_LZ_BYTES_PER_INPUT_BYTE) {
+        return richcrunch_error_too_large;
+    }
+    // auto tries huffman too
+    if ((codec == richcrunch_codec_huffman || codec == richcrunch_codec_auto) && src_size > RICHCRUNCH_HUFFMAN_MAX_SIZE) {
+        return richcrunch_error_too_large;
+    }
+    return richcrunch_error_none;
+}
+
+
+// Compress into the context's arena.
+// This is called with the context locked, and the previous output released.
+static richcrunch_error_t richcrunch_compress_locked(richcrunch_context_t *context, richcrunch_codec_t codec, byte_array_view_t src, richcrunch_output_t *output) {
+    arena_t *arena = &context->arena;
+    byte_array_view_t compressed = {0};
+
+    if (codec == richcrunch_codec_lz) {
+        lz_parse_result_t lz = lz_parse(src, &context->lz_options, arena, context->scratch);
+        compressed = lz_serialise(&lz, arena);
+    }
+    else if (codec == richcrunch_codec_huffman) {
+        compressed = huffman_serialise(src, arena, context->scratch);
+    }
+    else if (codec == richcrunch_codec_auto) {
+        method_result_t result = method_choose(src, &context->lz_options, arena, context->scratch);
+        if (!result.compressed.data) {
+            return richcrunch_error_corrupt;
+        }
+        compressed = result.compressed;
+        codec = (result.method == method_lz) ? richcrunch_codec_lz : richcrunch_codec_huffman;
+    }
+    else {
+        return richcrunch_error_unsupported;
+    }
+
+    *output = (richcrunch_output_t) {
+        .data = compressed.data,
+        .size = compressed.num,
+        .codec = codec
+    };
+    return richcrunch_error_none;
+}
+
+
+richcrunch_error_t richcrunch_compress(richcrunch_context_t *context, richcrunch_codec_t codec, const void *src, size_t src_size, richcrunch_output_t *output) {
+    richcrunch_error_t error = richcrunch_check_input(context, codec, src, src_size);
+    if (error != richcrunch_error_none || !output) {
+        return output ? error : richcrunch_error_invalid_argument;
+    }
+
+    thread_mutex_lock(&context->lock);
+    arena_reset(&context->arena);
+    error = richcrunch_compress_locked(context, codec, (byte_array_view_t) {.data = src, .num = (uint32_t)src_size}, output);
+    thread_mutex_unlock(&context->lock);
+    return error;
+}
+
+
+richcrunch_error_t richcrunch_decompress(richcrunch_context_t *context, richcrunch_codec_t codec, const void *compressed, size_t compressed_size, richcrunch_output_t *output) {
+    if (!context || !compressed || compressed_size == 0 || !output) {
+        return richcrunch_error_invalid_argument;
+    }
+    if ((uint64_t)compressed_size >= UINT32_MAX) {
+        return richcrunch_error_too_large;
+    }
+    if (codec != richcrunch_codec_lz && codec != richcrunch_codec_huffman) {
+        return (codec > richcrunch_codec_auto) ? richcrunch_error_invalid_argument : richcrunch_error_unsupported;
+    }
+
+    byte_array_view_t src = {.data = compressed, .num = (uint32_t)compressed_size};
+    richcrunch_error_t error = richcrunch_error_none;
+
+    thread_mutex_lock(&context->lock);
+    arena_reset(&context->arena);
+
+    byte_array_view_t expanded = {0};
+    if (codec == richcrunch_codec_lz) {
+        // The size is worked out first, so that we can decompress straight into a buffer of that size.
+        // Every ref takes at least a few bits and gives at most 256 bytes, which bounds the size of valid data.
+        uint32_t size = lz_get_decompressed_size(src);
+        if ((uint64_t)size > (uint64_t)compressed_size * 8 * 256) {
+            error = richcrunch_error_corrupt;
+        }
+        else if (size > context->arena.end) {
+            error = richcrunch_error_too_large;
+        }
+        else {
+            byte_array_span_t dest = byte_array_span_make(size, &context->arena);
+            if (lz_decompress(src, dest)) {
+                expanded = dest.view;
+            }
+            else {
+                error = richcrunch_error_corrupt;
+            }
+        }
+    }
+    else {
+        expanded = huffman_deserialise(src, &context->arena, context->scratch);
+        if (!expanded.data) {
+            error = richcrunch_error_corrupt;
+        }
+    }
+
+    *output = (richcrunch_output_t) {
+        .data = expanded.data,
+        .size = expanded.num,
+        .codec = codec
+    };
+
+    thread_mutex_unlock(&context->lock);
+    return error;
+}
+
+
+richcrunch_error_t richcrunch_estimate(richcrunch_context_t *context, richcrunch_codec_t codec, const void *src, size_t src_size, size_t *estimated_size) {
+    richcrunch_error_t error = richcrunch_check_input(context, codec, src, src_size);
+    if (error != richcrunch_error_none || !estimated_size) {
+        return estimated_size ? error : richcrunch_error_invalid_argument;
+    }
+
+    byte_array_view_t view = {.data = src, .num = (uint32_t)src_size};
+
+    thread_mutex_lock(&context->lock);
+    arena_reset(&context->arena);
+
+    if (codec == richcrunch_codec_lz) {
+        // The size is known from the parse, without serialising it
+        lz_parse_result_t lz = lz_parse(view, &context->lz_options, &context->arena, context->scratch);
+        *estimated_size = lz_get_serialised_size(&lz);
+    }
+    else if (codec == richcrunch_codec_lzhuff) {
+        lzhuff_result_t lzhuff = lzhuff_parse(view, &context->lz_options, &context->arena, context->scratch);
+        *estimated_size = (lzhuff_item_array_view_get(lzhuff.items, 0).total_cost + 7) / 8;
+    }
+    else {
+        // The others only know their size once they've been compressed
+        richcrunch_output_t output = {0};
+        error = richcrunch_compress_locked(context, codec, view, &output);
+        *estimated_size = output.size;
+    }
+
+    // Nothing from an estimate is kept
+    arena_reset(&context->arena);
+    thread_mutex_unlock(&context->lock);
+    return error;
+}
@@ -0,0 +1,138 @@
+#ifndef RICHCRUNCH_H_
+#define RICHCRUNCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// The library interface, for compressing in-process rather than running the tool once per file.
+//
+// This header is the only stable part of the library: its types are only ever added to, and everything else may
+// change from one version to the next.
+// All the working memory belongs to a context, and is reused from one call to the next. The calls on a context are
+// run one at a time, so it may be shared between threads, but to compress in parallel, make a context per thread.
+// The output of a call belongs to the context, and is valid until the next call on it, from any thread, or until it's
+// destroyed. So a shared context is only safe to use without locking of your own for richcrunch_estimate, whose
+// result is returned by value.
+
+#if defined(RICHCRUNCH_SHARED) && defined(_WIN32)
+#ifdef RICHCRUNCH_BUILDING
+#define RICHCRUNCH_API __declspec(dllexport)
+#else
+#define RICHCRUNCH_API __declspec(dllimport)
+#endif
+#elif defined(RICHCRUNCH_SHARED) && defined(__GNUC__)
+#define RICHCRUNCH_API __attribute__((visibility("default")))
+#else
+#define RICHCRUNCH_API
+#endif
+
+#define RICHCRUNCH_API_VERSION 2
+
+
+typedef struct richcrunch_context_t richcrunch_context_t;
+
+
+typedef enum richcrunch_codec_t {
+    richcrunch_codec_lz,
+    richcrunch_codec_huffman,
+    richcrunch_codec_lzhuff,        // can only be estimated, as it can't be serialised yet
+    richcrunch_codec_auto           // the smallest output of the others; the output says which it was
+} richcrunch_codec_t;
+
+
+typedef enum richcrunch_finder_t {
+    richcrunch_finder_pairs,
+    richcrunch_finder_suffix_array
+} richcrunch_finder_t;
+
+
+// How the lz codec chooses its tokens, from the smallest output to the fastest
+typedef enum richcrunch_parser_t {
+    richcrunch_parser_optimal,
+    richcrunch_parser_lazy,
+    richcrunch_parser_greedy
+} richcrunch_parser_t;
+
+
+typedef enum richcrunch_error_t {
+    richcrunch_error_none,
+    richcrunch_error_invalid_argument,
+    richcrunch_error_unsupported,   // the codec can't do this
+    richcrunch_error_too_large,     // the input is bigger than the codec can represent, or the context can hold
+    richcrunch_error_corrupt        // the compressed data doesn't decompress, or the output didn't verify
+} richcrunch_error_t;
+
+
+// Options for a context.
+// A zero-initialised richcrunch_options_t gives the defaults.
+typedef struct richcrunch_options_t {
+    richcrunch_finder_t finder;
+    uint32_t num_threads;           // 0 or 1 to run on the calling thread only
+    bool prune;                     // drop match candidates which a longer one can replace at the same cost (faster)
+    bool huge_pages;                // ask for transparent huge pages for working memory
+    richcrunch_parser_t parser;     // for lz, and auto's lz candidate; lzhuff always uses the optimal parse
+} richcrunch_options_t;
+
+
+typedef struct richcrunch_output_t {
+    const uint8_t *data;
+    size_t size;
+    richcrunch_codec_t codec;       // the codec which made the output
+} richcrunch_output_t;
+
+
+// Get the version of the library, as a string
+RICHCRUNCH_API const char *richcrunch_get_version(void);
+
+// Get a description of an error
+RICHCRUNCH_API const char *richcrunch_get_error_string(richcrunch_error_t error);
+
+// Make a context to compress with.
+// options may be null, in which case the defaults are used. Returns null if it can't be made.
+RICHCRUNCH_API richcrunch_context_t *richcrunch_create(const richcrunch_options_t *options);
+
+// Destroy a context, and the output of its last call
+RICHCRUNCH_API void richcrunch_destroy(richcrunch_context_t *context);
+
+// Compress src with the given codec
+RICHCRUNCH_API richcrunch_error_t richcrunch_compress(
+    richcrunch_context_t *context,
+    richcrunch_codec_t codec,
+    const void *src,
+    size_t src_size,
+    richcrunch_output_t *output
+);
+
+// Decompress data which was compressed with the given codec.
+// The output of richcrunch_codec_auto says which codec to decompress it with.
+// The data is checked as it's decompressed, and if it isn't valid for the codec, richcrunch_error_corrupt is returned.
+RICHCRUNCH_API richcrunch_error_t richcrunch_decompress(
+    richcrunch_context_t *context,
+    richcrunch_codec_t codec,
+    const void *compressed,
+    size_t compressed_size,
+    richcrunch_output_t *output
+);
+
+// Get the size src would compress to with the given codec, without writing the output.
+// This is exact for every codec but lzhuff, which is worked out from the cost of the parse.
+RICHCRUNCH_API richcrunch_error_t richcrunch_estimate(
+    richcrunch_context_t *context,
+    richcrunch_codec_t codec,
+    const void *src,
+    size_t src_size,
+    size_t *estimated_size
+);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ifndef RICHCRUNCH_H_
@@ -0,0 +1,519 @@
+// For sockets and getcwd under strict C
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "serve.h"
+#include "arena.h"
+#include "file.h"
+#include "richcrunch.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define SERVE_ENABLED
+#endif
+
+
+#ifdef SERVE_ENABLED
+
+// A client which goes away before its reply is sent shouldn't take the server down with SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SERVE_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SERVE_SEND_FLAGS 0
+#endif
+
+// The number of accepted connections which can wait for a worker
+#define SERVE_MAX_PENDING 64
+
+// How often a worker waiting on an idle connection checks whether the server is stopping
+#define SERVE_POLL_INTERVAL_MS 100
+
+
+typedef struct serve_t {
+    const char *socket_path;
+    richcrunch_options_t options;
+    thread_atomic_uint32_t stopping;    // non-zero once a shutdown has been asked for
+
+    // Accepted connections waiting for a worker, in a ring
+    thread_mutex_t lock;
+    thread_condition_t changed;
+    int pending[SERVE_MAX_PENDING];
+    uint32_t first_pending;
+    uint32_t num_pending;
+    bool closed;                // no more connections will be queued
+} serve_t;
+
+
+// Make a socket address for the given path, returning false if the path is too long
+static bool serve_make_address(const char *socket_path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        return false;
+    }
+    strcpy(address->sun_path, socket_path);
+    return true;
+}
+
+
+// Connect to the server at the given path, returning the socket, or -1 if it can't be reached
+static int serve_connect(const char *socket_path) {
+    struct sockaddr_un address;
+    if (!serve_make_address(socket_path, &address)) {
+        return -1;
+    }
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    if (connect(connection, (const struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+
+// Make sure the socket path is free to bind, returning false if it isn't.
+// Only a stale socket, which nothing answers on, is removed; anything else is left alone.
+static bool serve_claim_path(const char *socket_path) {
+    struct stat path_stat;
+    if (lstat(socket_path, &path_stat) != 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        fprintf(stderr, "Can't check socket path '%s'\n", socket_path);
+        return false;
+    }
+    if (!S_ISSOCK(path_stat.st_mode)) {
+        fprintf(stderr, "Socket path '%s' exists and isn't a socket\n", socket_path);
+        return false;
+    }
+    int connection = serve_connect(socket_path);
+    if (connection >= 0) {
+        close(connection);
+        fprintf(stderr, "A server is already listening on '%s'\n", socket_path);
+        return false;
+    }
+    if (unlink(socket_path) != 0) {
+        fprintf(stderr, "Can't remove stale socket '%s'\n", socket_path);
+        return false;
+    }
+    return true;
+}
+
+
+// Send the whole of a buffer, returning false if the other end has gone
+static bool serve_send_all(int connection, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t num_sent = send(connection, data, size, SERVE_SEND_FLAGS);
+        if (num_sent <= 0) {
+            return false;
+        }
+        data += num_sent;
+        size -= (size_t)num_sent;
+    }
+    return true;
+}
+
+
+// Queue an accepted connection for a worker, waiting for room if they're all busy
+static void serve_push(serve_t *serve, int connection) {
+    thread_mutex_lock(&serve->lock);
+    while (serve->num_pending == SERVE_MAX_PENDING) {
+        thread_condition_wait(&serve->changed, &serve->lock);
+    }
+    serve->pending[(serve->first_pending + serve->num_pending) % SERVE_MAX_PENDING] = connection;
+    serve->num_pending++;
+    thread_condition_broadcast(&serve->changed);
+    thread_mutex_unlock(&serve->lock);
+}
+
+
+// Take the next connection from the queue, waiting for one to arrive.
+// Returns -1 once the queue is closed and empty.
+static int serve_pop(serve_t *serve) {
+    thread_mutex_lock(&serve->lock);
+    while (serve->num_pending == 0 && !serve->closed) {
+        thread_condition_wait(&serve->changed, &serve->lock);
+    }
+    int connection = -1;
+    if (serve->num_pending > 0) {
+        connection = serve->pending[serve->first_pending];
+        serve->first_pending = (serve->first_pending + 1) % SERVE_MAX_PENDING;
+        serve->num_pending--;
+        thread_condition_broadcast(&serve->changed);
+    }
+    thread_mutex_unlock(&serve->lock);
+    return connection;
+}
+
+
+// Carry out a compress or verify request, putting the reply in reply
+static void serve_compress(const char *command, const char *type, const char *input, const char *output, richcrunch_context_t *context, arena_t *arena, char *reply, size_t reply_size) {
+    richcrunch_codec_t codec =
+        (strcmp(type, "lz") == 0) ? richcrunch_codec_lz :
+        (strcmp(type, "huffman") == 0) ? richcrunch_codec_huffman :
+        (strcmp(type, "auto") == 0) ? richcrunch_codec_auto :
+        richcrunch_codec_lzhuff;
+    if (codec == richcrunch_codec_lzhuff) {
+        snprintf(reply, reply_size, "error unknown type");
+        return;
+    }
+
+    double start = get_time_ms();
+    arena_reset(arena);
+
+    file_read_result_t src = file_read_binary(input, arena);
+    if (src.error.type != file_error_none) {
+        snprintf(reply, reply_size, "error can't read input");
+        return;
+    }
+
+    richcrunch_output_t compressed = {0};
+    richcrunch_error_t error = richcrunch_compress(context, codec, src.contents.data, src.contents.num, &compressed);
+    if (error != richcrunch_error_none) {
+        snprintf(reply, reply_size, "error %s", richcrunch_get_error_string(error));
+        return;
+    }
+
+    // The output only lasts until the next call on the context, so it's copied out before being verified
+    byte_array_span_t kept = byte_array_span_make((uint32_t)compressed.size, arena);
+    memcpy(kept.data, compressed.data, compressed.size);
+    richcrunch_codec_t chosen = compressed.codec;
+
+    if (file_write_binary(output, kept.view).type != file_error_none) {
+        snprintf(reply, reply_size, "error can't write output");
+        return;
+    }
+
+    if (strcmp(command, "verify") == 0) {
+        richcrunch_output_t expanded = {0};
+        error = richcrunch_decompress(context, chosen, kept.data, kept.num, &expanded);
+        if (error != richcrunch_error_none || expanded.size != src.contents.num ||
+            memcmp(expanded.data, src.contents.data, expanded.size) != 0) {
+            snprintf(reply, reply_size, "error verify failed");
+            return;
+        }
+    }
+
+    snprintf(reply, reply_size, "ok %s %u %u %.1f",
+        (chosen == richcrunch_codec_lz) ? "lz" : "huffman",
+        src.contents.num,
+        kept.num,
+        get_time_ms() - start
+    );
+}
+
+
+// Carry out a request line, putting the reply in reply.
+// Returns false if the connection should be closed after replying.
+static bool serve_request(serve_t *serve, const char *line, richcrunch_context_t *context, arena_t *arena, char *reply, size_t reply_size) {
+    char command[16];
+    char type[16];
+    char input[SERVE_MAX_LINE];
+    char output[SERVE_MAX_LINE];
+    char extra[2];
+    int num_fields = sscanf(line, "%15s %15s %4095s %4095s %1s", command, type, input, output, extra);
+
+    if (num_fields == 1 && strcmp(command, "shutdown") == 0) {
+        // Stop accepting, then wake the listener with a connection of our own so that it sees the flag
+        thread_atomic_store_uint32(&serve->stopping, 1);
+        int wake = serve_connect(serve->socket_path);
+        if (wake >= 0) {
+            close(wake);
+        }
+        snprintf(reply, reply_size, "ok");
+        return false;
+    }
+
+    if (num_fields == 4 && (strcmp(command, "compress") == 0 || strcmp(command, "verify") == 0)) {
+        serve_compress(command, type, input, output, context, arena, reply, reply_size);
+        return true;
+    }
+
+    snprintf(reply, reply_size, "error expected 'compress|verify <type> <input> <output>' or 'shutdown'");
+    return true;
+}
+
+
+// Serve the requests on a connection until it's closed, or until the server is stopping and the connection is idle
+static void serve_connection(serve_t *serve, int connection, richcrunch_context_t *context, arena_t *arena) {
+    char buffer[SERVE_MAX_LINE];
+    char reply[SERVE_MAX_LINE + 1];
+    size_t num = 0;
+
+    while (true) {
+        // Wait for more of a request, a little at a time, so that a client holding its connection open can't keep the
+        // server from stopping. Anything the client has already sent is still served.
+        struct pollfd waiting = {.fd = connection, .events = POLLIN};
+        int num_ready = poll(&waiting, 1, SERVE_POLL_INTERVAL_MS);
+        if (num_ready < 0 && errno != EINTR) {
+            return;
+        }
+        if (num_ready <= 0) {
+            if (thread_atomic_load_uint32(&serve->stopping)) {
+                return;
+            }
+            continue;
+        }
+
+        ssize_t num_received = recv(connection, buffer + num, sizeof(buffer) - 1 - num, 0);
+        if (num_received <= 0) {
+            return;
+        }
+        num += (size_t)num_received;
+
+        // Reply to each complete line
+        char *start = buffer;
+        char *end;
+        while ((end = memchr(start, '\n', (size_t)(buffer + num - start))) != 0) {
+            *end = 0;
+            if (end > start && end[-1] == '\r') {
+                end[-1] = 0;
+            }
+            bool keep_open = serve_request(serve, start, context, arena, reply, SERVE_MAX_LINE);
+            strcat(reply, "\n");
+            if (!serve_send_all(connection, reply, strlen(reply)) || !keep_open) {
+                return;
+            }
+            start = end + 1;
+        }
+
+        // Keep the start of the next line
+        num = (size_t)(buffer + num - start);
+        memmove(buffer, start, num);
+        if (num == sizeof(buffer) - 1) {
+            const char *error = "error request too long\n";
+            serve_send_all(connection, error, strlen(error));
+            return;
+        }
+    }
+}
+
+
+static int serve_worker_main(void *arg) {
+    serve_t *serve = arg;
+
+    // The context and the arena for the inputs are kept for every connection this worker serves
+    richcrunch_context_t *context = richcrunch_create(&serve->options);
+    arena_t arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, serve->options.huge_pages);
+
+    int connection;
+    while ((connection = serve_pop(serve)) >= 0) {
+        if (context) {
+            serve_connection(serve, connection, context, &arena);
+        }
+        close(connection);
+    }
+
+    arena_deinit(&arena);
+    richcrunch_destroy(context);
+    return 0;
+}
+
+
+bool serve_run(const char *socket_path, const serve_options_t *options) {
+    assert(socket_path);
+    assert(options);
+
+    struct sockaddr_un address;
+    if (!serve_make_address(socket_path, &address)) {
+        fprintf(stderr, "Socket path too long: '%s'\n", socket_path);
+        return false;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Can't make a socket\n");
+        return false;
+    }
+    if (!serve_claim_path(socket_path)) {
+        close(listener);
+        return false;
+    }
+
+    // Requests name files to read and write with the server's permissions, so only our user may connect
+    mode_t previous_mask = umask(077);
+    bool bound = bind(listener, (const struct sockaddr *)&address, sizeof(address)) == 0;
+    umask(previous_mask);
+    if (!bound || listen(listener, SERVE_MAX_PENDING) != 0) {
+        fprintf(stderr, "Can't listen on '%s'\n", socket_path);
+        if (bound) {
+            unlink(socket_path);
+        }
+        close(listener);
+        return false;
+    }
+
+    serve_t serve = {
+        .socket_path = socket_path,
+        .options = {
+            .finder = (options->lz_options.finder == refs_finder_suffix_array) ? richcrunch_finder_suffix_array : richcrunch_finder_pairs,
+            .num_threads = options->lz_options.num_threads,
+            .prune = options->lz_options.prune,
+            .huge_pages = options->huge_pages,
+            .parser =
+                (options->lz_options.parser == lz_parser_greedy) ? richcrunch_parser_greedy :
+                (options->lz_options.parser == lz_parser_lazy) ? richcrunch_parser_lazy :
+                richcrunch_parser_optimal
+        }
+    };
+    if (!thread_mutex_init(&serve.lock)) {
+        fprintf(stderr, "Can't make a lock\n");
+        close(listener);
+        unlink(socket_path);
+        return false;
+    }
+    if (!thread_condition_init(&serve.changed)) {
+        fprintf(stderr, "Can't make a condition variable\n");
+        thread_mutex_deinit(&serve.lock);
+        close(listener);
+        unlink(socket_path);
+        return false;
+    }
+
+    // If we can't start as many workers as we'd like, just carry on with the ones we have
+    thread_handle_t workers[SERVE_NUM_WORKERS];
+    uint32_t num_workers = 0;
+    for (uint32_t w = 0; w < SERVE_NUM_WORKERS; w++) {
+        if (thread_start(&workers[num_workers], serve_worker_main, &serve)) {
+            num_workers++;
+        }
+    }
+    if (num_workers == 0) {
+        fprintf(stderr, "Can't start any workers\n");
+        close(listener);
+        unlink(socket_path);
+        thread_condition_deinit(&serve.changed);
+        thread_mutex_deinit(&serve.lock);
+        return false;
+    }
+
+    while (true) {
+        int connection = accept(listener, 0, 0);
+        if (thread_atomic_load_uint32(&serve.stopping)) {
+            if (connection >= 0) {
+                close(connection);
+            }
+            break;
+        }
+        if (connection >= 0) {
+#ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            serve_push(&serve, connection);
+        }
+    }
+
+    // Let the workers finish the requests they have, and any still queued. Connections which are left idle are closed.
+    thread_mutex_lock(&serve.lock);
+    serve.closed = true;
+    thread_condition_broadcast(&serve.changed);
+    thread_mutex_unlock(&serve.lock);
+    for (uint32_t w = 0; w < num_workers; w++) {
+        thread_join(&workers[w]);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    thread_condition_deinit(&serve.changed);
+    thread_mutex_deinit(&serve.lock);
+    return true;
+}
+
+
+// Write a filename to the end of a request, made absolute so that it means the same to the server
+static bool serve_append_filename(char *request, size_t request_size, const char *filename) {
+    size_t num = strlen(request);
+    if (filename[0] == '/') {
+        return snprintf(request + num, request_size - num, " %s", filename) < (int)(request_size - num);
+    }
+    char directory[SERVE_MAX_LINE];
+    if (!getcwd(directory, sizeof(directory))) {
+        return false;
+    }
+    return snprintf(request + num, request_size - num, " %s/%s", directory, filename) < (int)(request_size - num);
+}
+
+
+bool serve_send_job(const char *socket_path, const char *type, bool verify, const char *input, const char *output, char *reply, size_t reply_size) {
+    assert(type && input && output);
+
+    char request[SERVE_MAX_LINE];
+    snprintf(request, sizeof(request), "%s %s", verify ? "verify" : "compress", type);
+    if (!serve_append_filename(request, sizeof(request), input) || !serve_append_filename(request, sizeof(request), output)) {
+        snprintf(reply, reply_size, "error filename too long");
+        return true;
+    }
+    return serve_send(socket_path, request, reply, reply_size);
+}
+
+
+bool serve_send(const char *socket_path, const char *request, char *reply, size_t reply_size) {
+    assert(socket_path);
+    assert(request);
+    assert(reply && reply_size > 0);
+
+    int connection = serve_connect(socket_path);
+    if (connection < 0) {
+        return false;
+    }
+
+    bool ok = serve_send_all(connection, request, strlen(request)) && serve_send_all(connection, "\n", 1);
+
+    // Read up to the end of the reply line
+    size_t num = 0;
+    while (ok && num < reply_size - 1) {
+        ssize_t num_received = recv(connection, reply + num, reply_size - 1 - num, 0);
+        if (num_received <= 0) {
+            ok = false;
+            break;
+        }
+        num += (size_t)num_received;
+        if (memchr(reply, '\n', num)) {
+            break;
+        }
+    }
+    reply[num] = 0;
+    reply[strcspn(reply, "\n")] = 0;
+
+    close(connection);
+    return ok;
+}
+
+#else
+
+bool serve_run(const char *socket_path, const serve_options_t *options) {
+    fprintf(stderr, "Server mode isn't available on this platform\n");
+    return false;
+}
+
+
+bool serve_send(const char *socket_path, const char *request, char *reply, size_t reply_size) {
+    fprintf(stderr, "Server mode isn't available on this platform\n");
+    return false;
+}
+
+
+bool serve_send_job(const char *socket_path, const char *type, bool verify, const char *input, const char *output, char *reply, size_t reply_size) {
+    return serve_send(socket_path, "", reply, reply_size);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include "lz.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Server mode: stay running, listening on a local socket, and compress files as requests come in.
+//
+// This saves starting a process, and warming up its arenas, for every file, which matters when the same asset is
+// compressed over and over while it's being edited.
+// Each connection sends requests one line at a time, and gets a line back for each, in order:
+//     compress <type> <input> <output>     compress the input to the output
+//     verify <type> <input> <output>       the same, then check that the output decompresses to the input
+//     shutdown                             stop the server, once the requests in progress are done
+// where type is 'lz', 'huffman' or 'auto', as on the command line. Filenames can't contain spaces, and relative
+// filenames are relative to the server's working directory.
+// The reply is one of:
+//     ok <type> <input size> <output size> <time in ms>
+//     error <reason>
+// where type is the method which made the output, which auto chooses.
+//
+// Several connections can be served at once, each by a worker with its own library context, whose arenas are kept
+// from one request to the next. On shutdown, connections which are left open with no request in progress are closed.
+// This is only available where there are Unix domain sockets.
+
+// The number of connections which can be served at once
+#define SERVE_NUM_WORKERS 4
+
+// The longest request or reply
+#define SERVE_MAX_LINE 4096
+
+
+typedef struct serve_options_t {
+    lz_options_t lz_options;    // num_threads is the number of threads each request can use
+    bool huge_pages;            // ask for transparent huge pages for the arenas
+} serve_options_t;
+
+
+// Listen on the socket at the given path, serving requests until one asks the server to shut down.
+// A stale socket left at the path is replaced, but anything else there, or a server already listening, is an error.
+// The socket is only accessible to the current user. Returns false if the socket couldn't be made.
+bool serve_run(const char *socket_path, const serve_options_t *options);
+
+// Send a request line (without its newline) to the server at the given path, and wait for the reply.
+// Returns false if the server couldn't be reached; otherwise the reply line, without its newline, is put in reply.
+bool serve_send(const char *socket_path, const char *request, char *reply, size_t reply_size);
+
+// Send a compress or verify request for one file to the server at the given path, and wait for the reply.
+// Relative filenames are made absolute first, so that they mean the same to the server. Returns as serve_send does.
+bool serve_send_job(const char *socket_path, const char *type, bool verify, const char *input, const char *output, char *reply, size_t reply_size);
+
+
+#endif // ifndef SERVE_H_
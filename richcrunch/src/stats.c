@@ -0,0 +1,110 @@
+#include "stats.h"
+#include "thread_pool.h"
+#include <assert.h>
+
+
+static const char *stats_timer_names[stats_timer_count] = {
+    "read",
+    "refs_make",
+    "sequence_cache_make",
+    "suffix_array_make",
+    "refs_find",
+    "lz_sweeps",
+    "lzhuff_sweeps",
+    "lz_serialise",
+    "lz_decompress",
+    "huffman_serialise",
+    "huffman_deserialise",
+    "write"
+};
+
+static const char *stats_counter_names[stats_counter_count] = {
+    "tokens_examined",
+    "relaxations",
+    "pairs_scanned",
+    "bits_written"
+};
+
+
+// Times are kept in nanoseconds, so that they can be added atomically
+static thread_atomic_uint64_t stats_time_ns[stats_timer_count];
+static thread_atomic_uint64_t stats_num_calls[stats_timer_count];
+static thread_atomic_uint64_t stats_counters[stats_counter_count];
+
+
+void stats_reset(void) {
+    for (uint32_t t = 0; t < stats_timer_count; t++) {
+        thread_atomic_store_uint64(&stats_time_ns[t], 0);
+        thread_atomic_store_uint64(&stats_num_calls[t], 0);
+    }
+    for (uint32_t c = 0; c < stats_counter_count; c++) {
+        thread_atomic_store_uint64(&stats_counters[c], 0);
+    }
+}
+
+
+void stats_add_time(stats_timer_t timer, double time_ms) {
+    assert(timer < stats_timer_count);
+    thread_atomic_add_uint64(&stats_time_ns[timer], (uint64_t)(time_ms * 1000000.0));
+    thread_atomic_add_uint64(&stats_num_calls[timer], 1);
+}
+
+
+void stats_add(stats_counter_t counter, uint64_t n) {
+    assert(counter < stats_counter_count);
+    thread_atomic_add_uint64(&stats_counters[counter], n);
+}
+
+
+uint64_t stats_get_counter(stats_counter_t counter) {
+    assert(counter < stats_counter_count);
+    return thread_atomic_load_uint64(&stats_counters[counter]);
+}
+
+
+void stats_print(FILE *file, bool json) {
+    assert(file);
+
+    if (json) {
+        fprintf(file, "{\n  \"timers\": {");
+        const char *separator = "\n";
+        for (uint32_t t = 0; t < stats_timer_count; t++) {
+            uint64_t num_calls = thread_atomic_load_uint64(&stats_num_calls[t]);
+            if (num_calls > 0) {
+                fprintf(file, "%s    \"%s\": {\"ms\": %.3f, \"calls\": %llu}",
+                    separator,
+                    stats_timer_names[t],
+                    (double)thread_atomic_load_uint64(&stats_time_ns[t]) / 1000000.0,
+                    (unsigned long long)num_calls
+                );
+                separator = ",\n";
+            }
+        }
+        fprintf(file, "\n  },\n  \"counters\": {");
+        for (uint32_t c = 0; c < stats_counter_count; c++) {
+            fprintf(file, "%s\n    \"%s\": %llu",
+                (c == 0) ? "" : ",",
+                stats_counter_names[c],
+                (unsigned long long)thread_atomic_load_uint64(&stats_counters[c])
+            );
+        }
+        fprintf(file, "\n  }\n}\n");
+    }
+    else {
+        fprintf(file, "Timers:\n");
+        for (uint32_t t = 0; t < stats_timer_count; t++) {
+            uint64_t num_calls = thread_atomic_load_uint64(&stats_num_calls[t]);
+            if (num_calls > 0) {
+                fprintf(file, "  %-20s %10.3fms  (%llu calls)\n",
+                    stats_timer_names[t],
+                    (double)thread_atomic_load_uint64(&stats_time_ns[t]) / 1000000.0,
+                    (unsigned long long)num_calls
+                );
+            }
+        }
+        fprintf(file, "Counters:\n");
+        for (uint32_t c = 0; c < stats_counter_count; c++) {
+            fprintf(file, "  %-20s %14llu\n", stats_counter_names[c], (unsigned long long)thread_atomic_load_uint64(&stats_counters[c]));
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+// Instrumentation of where the time goes: timers for each phase, and counters on the hot paths.
+//
+// This is only built when STATS_ENABLED is defined; otherwise the macros below compile to nothing.
+// The totals are shared by all threads. Each timer adds up the time spent in its phase over every call, so phases
+// which run on several threads at once can add up to more than the time taken.
+// Counters in the innermost loops are kept in locals and added once per call, so that threads don't contend for them.
+
+typedef enum stats_timer_t {
+    stats_timer_read,
+    stats_timer_refs_make,
+    stats_timer_sequence_cache_make,
+    stats_timer_suffix_array_make,
+    stats_timer_refs_find,
+    stats_timer_lz_sweeps,
+    stats_timer_lzhuff_sweeps,
+    stats_timer_lz_serialise,
+    stats_timer_lz_decompress,
+    stats_timer_huffman_serialise,
+    stats_timer_huffman_deserialise,
+    stats_timer_write,
+    stats_timer_count
+} stats_timer_t;
+
+
+typedef enum stats_counter_t {
+    stats_counter_tokens_examined,      // candidate tokens read from the refs by the parses
+    stats_counter_relaxations,          // costs worked out for a token and length in the parses
+    stats_counter_pairs_scanned,        // entries scanned by indices_view_find to find the current index
+    stats_counter_bits_written,
+    stats_counter_count
+} stats_counter_t;
+
+
+#ifdef STATS_ENABLED
+
+#define STATS_TIMER_BEGIN(timer) double stats_start_##timer = get_time_ms()
+#define STATS_TIMER_END(timer) stats_add_time(timer, get_time_ms() - stats_start_##timer)
+#define STATS_ADD(counter, n) stats_add(counter, n)
+
+#else
+
+#define STATS_TIMER_BEGIN(timer) ((void)0)
+#define STATS_TIMER_END(timer) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+
+#endif
+
+
+// Clear all the timers and counters
+void stats_reset(void);
+
+// Add the time for one call of a phase
+void stats_add_time(stats_timer_t timer, double time_ms);
+
+// Add to a counter
+void stats_add(stats_counter_t counter, uint64_t n);
+
+// Get the total of a counter
+uint64_t stats_get_counter(stats_counter_t counter);
+
+// Write the timers which were used, and the counters, as text or JSON
+void stats_print(FILE *file, bool json);
+
+
+#endif // ifndef STATS_H_
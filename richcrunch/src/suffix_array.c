@@ -0,0 +1,191 @@
+#include "match.h"
+#include "suffix_array.h"
+#include "utils.h"
+#include <assert.h>
+
+
+static uint32_t suffix_array_get_second_key(uint32_array_view_t ranks, uint32_t index, uint32_t h) {
+    // Suffixes which end before index+h sort before all others
+    return (index + h < ranks.num) ? uint32_array_view_get(ranks, index + h) + 1 : 0;
+}
+
+
+// Sort the suffixes by prefix doubling.
+// After each pass, the suffixes are sorted by their first 2h bytes, using the ranks of their first h bytes
+// and of the h bytes which follow as a two-part key.
+// Each pass is a linear time counting sort, and we stop as soon as all the ranks are distinct.
+
+static void suffix_array_sort(byte_array_view_t src, uint32_array_span_t suffixes, uint32_array_span_t ranks, arena_t scratch) {
+    uint32_t num = src.num;
+    uint32_array_span_t sorted_by_second_key = uint32_array_span_make(num, &scratch);
+    uint32_array_span_t new_ranks = uint32_array_span_make(num, &scratch);
+    uint32_array_span_t counts = uint32_array_span_make(max_uint32(num, 256) + 1, &scratch);
+
+    // The initial ranks are just the byte values
+    for (uint32_t i = 0; i < num; i++) {
+        uint32_array_span_set(ranks, i, byte_array_view_get(src, i));
+        (*uint32_array_span_at(counts, byte_array_view_get(src, i) + 1))++;
+    }
+    for (uint32_t i = 1; i <= 256; i++) {
+        *uint32_array_span_at(counts, i) += uint32_array_span_get(counts, i - 1);
+    }
+    for (uint32_t i = 0; i < num; i++) {
+        uint32_t *count = uint32_array_span_at(counts, byte_array_view_get(src, i));
+        uint32_array_span_set(suffixes, (*count)++, i);
+    }
+
+    uint32_t num_ranks = 256;
+
+    for (uint32_t h = 1; h < num; h *= 2) {
+        // Order the suffixes by their second key.
+        // Those with nothing after the first h bytes come first; the rest follow the order of the current ranks.
+        uint32_t n = 0;
+        for (uint32_t i = num - h; i < num; i++) {
+            uint32_array_span_set(sorted_by_second_key, n++, i);
+        }
+        for (uint32_t r = 0; r < num; r++) {
+            uint32_t index = uint32_array_span_get(suffixes, r);
+            if (index >= h) {
+                uint32_array_span_set(sorted_by_second_key, n++, index - h);
+            }
+        }
+        assert(n == num);
+
+        // Now do a stable counting sort by the first key
+        memset(counts.data, 0, (num_ranks + 1) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < num; i++) {
+            (*uint32_array_span_at(counts, uint32_array_span_get(ranks, i) + 1))++;
+        }
+        for (uint32_t i = 1; i <= num_ranks; i++) {
+            *uint32_array_span_at(counts, i) += uint32_array_span_get(counts, i - 1);
+        }
+        for (uint32_t i = 0; i < num; i++) {
+            uint32_t index = uint32_array_span_get(sorted_by_second_key, i);
+            uint32_t *count = uint32_array_span_at(counts, uint32_array_span_get(ranks, index));
+            uint32_array_span_set(suffixes, (*count)++, index);
+        }
+
+        // Assign new ranks: suffixes whose two keys are both equal share a rank
+        uint32_t rank = 0;
+        uint32_array_span_set(new_ranks, uint32_array_span_get(suffixes, 0), 0);
+        for (uint32_t r = 1; r < num; r++) {
+            uint32_t a = uint32_array_span_get(suffixes, r - 1);
+            uint32_t b = uint32_array_span_get(suffixes, r);
+            if (uint32_array_span_get(ranks, a) != uint32_array_span_get(ranks, b) ||
+                suffix_array_get_second_key(ranks.view, a, h) != suffix_array_get_second_key(ranks.view, b, h)) {
+                rank++;
+            }
+            uint32_array_span_set(new_ranks, b, rank);
+        }
+        memcpy(ranks.data, new_ranks.data, num * sizeof(uint32_t));
+
+        num_ranks = rank + 1;
+        if (num_ranks == num) {
+            break;
+        }
+    }
+}
+
+
+suffix_array_t suffix_array_make(byte_array_view_t src, uint32_t max_lcp, arena_t *arena) {
+    assert(src.data);
+    assert(arena);
+    assert(max_lcp <= UINT16_MAX);
+
+    uint32_t num = src.num;
+    uint32_t num_levels = num ? get_bit_width(num) : 0;
+
+    uint32_array_span_t suffixes = uint32_array_span_make(num, arena);
+    uint32_array_span_t ranks = uint32_array_span_make(num, arena);
+    uint16_array_span_t lcp_table = uint16_array_span_make(num * num_levels, arena);
+
+    if (num == 0) {
+        return (suffix_array_t) {0};
+    }
+
+    // The sort needs some working space, which we take from beyond the arrays we return
+    suffix_array_sort(src, suffixes, ranks, *arena);
+
+    // Build the LCP array with Kasai's algorithm.
+    // Moving from suffix i to suffix i+1 loses at most one byte of the common prefix with the preceding suffix,
+    // so we never have to compare more than 2n bytes in total.
+    match_length_fn_t match_length = match_get_length_fn();
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        uint32_t rank = uint32_array_span_get(ranks, i);
+        if (rank == 0) {
+            length = 0;
+            continue;
+        }
+
+        uint32_t j = uint32_array_span_get(suffixes, rank - 1);
+        uint32_t max_length = num - max_uint32(i, j);
+        length += match_length(src.data + i + length, src.data + j + length, max_length - length);
+
+        uint16_array_span_set(lcp_table, rank, min_uint32(length, max_lcp));
+        if (length > 0) {
+            length--;
+        }
+    }
+
+    // Build the remaining levels of the sparse table
+    for (uint32_t k = 1; k < num_levels; k++) {
+        uint32_t half = 1U << (k - 1);
+        for (uint32_t r = 0; r + (1U << k) <= num; r++) {
+            uint16_t a = uint16_array_span_get(lcp_table, (k - 1) * num + r);
+            uint16_t b = uint16_array_span_get(lcp_table, (k - 1) * num + r + half);
+            uint16_array_span_set(lcp_table, k * num + r, (a < b) ? a : b);
+        }
+    }
+
+    return (suffix_array_t) {
+        .suffixes = suffixes.view,
+        .ranks = ranks.view,
+        .lcp_table = lcp_table.view,
+        .num_levels = num_levels
+    };
+}
+
+
+static uint32_t suffix_array_get_min_lcp(const suffix_array_t *sa, uint32_t level, uint32_t rank) {
+    return uint16_array_view_get(sa->lcp_table, level * sa->suffixes.num + rank);
+}
+
+
+uint32_t suffix_array_get_lcp(const suffix_array_t *sa, uint32_t rank_a, uint32_t rank_b) {
+    assert(sa);
+    assert(rank_a != rank_b);
+
+    // The LCP of two suffixes is the minimum of the LCPs of all the adjacent suffixes between them
+    uint32_t first = min_uint32(rank_a, rank_b) + 1;
+    uint32_t last = max_uint32(rank_a, rank_b);
+    uint32_t level = get_bit_width(last - first + 1) - 1;
+    return min_uint32(
+        suffix_array_get_min_lcp(sa, level, first),
+        suffix_array_get_min_lcp(sa, level, last + 1 - (1U << level))
+    );
+}
+
+
+suffix_array_interval_t suffix_array_get_interval(const suffix_array_t *sa, uint32_t rank, uint32_t length) {
+    assert(sa);
+    assert(rank < sa->suffixes.num);
+
+    // Extend the interval as far as possible in each direction, in decreasing power of two steps
+    uint32_t first = rank;
+    uint32_t last = rank;
+    for (uint32_t level = sa->num_levels; level-- > 0;) {
+        uint32_t step = 1U << level;
+        if (first >= step && suffix_array_get_min_lcp(sa, level, first + 1 - step) >= length) {
+            first -= step;
+        }
+        if (last + step < sa->suffixes.num && suffix_array_get_min_lcp(sa, level, last + 1) >= length) {
+            last += step;
+        }
+    }
+
+    return (suffix_array_interval_t) {
+        .first = first,
+        .last = last
+    };
+}
@@ -0,0 +1,42 @@
+#ifndef SUFFIX_ARRAY_H_
+#define SUFFIX_ARRAY_H_
+
+#include "arena.h"
+#include "byte_array.h"
+#include "uint16_array.h"
+#include "uint32_array.h"
+
+
+// A suffix array of the source data, along with its LCP (longest common prefix) array.
+// suffixes[r] is the source index of the suffix with lexicographic rank r, and ranks is its inverse.
+// The LCP array is stored as a sparse table so that the LCP of any two suffixes can be found in constant time:
+// level k of lcp_table holds, at index r, the minimum LCP over ranks r...r+2^k-1.
+// The LCP at rank r is the length of the common prefix of the suffixes at ranks r-1 and r, clamped to max_lcp.
+typedef struct suffix_array_t {
+    uint32_array_view_t suffixes;
+    uint32_array_view_t ranks;
+    uint16_array_view_t lcp_table;
+    uint32_t num_levels;
+} suffix_array_t;
+
+
+// An inclusive [first, last] range of suffix ranks
+typedef struct suffix_array_interval_t {
+    uint32_t first;
+    uint32_t last;
+} suffix_array_interval_t;
+
+
+// Make a suffix array and LCP table for the given data.
+// Temporary working space is taken from the arena beyond the returned allocations.
+suffix_array_t suffix_array_make(byte_array_view_t src, uint32_t max_lcp, arena_t *arena);
+
+// Get the length of the common prefix of the suffixes at the two given ranks, clamped to max_lcp.
+// The ranks must be different.
+uint32_t suffix_array_get_lcp(const suffix_array_t *sa, uint32_t rank_a, uint32_t rank_b);
+
+// Get the range of ranks surrounding the given rank whose suffixes share a prefix of at least the given length
+suffix_array_interval_t suffix_array_get_interval(const suffix_array_t *sa, uint32_t rank, uint32_t length);
+
+
+#endif // ifndef SUFFIX_ARRAY_H_
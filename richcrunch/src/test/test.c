@@ -1,17 +1,189 @@
 #include "arena.h"
+#include "batch.h"
 #include "bitreader.h"
+#include "bitreader64.h"
 #include "bitwriter.h"
+#include "bitwriter64.h"
 #include "byte_array.h"
+#include "cache.h"
 #include "file.h"
 #include "huffman.h"
 #include "lz.h"
 #include "lzhuff.h"
+#include "match.h"
+#include "method.h"
 #include "refs.h"
+#include "richcrunch.h"
+#include "serve.h"
+#include "stats.h"
 #include "test.h"
+#include "thread_pool.h"
+#include "uint32_array.h"
 #include <stdio.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 
 
+int test_arena_virtual(void) {
+    arena_t arena = arena_make_virtual(ARENA_VIRTUAL_RESERVE_SIZE, false);
+    TEST_REQUIRE_TRUE(arena.base != 0);
+    TEST_REQUIRE_EQUAL(arena.end, ARENA_VIRTUAL_RESERVE_SIZE);
+
+    // Far more than any of the fixed arenas, but only the pages touched are committed, and they start zeroed
+    uint8_t *block = arena_alloc(&arena, 0x20000000);
+    TEST_REQUIRE_TRUE(block[0] == 0 && block[0x1FFFFFFF] == 0);
+    block[0x1FFFFFFF] = 1;
+
+    // Sub-arenas and scratch copies behave as before
+    arena_t sub = arena_alloc_subarena(&arena, 0x1000);
+    TEST_REQUIRE_TRUE((sub.flags & arena_flags_virtual) == 0);
+    arena_t scratch = arena;
+    uint8_t *a = arena_alloc(&scratch, 16);
+    uint8_t *b = arena_alloc(&arena, 16);
+    TEST_REQUIRE_TRUE(a == b);
+
+    arena_reset(&arena);
+    TEST_REQUIRE_TRUE(arena_alloc(&arena, 16) == block);
+
+    arena_deinit(&arena);
+    TEST_REQUIRE_TRUE(arena.base == 0);
+
+    return 0;
+}
+
+
+int test_arena_checkpoint(void) {
+    arena_t arena = arena_make(0x1000);
+    uint8_t *kept = arena_alloc(&arena, 16);
+
+    // Everything allocated after the checkpoint is released by the rollback, however many blocks there were
+    arena_checkpoint_t checkpoint = arena_get_checkpoint(&arena);
+    uint8_t *first = arena_alloc(&arena, 100);
+    arena_alloc(&arena, 200);
+    arena_alloc_subarena(&arena, 0x100);
+    arena_rollback(&arena, checkpoint);
+    TEST_REQUIRE_EQUAL(arena.next, checkpoint.next);
+    TEST_REQUIRE_TRUE(arena_alloc(&arena, 16) == first);
+
+    // Rolling back to where we already are does nothing
+    checkpoint = arena_get_checkpoint(&arena);
+    arena_rollback(&arena, checkpoint);
+    TEST_REQUIRE_TRUE(arena_alloc(&arena, 16) == first + 16);
+    TEST_REQUIRE_TRUE(kept + 16 == first);
+
+    arena_deinit(&arena);
+    return 0;
+}
+
+
+int test_arena_stats(void) {
+    arena_t arena = arena_make(0x10000);
+    arena_alloc(&arena, 0x100);
+
+    arena_stats_t stats;
+    arena_attach_stats(&arena, &stats, "test");
+    TEST_REQUIRE_EQUAL(stats.high_water, 0x100);
+
+    // A realloc which isn't of the last block has to copy it
+    arena_set_tag(&arena, "first");
+    uint8_t *a = arena_calloc(&arena, 0x100);
+    arena_alloc(&arena, 0x10);
+    a = arena_realloc(&arena, a, 0x100, 0x200);
+    TEST_REQUIRE_EQUAL(stats.num_realloc_copies, 1);
+    TEST_REQUIRE_EQUAL((uint32_t)stats.realloc_copy_bytes, 0x100);
+
+    // The last block grows in place
+    arena_realloc(&arena, a, 0x200, 0x300);
+    TEST_REQUIRE_EQUAL(stats.num_realloc_copies, 1);
+    TEST_REQUIRE_EQUAL((uint32_t)stats.zeroed_bytes, 0x100 + 0x100 + 0x100);
+    TEST_REQUIRE_EQUAL(stats.high_water, 0x100 + 0x100 + 0x10 + 0x300);
+
+    // A sub-arena has its own stats, and only what's used of it counts towards the parent's high water mark
+    const char *tag = arena_set_tag(&arena, "second");
+    TEST_REQUIRE_TRUE(strcmp(tag, "first") == 0);
+    arena_t sub = arena_alloc_subarena(&arena, 0x1000);
+    arena_alloc(&sub, 0x20);
+    TEST_REQUIRE_TRUE(stats.first_child == sub.stats && sub.stats->next_sibling == 0);
+    TEST_REQUIRE_EQUAL(sub.stats->offset, 0x100 + 0x100 + 0x10 + 0x300);
+    TEST_REQUIRE_EQUAL(sub.stats->high_water, 0x20);
+    TEST_REQUIRE_EQUAL(stats.high_water, 0x100 + 0x100 + 0x10 + 0x300);
+
+    TEST_REQUIRE_EQUAL(stats.num_allocs, 4);
+    TEST_REQUIRE_EQUAL(stats.num_tags, 2);
+    TEST_REQUIRE_EQUAL(stats.tags[0].num_allocs, 3);
+    TEST_REQUIRE_EQUAL((uint32_t)stats.tags[0].num_bytes, 0x100 + 0x10 + 0x200 + 0x100);
+    TEST_REQUIRE_EQUAL((uint32_t)stats.tags[1].num_bytes, 0x1000);
+
+    arena_stats_deinit(&stats);
+    TEST_REQUIRE_TRUE(stats.first_child == 0);
+    arena_detach_stats(&arena);
+    arena_alloc(&arena, 0x1000);
+    TEST_REQUIRE_EQUAL(stats.num_allocs, 4);
+
+    arena_deinit(&arena);
+    return 0;
+}
+
+
+typedef struct test_thread_pool_context_t {
+    thread_atomic_uint32_t num_jobs_run;
+    thread_mutex_t lock;
+    uint64_t total;             // guarded by lock
+    uint32_t runs[THREAD_POOL_MAX_THREADS];
+} test_thread_pool_context_t;
+
+
+static void test_thread_pool_job(void *context, uint32_t job, uint32_t worker) {
+    test_thread_pool_context_t *test = context;
+    thread_atomic_add_uint32(&test->num_jobs_run, 1);
+    thread_mutex_lock(&test->lock);
+    test->total += job;
+    thread_mutex_unlock(&test->lock);
+    test->runs[worker]++;
+}
+
+
+static int test_thread_main(void *arg) {
+    return *(const int *)arg + 1;
+}
+
+
+int test_thread_pool(void) {
+    // Every job should run once, on one of the workers
+    test_thread_pool_context_t test = {0};
+    TEST_REQUIRE_TRUE(thread_mutex_init(&test.lock));
+    thread_pool_run(4, 1000, test_thread_pool_job, &test);
+    TEST_REQUIRE_EQUAL(thread_atomic_load_uint32(&test.num_jobs_run), 1000);
+    TEST_REQUIRE_TRUE(test.total == 999 * 1000 / 2);
+    uint32_t num_runs = 0;
+    for (uint32_t w = 0; w < THREAD_POOL_MAX_THREADS; w++) {
+        TEST_REQUIRE_TRUE(w < 4 || test.runs[w] == 0);
+        num_runs += test.runs[w];
+    }
+    TEST_REQUIRE_EQUAL(num_runs, 1000);
+    thread_mutex_deinit(&test.lock);
+
+    // A thread's result comes back from joining it
+    int value = 41;
+    thread_handle_t thread;
+    TEST_REQUIRE_TRUE(thread_start(&thread, test_thread_main, &value));
+    TEST_REQUIRE_EQUAL(thread_join(&thread), 42);
+
+    thread_atomic_uint64_t atomic = {0};
+    TEST_REQUIRE_TRUE(thread_atomic_add_uint64(&atomic, 0x100000000ULL) == 0);
+    thread_atomic_store_uint64(&atomic, thread_atomic_load_uint64(&atomic) + 1);
+    TEST_REQUIRE_TRUE(thread_atomic_load_uint64(&atomic) == 0x100000001ULL);
+
+    return 0;
+}
+
+
 int test_refs(void) {
     arena_t arena = arena_make(0x800000);
     arena_t scratch = arena_make(0x800000);
@@ -22,15 +194,15 @@ int test_refs(void) {
         .num = sizeof("the cat sat on the mat singinging") - 1
     };
 
-    refs_t refs = refs_make(src, &arena, scratch);
+    refs_t refs = refs_make(src, 0, &arena, scratch);
 
     {
-        token_array_view_t tv = refs_get_tokens(&refs, 8);
+        token_array_view_t tv = refs_get_tokens(&refs, 8, &scratch);
         TEST_REQUIRE_EQUAL(tv.num, 1);
         TEST_REQUIRE_TRUE(token_is_literal(token_array_view_get(tv, 0)));
     }
     {
-        token_array_view_t tv = refs_get_tokens(&refs, 15);
+        token_array_view_t tv = refs_get_tokens(&refs, 15, &scratch);
         TEST_REQUIRE_EQUAL(tv.num, 2);
         TEST_REQUIRE_TRUE(token_is_literal(token_array_view_get(tv, 0)));
         TEST_REQUIRE_TRUE(!token_is_literal(token_array_view_get(tv, 1)));
@@ -38,7 +210,7 @@ int test_refs(void) {
         TEST_REQUIRE_EQUAL(token_array_view_get(tv, 1).length_minus_one, 3); // 'the '
     }
     {
-        token_array_view_t tv = refs_get_tokens(&refs, 9);
+        token_array_view_t tv = refs_get_tokens(&refs, 9, &scratch);
         TEST_REQUIRE_EQUAL(tv.num, 2);
         TEST_REQUIRE_TRUE(token_is_literal(token_array_view_get(tv, 0)));
         TEST_REQUIRE_TRUE(!token_is_literal(token_array_view_get(tv, 1)));
@@ -46,7 +218,7 @@ int test_refs(void) {
         TEST_REQUIRE_EQUAL(token_array_view_get(tv, 1).length_minus_one, 2); // 'at '
     }
     {
-        token_array_view_t tv = refs_get_tokens(&refs, 20);
+        token_array_view_t tv = refs_get_tokens(&refs, 20, &scratch);
         TEST_REQUIRE_EQUAL(tv.num, 3);
         TEST_REQUIRE_TRUE(token_is_literal(token_array_view_get(tv, 0)));
         TEST_REQUIRE_TRUE(!token_is_literal(token_array_view_get(tv, 1)));
@@ -57,7 +229,7 @@ int test_refs(void) {
         TEST_REQUIRE_EQUAL(token_array_view_get(tv, 2).length_minus_one, 3); // 'at s'
     }
     {
-        token_array_view_t tv = refs_get_tokens(&refs, 27);
+        token_array_view_t tv = refs_get_tokens(&refs, 27, &scratch);
         TEST_REQUIRE_EQUAL(tv.num, 2);
         TEST_REQUIRE_TRUE(token_is_literal(token_array_view_get(tv, 0)));
         TEST_REQUIRE_TRUE(!token_is_literal(token_array_view_get(tv, 1)));
@@ -65,7 +237,7 @@ int test_refs(void) {
         TEST_REQUIRE_EQUAL(token_array_view_get(tv, 1).length_minus_one, 5); // 'inging'
     }
     {
-        token_array_view_t tv = refs_get_tokens(&refs, 31);
+        token_array_view_t tv = refs_get_tokens(&refs, 31, &scratch);
         TEST_REQUIRE_EQUAL(tv.num, 2);
         TEST_REQUIRE_TRUE(token_is_literal(token_array_view_get(tv, 0)));
         TEST_REQUIRE_TRUE(!token_is_literal(token_array_view_get(tv, 1)));
@@ -81,6 +253,392 @@ int test_refs(void) {
 }
 
 
+static bool test_tokens_are_same(token_t a, token_t b) {
+    return a.length_minus_one == b.length_minus_one && (token_is_literal(a) ? a.value == b.value : a.offset == b.offset);
+}
+
+
+static bool test_lz_items_are_same(lz_item_array_view_t a, lz_item_array_view_t b) {
+    if (a.num != b.num) {
+        return false;
+    }
+    for (uint32_t i = 0; i < a.num; i++) {
+        const lz_item_t *x = lz_item_array_view_at(a, i);
+        const lz_item_t *y = lz_item_array_view_at(b, i);
+        if (!test_tokens_are_same(x->token, y->token) || x->total_cost != y->total_cost || x->tally != y->tally) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool test_refs_are_same(const refs_t *a, const refs_t *b) {
+    if (refs_num(a) != refs_num(b)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < refs_num(a); i++) {
+        refs_iterator_t ia = refs_get_iterator(a, i);
+        refs_iterator_t ib = refs_get_iterator(b, i);
+        token_t ta;
+        token_t tb;
+        bool more;
+        while ((more = refs_iterator_next(&ia, &ta)) == refs_iterator_next(&ib, &tb) && more) {
+            if (!test_tokens_are_same(ta, tb)) {
+                return false;
+            }
+        }
+        if (more) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int test_refs_suffix_array(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    refs_options_t pairs = {.finder = refs_finder_pairs};
+    refs_options_t suffix_array = {.finder = refs_finder_suffix_array};
+
+    // Zero-heavy data, like a screen dump, with a few repeated patterns breaking up the runs
+    uint8_t zeros[3000] = {0};
+    for (uint32_t i = 0; i < sizeof zeros; i += 97) {
+        zeros[i] = (uint8_t)(i % 7);
+        zeros[i + 1] = 0x55;
+    }
+
+    const char *filenames[] = {"titlescreen.bin", "test_0.bin"};
+    byte_array_view_t srcs[] = {
+        {.data = (const uint8_t *)"the cat sat on the mat singinging", .num = sizeof("the cat sat on the mat singinging") - 1},
+        {.data = (const uint8_t *)"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", .num = sizeof("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa") - 1},
+        VIEW(zeros),
+        file_read_binary(filenames[0], &arena).contents,
+        file_read_binary(filenames[1], &arena).contents
+    };
+
+    for (uint32_t n = 0; n < sizeof srcs / sizeof *srcs; n++) {
+        TEST_REQUIRE_TRUE(srcs[n].data != 0);
+        refs_t expected = refs_make(srcs[n], &pairs, &arena, scratch);
+        refs_t actual = refs_make(srcs[n], &suffix_array, &arena, scratch);
+        TEST_REQUIRE_TRUE(test_refs_are_same(&expected, &actual));
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_refs_threaded(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+
+    for (uint32_t finder = refs_finder_pairs; finder <= refs_finder_suffix_array; finder++) {
+        refs_options_t serial = {.finder = finder, .num_threads = 1};
+        refs_options_t threaded = {.finder = finder, .num_threads = 5};
+        refs_t expected = refs_make(file_result.contents, &serial, &arena, scratch);
+        refs_t actual = refs_make(file_result.contents, &threaded, &arena, scratch);
+        TEST_REQUIRE_TRUE(test_refs_are_same(&expected, &actual));
+        TEST_REQUIRE_EQUAL(actual.data.num, expected.data.num);
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+static uint32_t test_get_cheapest_offset_cost(token_array_view_t tokens, uint32_t length, uint32_t num_fixed_bits) {
+    uint32_t cheapest = UINT32_MAX;
+    for (uint32_t i = 0; i < tokens.num; i++) {
+        token_t token = token_array_view_get(tokens, i);
+        if (!token_is_literal(token) && token_get_length(token) >= length && token.offset <= (256U << num_fixed_bits)) {
+            cheapest = min_uint32(cheapest, get_hybrid_cost(token.offset - 1, num_fixed_bits));
+        }
+    }
+    return cheapest;
+}
+
+
+int test_refs_pruned(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    const char *filenames[] = {"test_0.bin", "titlescreen.bin"};
+    for (uint32_t f = 0; f < 2; f++) {
+        file_read_result_t file_result = file_read_binary(filenames[f], &arena);
+        TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+
+        // Each pruned token list should be a subset of the full one, keeping the literal and the longest ref
+        refs_options_t full_options = {.finder = refs_finder_suffix_array};
+        refs_options_t pruned_options = {.finder = refs_finder_suffix_array, .prune = true};
+        refs_t full = refs_make(file_result.contents, &full_options, &arena, scratch);
+        refs_t pruned = refs_make(file_result.contents, &pruned_options, &arena, scratch);
+        TEST_REQUIRE_EQUAL(refs_num(&pruned), refs_num(&full));
+        TEST_REQUIRE_TRUE(pruned.data.num <= full.data.num);
+
+        for (uint32_t i = 0; i < refs_num(&full); i++) {
+            arena_t tokens_arena = scratch;
+            token_array_view_t full_tokens = refs_get_tokens(&full, i, &tokens_arena);
+            token_array_view_t pruned_tokens = refs_get_tokens(&pruned, i, &tokens_arena);
+            TEST_REQUIRE_TRUE(pruned_tokens.num >= 1 && pruned_tokens.num <= full_tokens.num);
+            TEST_REQUIRE_TRUE(test_tokens_are_same(token_array_view_get(pruned_tokens, 0), token_array_view_get(full_tokens, 0)));
+            TEST_REQUIRE_TRUE(test_tokens_are_same(
+                token_array_view_get(pruned_tokens, pruned_tokens.num - 1),
+                token_array_view_get(full_tokens, full_tokens.num - 1)
+            ));
+
+            uint32_t k = 0;
+            for (uint32_t j = 0; j < pruned_tokens.num; j++) {
+                while (k < full_tokens.num && !test_tokens_are_same(token_array_view_get(full_tokens, k), token_array_view_get(pruned_tokens, j))) {
+                    k++;
+                }
+                TEST_REQUIRE_TRUE(k < full_tokens.num);
+            }
+
+            // The cheapest offset cost for each length should be unchanged
+            uint32_t max_length = token_get_length(token_array_view_get(full_tokens, full_tokens.num - 1));
+            for (uint32_t length = 2; length <= max_length; length++) {
+                for (uint32_t num_fixed_bits = 1; num_fixed_bits <= 8; num_fixed_bits++) {
+                    TEST_REQUIRE_EQUAL(
+                        test_get_cheapest_offset_cost(pruned_tokens, length, num_fixed_bits),
+                        test_get_cheapest_offset_cost(full_tokens, length, num_fixed_bits)
+                    );
+                }
+            }
+        }
+
+        // Pruning may choose different offsets, so just check the result is still correct
+        lz_options_t lz_options = {.prune = true};
+        lz_parse_result_t lz = lz_parse(file_result.contents, &lz_options, &arena, scratch);
+        byte_array_view_t compressed = lz_serialise(&lz, &arena);
+        byte_array_view_t expanded = lz_deserialise(compressed, &arena);
+        TEST_REQUIRE_EQUAL(expanded.num, file_result.contents.num);
+        TEST_REQUIRE_TRUE(memcmp(file_result.contents.data, expanded.data, expanded.num) == 0);
+
+        arena_reset(&arena);
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_refs_large(void) {
+    arena_t arena = arena_make(0x4000000);
+    arena_t scratch = arena_make(0x4000000);
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+
+    // Make something bigger than the range of an offset, from slightly differing copies of a file
+    byte_array_t src = byte_array_make(0x20000, &arena);
+    for (uint32_t n = 0; src.num < 0x20000; n++) {
+        for (uint32_t i = 0; i < file_result.contents.num && src.num < 0x20000; i++) {
+            byte_array_add(&src, byte_array_view_get(file_result.contents, i) ^ ((i % 997 == n) ? 0x5A : 0), &arena);
+        }
+    }
+
+    // The pairs finder is too slow on this much repetition, so just check the threaded suffix array finder agrees
+    refs_options_t serial = {.finder = refs_finder_suffix_array, .num_threads = 1};
+    refs_options_t threaded = {.finder = refs_finder_suffix_array, .num_threads = 3};
+    refs_t expected = refs_make(src.view, &serial, &arena, scratch);
+    refs_t actual = refs_make(src.view, &threaded, &arena, scratch);
+    TEST_REQUIRE_TRUE(test_refs_are_same(&expected, &actual));
+
+    for (uint32_t i = 0; i < refs_num(&actual); i++) {
+        refs_iterator_t it = refs_get_iterator(&actual, i);
+        token_t token;
+        TEST_REQUIRE_TRUE(refs_iterator_next(&it, &token) && token_is_literal(token));
+        while (refs_iterator_next(&it, &token)) {
+            TEST_REQUIRE_TRUE(token.offset > 0 && token.offset <= i);
+            TEST_REQUIRE_TRUE(memcmp(src.data + i, src.data + i - token.offset, token_get_length(token)) == 0);
+        }
+    }
+
+    lz_options_t lz_options = {.finder = refs_finder_suffix_array};
+    lz_parse_result_t lz = lz_parse(src.view, &lz_options, &arena, scratch);
+    byte_array_view_t compressed = lz_serialise(&lz, &arena);
+    byte_array_view_t expanded = lz_deserialise(compressed, &arena);
+    TEST_REQUIRE_EQUAL(expanded.num, src.num);
+    TEST_REQUIRE_TRUE(memcmp(src.data, expanded.data, expanded.num) == 0);
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_parse_threaded(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+
+    lz_options_t serial = {.num_threads = 1};
+    lz_options_t threaded = {.num_threads = 3};
+
+    lz_parse_result_t lz_expected = lz_parse(file_result.contents, &serial, &arena, scratch);
+    lz_parse_result_t lz_actual = lz_parse(file_result.contents, &threaded, &arena, scratch);
+    TEST_REQUIRE_EQUAL(lz_actual.cost, lz_expected.cost);
+    TEST_REQUIRE_EQUAL(lz_actual.num_fixed_bits, lz_expected.num_fixed_bits);
+    TEST_REQUIRE_TRUE(test_lz_items_are_same(lz_actual.items, lz_expected.items));
+    TEST_REQUIRE_TRUE(memcmp(lz_actual.fixed_bits_costs, lz_expected.fixed_bits_costs, sizeof(lz_actual.fixed_bits_costs)) == 0);
+
+    lzhuff_result_t lzhuff_expected = lzhuff_parse(file_result.contents, &serial, &arena, scratch);
+    lzhuff_result_t lzhuff_actual = lzhuff_parse(file_result.contents, &threaded, &arena, scratch);
+    TEST_REQUIRE_EQUAL(lzhuff_actual.items.num, lzhuff_expected.items.num);
+    for (uint32_t i = 0; i < lzhuff_actual.items.num; i++) {
+        const lzhuff_item_t *x = lzhuff_item_array_view_at(lzhuff_actual.items, i);
+        const lzhuff_item_t *y = lzhuff_item_array_view_at(lzhuff_expected.items, i);
+        TEST_REQUIRE_TRUE(test_tokens_are_same(x->token, y->token) && x->total_cost == y->total_cost);
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_parse_lengths(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    // Trying only the best length in each length cost bucket should give exactly the same parse as trying them all
+    const char *filenames[] = {"test_0.bin", "titlescreen.bin"};
+    for (uint32_t f = 0; f < 2; f++) {
+        file_read_result_t file_result = file_read_binary(filenames[f], &arena);
+        TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+
+        for (uint32_t num_threads = 1; num_threads <= 3; num_threads += 2) {
+            lz_options_t all = {.finder = refs_finder_suffix_array, .num_threads = num_threads, .all_lengths = true};
+            lz_options_t bucketed = {.finder = refs_finder_suffix_array, .num_threads = num_threads};
+
+            lz_parse_result_t lz_expected = lz_parse(file_result.contents, &all, &arena, scratch);
+            lz_parse_result_t lz_actual = lz_parse(file_result.contents, &bucketed, &arena, scratch);
+
+            TEST_REQUIRE_EQUAL(lz_actual.cost, lz_expected.cost);
+            TEST_REQUIRE_EQUAL(lz_actual.num_fixed_bits, lz_expected.num_fixed_bits);
+            TEST_REQUIRE_TRUE(test_lz_items_are_same(lz_actual.items, lz_expected.items));
+
+            lzhuff_result_t lzhuff_expected = lzhuff_parse(file_result.contents, &all, &arena, scratch);
+            lzhuff_result_t lzhuff_actual = lzhuff_parse(file_result.contents, &bucketed, &arena, scratch);
+            TEST_REQUIRE_EQUAL(lzhuff_actual.items.num, lzhuff_expected.items.num);
+            for (uint32_t i = 0; i < lzhuff_actual.items.num; i++) {
+                const lzhuff_item_t *x = lzhuff_item_array_view_at(lzhuff_actual.items, i);
+                const lzhuff_item_t *y = lzhuff_item_array_view_at(lzhuff_expected.items, i);
+                TEST_REQUIRE_TRUE(test_tokens_are_same(x->token, y->token) && x->total_cost == y->total_cost);
+            }
+        }
+
+        arena_reset(&arena);
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_parse_levels(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    // The greedy and lazy parses should make valid streams, which the optimal parse can't be beaten by, and the lazy
+    // parse shouldn't lose to the greedy one
+    const char *filenames[] = {"test_0.bin", "titlescreen.bin", "titlescreen_lz_huffman.bin"};
+    for (uint32_t f = 0; f < 3; f++) {
+        file_read_result_t file_result = file_read_binary(filenames[f], &arena);
+        TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+        byte_array_view_t src = file_result.contents;
+
+        lz_parse_result_t optimal = lz_parse(src, 0, &arena, scratch);
+
+        lz_parser_t parsers[] = {lz_parser_greedy, lz_parser_lazy};
+        uint32_t costs[2];
+        for (uint32_t p = 0; p < 2; p++) {
+            lz_options_t options = {.parser = parsers[p]};
+            lz_parse_result_t lz = lz_parse(src, &options, &arena, scratch);
+            TEST_REQUIRE_TRUE(lz.cost >= optimal.cost);
+            costs[p] = lz.cost;
+            uint32_t chosen_cost = lz.fixed_bits_costs[lz.num_fixed_bits - 1];
+            TEST_REQUIRE_EQUAL(chosen_cost, lz.cost);
+
+            // The costs and tallies should describe the stream which is written
+            lz_analysis_t analysis = lz_analyse(&lz);
+            uint32_t total_bits = analysis.tally_bits + analysis.literal_bits +
+                analysis.offset_prefix_bits + analysis.offset_fixed_bits + analysis.length_bits;
+            TEST_REQUIRE_EQUAL(total_bits, lz.cost);
+
+            byte_array_view_t compressed = lz_serialise(&lz, &arena);
+            byte_array_span_t expanded = byte_array_span_make(src.num, &arena);
+            TEST_REQUIRE_TRUE(lz_decompress(compressed, expanded));
+            TEST_REQUIRE_TRUE(memcmp(src.data, expanded.data, src.num) == 0);
+
+            // They run on the calling thread, so more threads shouldn't change anything
+            options.num_threads = 3;
+            lz_parse_result_t threaded = lz_parse(src, &options, &arena, scratch);
+            TEST_REQUIRE_TRUE(test_lz_items_are_same(threaded.items, lz.items));
+        }
+        TEST_REQUIRE_TRUE(costs[1] <= costs[0]);
+
+        arena_reset(&arena);
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_match_length(void) {
+    // Two buffers which are identical apart from a sprinkling of differences
+    uint8_t a[600];
+    uint8_t b[600];
+    uint32_t val = 372621;
+    for (uint32_t i = 0; i < sizeof a; i++) {
+        a[i] = b[i] = (uint8_t)(val >> 16);
+        val = (val * 100009 + 12356237);
+        if (val % 37 == 0) {
+            b[i] ^= 1 << (val % 8);
+        }
+    }
+
+    match_length_fn_t scalar = match_get_length_fn_for(match_impl_scalar);
+    TEST_REQUIRE_TRUE(scalar != 0);
+
+    for (uint32_t impl = 0; impl < match_impl_count; impl++) {
+        match_length_fn_t fn = match_get_length_fn_for(impl);
+        if (!fn) {
+            continue;
+        }
+        for (uint32_t start = 0; start < 64; start++) {
+            for (uint32_t max_length = 0; max_length <= 256; max_length++) {
+                TEST_REQUIRE_EQUAL(fn(a + start, b + start, max_length), scalar(a + start, b + start, max_length));
+                TEST_REQUIRE_EQUAL(fn(a + start, a + start, max_length), max_length);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
 int test_lz_simple(void) {
     arena_t arena = arena_make(0x800000);
     arena_t scratch = arena_make(0x800000);
@@ -91,7 +649,7 @@ int test_lz_simple(void) {
         .num = sizeof("the cat sat on the mat singinging") - 1
     };
 
-    lz_parse_result_t lz = lz_parse(src, &arena, scratch);
+    lz_parse_result_t lz = lz_parse(src, 0, &arena, scratch);
 
     //  0123456789.123456789.123456789.12
     // "the cat sat on the mat singinging"
@@ -201,7 +759,7 @@ int test_lz_file(void) {
     TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
     TEST_REQUIRE_EQUAL(file_result.contents.num, 8320);
 
-    lz_parse_result_t lz = lz_parse(file_result.contents, &arena, scratch);
+    lz_parse_result_t lz = lz_parse(file_result.contents, 0, &arena, scratch);
     lz_dump(&lz, "titlescreen.txt");
     byte_array_view_t compressed = lz_serialise(&lz, &arena);
     byte_array_view_t expanded = lz_deserialise(compressed, &arena);
@@ -221,6 +779,143 @@ int test_lz_file(void) {
 }
 
 
+int test_lz_file_mapped(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    // The mapped input should be the same as that read into memory
+    file_read_result_t file_result = file_read_binary("titlescreen.bin", &arena);
+    file_mapping_t src_mapping = file_map_binary("titlescreen.bin");
+    TEST_REQUIRE_EQUAL(src_mapping.error.type, file_error_none);
+    TEST_REQUIRE_EQUAL(src_mapping.contents.num, 8320);
+    TEST_REQUIRE_TRUE(memcmp(src_mapping.contents.data, file_result.contents.data, 8320) == 0);
+
+    // Serialising in place into a mapped output should write the same as serialising into the arena
+    lz_parse_result_t lz = lz_parse(src_mapping.contents.view, 0, &arena, scratch);
+    byte_array_view_t compressed = lz_serialise(&lz, &arena);
+    TEST_REQUIRE_EQUAL(lz_get_serialised_size(&lz), compressed.num);
+
+    file_mapping_t dest_mapping = file_map_binary_for_output("titlescreen.lz", compressed.num);
+    TEST_REQUIRE_EQUAL(dest_mapping.error.type, file_error_none);
+    byte_array_view_t written = lz_serialise_in_place(&lz, dest_mapping.contents);
+    TEST_REQUIRE_TRUE(written.data == dest_mapping.contents.data);
+    file_unmap(&dest_mapping);
+    file_unmap(&src_mapping);
+    TEST_REQUIRE_TRUE(src_mapping.contents.data == 0);
+
+    file_read_result_t dest_result = file_read_binary("titlescreen.lz", &arena);
+    remove("titlescreen.lz");
+    TEST_REQUIRE_EQUAL(dest_result.contents.num, compressed.num);
+    TEST_REQUIRE_TRUE(memcmp(dest_result.contents.data, compressed.data, compressed.num) == 0);
+
+    // A missing file can't be mapped
+    file_mapping_t missing = file_map_binary("missing.bin");
+    TEST_REQUIRE_EQUAL(missing.error.type, file_error_not_found);
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_lz_analysis(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+    lz_parse_result_t lz = lz_parse(file_result.contents, 0, &arena, scratch);
+
+    // The chosen number of fixed offset bits should be the cheapest of those tried
+    for (uint32_t n = 0; n < LZ_MAX_FIXED_BITS; n++) {
+        TEST_REQUIRE_TRUE(lz.fixed_bits_costs[n] >= lz.cost);
+    }
+    uint32_t chosen_cost = lz.fixed_bits_costs[lz.num_fixed_bits - 1];
+    TEST_REQUIRE_EQUAL(chosen_cost, lz.cost);
+
+    // The bits of each field should add up to the serialised size
+    lz_analysis_t analysis = lz_analyse(&lz);
+    uint32_t total_bits = analysis.header_bits + analysis.tally_bits + analysis.literal_bits +
+        analysis.offset_prefix_bits + analysis.offset_fixed_bits + analysis.length_bits;
+    TEST_REQUIRE_EQUAL(total_bits, analysis.header_bits + lz.cost);
+    TEST_REQUIRE_EQUAL((total_bits + 7) / 8, lz_serialise(&lz, &arena).num);
+
+    // Every token should be counted once, and cover the source between them
+    uint32_t num_offsets = 0;
+    for (uint32_t w = 0; w < 17; w++) {
+        num_offsets += analysis.offset_histogram[w];
+    }
+    uint32_t num_lengths = 0;
+    uint32_t num_bytes = analysis.num_literals;
+    for (uint32_t length = 0; length < 257; length++) {
+        num_lengths += analysis.length_histogram[length];
+        num_bytes += analysis.length_histogram[length] * length;
+    }
+    TEST_REQUIRE_EQUAL(num_offsets, analysis.num_refs);
+    TEST_REQUIRE_EQUAL(num_lengths, analysis.num_refs);
+    TEST_REQUIRE_EQUAL(num_bytes, file_result.contents.num);
+    TEST_REQUIRE_EQUAL(analysis.num_literals + analysis.num_refs, lz.items.num);
+
+    lz_dump_analysis(&lz, "test_0.analysis.json");
+    file_read_result_t json = file_read_binary("test_0.analysis.json", &arena);
+    remove("test_0.analysis.json");
+    TEST_REQUIRE_EQUAL(json.error.type, file_error_none);
+    TEST_REQUIRE_TRUE(json.contents.num > 0 && json.contents.data[0] == '{');
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_lz_decompress(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    // Repeats of every short period, so that matches of each offset turn up, including right at the end
+    byte_array_t src = byte_array_make(0x4000, &arena);
+    uint32_t seed = 999;
+    for (uint32_t period = 1; period <= 40; period++) {
+        uint32_t start = src.num;
+        for (uint32_t i = 0; i < period; i++) {
+            seed = seed * 1664525 + 1013904223;
+            byte_array_add(&src, (uint8_t)(seed >> 24), &arena);
+        }
+        uint32_t length = 3 + (seed >> 8) % 300;
+        for (uint32_t i = 0; i < length; i++) {
+            byte_array_add(&src, byte_array_get(&src, start + i), &arena);
+        }
+    }
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+
+    byte_array_view_t srcs[] = {src.view, file_result.contents};
+    for (uint32_t n = 0; n < sizeof srcs / sizeof *srcs; n++) {
+        lz_parse_result_t lz = lz_parse(srcs[n], 0, &arena, scratch);
+        byte_array_view_t compressed = lz_serialise(&lz, &arena);
+        TEST_REQUIRE_EQUAL(lz_get_decompressed_size(compressed), srcs[n].num);
+
+        byte_array_span_t dest = byte_array_span_make(srcs[n].num, &arena);
+        TEST_REQUIRE_TRUE(lz_decompress(compressed, dest));
+        TEST_REQUIRE_TRUE(memcmp(srcs[n].data, dest.data, srcs[n].num) == 0);
+
+        // A destination of the wrong size is rejected
+        byte_array_span_t too_small = byte_array_span_make(srcs[n].num - 1, &arena);
+        byte_array_span_t too_big = byte_array_span_make(srcs[n].num + 1, &arena);
+        TEST_REQUIRE_FALSE(lz_decompress(compressed, too_small));
+        TEST_REQUIRE_FALSE(lz_decompress(compressed, too_big));
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
 int test_bitstream(void) {
     arena_t arena = arena_make(0x800000);
 
@@ -257,13 +952,111 @@ int test_bitstream(void) {
 }
 
 
-#define TEMPLATE_ARRAY_NAME uint32_array
-#define TEMPLATE_ARRAY_TYPE uint32_t
-#include "array.template.h"
-
 #define TEMPLATE_SORT_NAME uint32
 #include "sort.template.h"
 
+int test_bitstream64(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    // Some huffman codes to write, from the symbol counts of a text
+    const char *text = "the cat sat on the mat singinging";
+    uint16_t counts[256] = {0};
+    for (const char *c = text; *c; c++) {
+        counts[(uint8_t)*c]++;
+    }
+    uint8_array_view_t lengths = huffman_build_code_lengths((uint16_array_view_t) VIEW(counts), 0, &arena, scratch);
+    uint16_array_view_t codes = huffman_get_canonical_encoding(lengths, &arena);
+    bitwriter64_code_array_view_t code_pairs = bitwriter64_make_huffman_codes(codes, &arena);
+
+    // Write the same random mix of fields with both bitwriters; the streams should be identical
+    bitwriter_t expected = bitwriter_make(16, &arena);
+    bitwriter64_t actual = bitwriter64_make(16, &arena);
+    uint32_t seed = 54321;
+    for (uint32_t i = 0; i < 10000; i++) {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t r = seed >> 8;
+        switch (seed >> 30) {
+            case 0: {
+                uint32_t numbits = r % 17;
+                bitwriter_add_value(&expected, r >> 5, numbits, &arena);
+                bitwriter64_add_value(&actual, r >> 5, numbits, &arena);
+                break;
+            }
+            case 1: {
+                uint32_t value = 1 + (r >> (r % 16)) % 256;
+                bitwriter_add_elias_gamma_value(&expected, value, &arena);
+                bitwriter64_add_elias_gamma_value(&actual, value, &arena);
+                break;
+            }
+            case 2: {
+                uint32_t fixed_bits = r % 9;
+                uint32_t value = (r >> 4) % (256U << fixed_bits);
+                bitwriter_add_hybrid_value(&expected, value, fixed_bits, &arena);
+                bitwriter64_add_hybrid_value(&actual, value, fixed_bits, &arena);
+                break;
+            }
+            default: {
+                uint8_t symbol = (uint8_t)text[r % 33];
+                bitwriter_add_huffman_code(&expected, codes, symbol, &arena);
+                bitwriter64_add_huffman_code(&actual, code_pairs, symbol, &arena);
+                break;
+            }
+        }
+    }
+
+    byte_array_view_t stream = bitwriter64_flush(&actual, &arena);
+    TEST_REQUIRE_EQUAL(stream.num, expected.data.num);
+    TEST_REQUIRE_TRUE(memcmp(stream.data, expected.data.data, stream.num) == 0);
+
+    // Now read them back with the fast bitreader
+    huffman_table_t table = huffman_table_make(huffman_decoder_make(lengths, &arena), &arena);
+    bitreader64_t reader = bitreader64_make(stream);
+    seed = 54321;
+    for (uint32_t i = 0; i < 10000; i++) {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t r = seed >> 8;
+        switch (seed >> 30) {
+            case 0: {
+                uint32_t numbits = r % 17;
+                uint32_t value = bitreader64_get_value(&reader, numbits);
+                TEST_REQUIRE_EQUAL(value, (r >> 5) & ((1U << numbits) - 1));
+                break;
+            }
+            case 1: {
+                uint32_t value = 1 + (r >> (r % 16)) % 256;
+                uint32_t actual_value = bitreader64_get_elias_gamma_value(&reader);
+                TEST_REQUIRE_EQUAL(actual_value, value & 0xFF);
+                break;
+            }
+            case 2: {
+                uint32_t fixed_bits = r % 9;
+                uint32_t value = (r >> 4) % (256U << fixed_bits);
+                uint32_t actual_value = bitreader64_get_hybrid_value(&reader, fixed_bits);
+                TEST_REQUIRE_EQUAL(actual_value, value);
+                break;
+            }
+            default: {
+                uint8_t symbol = (uint8_t)text[r % 33];
+                uint32_t actual_symbol = bitreader64_get_huffman_code(&reader, &table);
+                TEST_REQUIRE_EQUAL(actual_symbol, symbol);
+                break;
+            }
+        }
+    }
+    TEST_REQUIRE_FALSE(bitreader64_is_overrun(&reader));
+
+    // Reading the padding at the end is safe, and is noticed
+    bitreader64_get_value(&reader, 32);
+    bitreader64_get_elias_gamma_value(&reader);
+    TEST_REQUIRE_TRUE(bitreader64_is_overrun(&reader));
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+    return 0;
+}
+
+
 int test_sort(void) {
     uint32_t data[1000];
     uint32_array_span_t span = SPAN(data);
@@ -370,11 +1163,11 @@ int test_huffman_simple(void) {
 
     huffman_decoder_t decoder = huffman_decoder_make(huff, &arena);
     TEST_REQUIRE_EQUAL(decoder.num_codes_of_length.num, 5);
-    TEST_REQUIRE_EQUAL(uint8_array_view_get(decoder.num_codes_of_length, 0), 0);
-    TEST_REQUIRE_EQUAL(uint8_array_view_get(decoder.num_codes_of_length, 1), 2);
-    TEST_REQUIRE_EQUAL(uint8_array_view_get(decoder.num_codes_of_length, 2), 1);
-    TEST_REQUIRE_EQUAL(uint8_array_view_get(decoder.num_codes_of_length, 3), 5);
-    TEST_REQUIRE_EQUAL(uint8_array_view_get(decoder.num_codes_of_length, 4), 2);
+    TEST_REQUIRE_EQUAL(uint16_array_view_get(decoder.num_codes_of_length, 0), 0);
+    TEST_REQUIRE_EQUAL(uint16_array_view_get(decoder.num_codes_of_length, 1), 2);
+    TEST_REQUIRE_EQUAL(uint16_array_view_get(decoder.num_codes_of_length, 2), 1);
+    TEST_REQUIRE_EQUAL(uint16_array_view_get(decoder.num_codes_of_length, 3), 5);
+    TEST_REQUIRE_EQUAL(uint16_array_view_get(decoder.num_codes_of_length, 4), 2);
 
     TEST_REQUIRE_EQUAL(decoder.dictionary.num, 10);
     TEST_REQUIRE_EQUAL(uint16_array_view_get(decoder.dictionary, 0), ' ');
@@ -457,11 +1250,541 @@ int test_huffman_file(void) {
 }
 
 
+int test_huffman_table(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    // A stream of random bits, which will include invalid codes for any incomplete code sets
+    uint32_t seed = 12345;
+    byte_array_t stream = byte_array_make(0x1000, &arena);
+    for (uint32_t i = 0; i < 0x1000; i++) {
+        seed = seed * 1664525 + 1013904223;
+        byte_array_add(&stream, (uint8_t)(seed >> 24), &arena);
+    }
+
+    // Try code lengths from a range of alphabet sizes and skewed symbol counts, with and without subtables
+    uint32_t num_symbols[] = {2, 3, 16, 100, 257};
+    uint32_t max_code_lengths[] = {1, 4, 7, 10, 11, 15};
+    for (uint32_t n = 0; n < sizeof num_symbols / sizeof *num_symbols; n++) {
+        for (uint32_t m = 0; m < sizeof max_code_lengths / sizeof *max_code_lengths; m++) {
+            if ((1U << max_code_lengths[m]) < num_symbols[n]) {
+                continue;
+            }
+
+            uint16_t counts[257] = {0};
+            for (uint32_t i = 0; i < num_symbols[n]; i++) {
+                seed = seed * 1664525 + 1013904223;
+                counts[i] = (uint16_t)(1 + ((seed >> 8) & ((1U << ((seed >> 28) % 12)) - 1)));
+            }
+
+            uint16_array_view_t symbol_counts = {.data = counts, .num = num_symbols[n]};
+            uint8_array_view_t lengths = huffman_build_code_lengths(symbol_counts, max_code_lengths[m], &arena, scratch);
+            huffman_decoder_t decoder = huffman_decoder_make(lengths, &arena);
+            huffman_table_t table = huffman_table_make(decoder, &arena);
+
+            bitreader_t expected = bitreader_make(stream.view);
+            bitreader64_t actual = bitreader64_make(stream.view);
+            while (expected.index < stream.num - 2) {
+                uint16_t symbol = bitreader_get_huffman_code(&expected, decoder);
+                TEST_REQUIRE_EQUAL(bitreader64_get_huffman_code(&actual, &table), symbol);
+            }
+            uint32_t value = bitreader_get_value(&expected, 8);
+            TEST_REQUIRE_EQUAL(bitreader64_get_value(&actual, 8), value);
+        }
+    }
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
 int test_lzhuff_simple(void) {
     return 0;
 }
 
 
+int test_method(void) {
+    arena_t arena = arena_make(0x4000000);
+    arena_t scratch = arena_make(0x4000000);
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+    byte_array_view_t src = file_result.contents;
+
+    // Each method should do as well as it does on its own, with the lz parses sharing their refs
+    lz_options_t options = {.num_threads = 4};
+    method_result_t result = method_choose(src, &options, &arena, scratch);
+
+    lz_parse_result_t lz = lz_parse(src, 0, &arena, scratch);
+    byte_array_view_t lz_compressed = lz_serialise(&lz, &arena);
+    TEST_REQUIRE_EQUAL(result.reports[method_lz].size, lz_compressed.num);
+    TEST_REQUIRE_TRUE(result.reports[method_lz].verified);
+
+    lzhuff_result_t lzhuff = lzhuff_parse(src, 0, &arena, scratch);
+    uint32_t lzhuff_size = (lzhuff_item_array_view_get(lzhuff.items, 0).total_cost + 7) / 8;
+    TEST_REQUIRE_EQUAL(result.reports[method_lzhuff].size, lzhuff_size);
+    TEST_REQUIRE_TRUE(!result.reports[method_lzhuff].verified);
+
+    // Huffman is the smallest on this file
+    byte_array_view_t huffman_compressed = huffman_serialise(src, &arena, scratch);
+    TEST_REQUIRE_EQUAL(result.method, method_huffman);
+    TEST_REQUIRE_EQUAL(result.compressed.num, huffman_compressed.num);
+    TEST_REQUIRE_TRUE(memcmp(result.compressed.data, huffman_compressed.data, huffman_compressed.num) == 0);
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_batch(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    const char *manifest =
+        "# test jobs\n"
+        "lz titlescreen.bin batch_0.bin\r\n"
+        "\n"
+        "huffman test_0.bin batch_1.bin\n"
+        "lz test_0.bin batch_2.bin";
+    file_error_t error = file_write_binary("batch.txt", (byte_array_view_t) {.data = (const uint8_t *)manifest, .num = (uint32_t)strlen(manifest)});
+    TEST_REQUIRE_EQUAL(error.type, file_error_none);
+
+    batch_options_t options = {.lz_options = {.num_threads = 2}, .verify = true};
+    bool ok = batch_run("batch.txt", "batch_results.txt", &options);
+    TEST_REQUIRE_TRUE(ok);
+
+    // Each job should write the same as compressing its file on its own
+    const char *filenames[3][2] = {
+        {"titlescreen.bin", "batch_0.bin"},
+        {"test_0.bin", "batch_1.bin"},
+        {"test_0.bin", "batch_2.bin"}
+    };
+    for (uint32_t f = 0; f < 3; f++) {
+        byte_array_view_t src = file_read_binary(filenames[f][0], &arena).contents;
+        byte_array_view_t expected = {0};
+        if (f == 1) {
+            expected = huffman_serialise(src, &arena, scratch);
+        }
+        else {
+            lz_parse_result_t lz = lz_parse(src, 0, &arena, scratch);
+            expected = lz_serialise(&lz, &arena);
+        }
+        file_read_result_t actual = file_read_binary(filenames[f][1], &arena);
+        remove(filenames[f][1]);
+        TEST_REQUIRE_EQUAL(actual.contents.num, expected.num);
+        TEST_REQUIRE_TRUE(memcmp(actual.contents.data, expected.data, expected.num) == 0);
+    }
+
+    // A job which fails doesn't stop the others, but the batch reports it
+    manifest = "lz missing.bin batch_0.bin\nlz test_0.bin batch_1.bin\n";
+    file_write_binary("batch.txt", (byte_array_view_t) {.data = (const uint8_t *)manifest, .num = (uint32_t)strlen(manifest)});
+    ok = batch_run("batch.txt", "batch_results.txt", &options);
+    TEST_REQUIRE_TRUE(!ok);
+    file_read_result_t written = file_read_binary("batch_1.bin", &arena);
+    TEST_REQUIRE_EQUAL(written.error.type, file_error_none);
+
+    remove("batch_1.bin");
+    remove("batch_results.txt");
+    remove("batch.txt");
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_cache(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    cache_t cache = cache_make("cache_test", CACHE_DEFAULT_MAX_SIZE);
+    TEST_REQUIRE_TRUE(cache_is_enabled(&cache));
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+    byte_array_view_t src = file_result.contents;
+    lz_parse_result_t lz = lz_parse(src, 0, &arena, scratch);
+    byte_array_view_t compressed = lz_serialise(&lz, &arena);
+
+    // The key depends on the input, the type and the options which change the output, but not the thread count
+    lz_options_t options = {.num_threads = 4};
+    cache_key_t key = cache_key_make("lz", 0, src);
+    cache_key_t threaded_key = cache_key_make("lz", &options, src);
+    TEST_REQUIRE_TRUE(memcmp(&key, &threaded_key, sizeof(key)) == 0);
+    options.prune = true;
+    cache_key_t pruned_key = cache_key_make("lz", &options, src);
+    TEST_REQUIRE_TRUE(memcmp(&key, &pruned_key, sizeof(key)) != 0);
+    cache_key_t huffman_key = cache_key_make("huffman", 0, src);
+    TEST_REQUIRE_TRUE(memcmp(&key, &huffman_key, sizeof(key)) != 0);
+    cache_key_t other_key = cache_key_make("lz", 0, byte_array_view_make_subview(src, 1, src.num));
+    TEST_REQUIRE_TRUE(memcmp(&key, &other_key, sizeof(key)) != 0);
+
+    // Nothing is found until it's stored
+    TEST_REQUIRE_TRUE(!cache_lookup(&cache, key, src.num, &arena).data);
+    cache_store(&cache, key, src.num, compressed, scratch);
+    byte_array_view_t found = cache_lookup(&cache, key, src.num, &arena);
+    TEST_REQUIRE_EQUAL(found.num, compressed.num);
+    TEST_REQUIRE_TRUE(memcmp(found.data, compressed.data, compressed.num) == 0);
+    TEST_REQUIRE_TRUE(!cache_lookup(&cache, key, src.num + 1, &arena).data);
+    TEST_REQUIRE_TRUE(!cache_lookup(&cache, pruned_key, src.num, &arena).data);
+
+    // An entry whose output has been damaged misses, and is removed
+    char path[CACHE_MAX_PATH];
+    snprintf(path, sizeof(path), "cache_test/%016llx%016llx.rcc", (unsigned long long)key.hash[0], (unsigned long long)key.hash[1]);
+    file_read_result_t entry = file_read_binary(path, &arena);
+    TEST_REQUIRE_EQUAL(entry.error.type, file_error_none);
+    byte_array_span_t damaged = byte_array_span_make(entry.contents.num, &arena);
+    memcpy(damaged.data, entry.contents.data, entry.contents.num);
+    damaged.data[damaged.num - 1] ^= 1;
+    TEST_REQUIRE_EQUAL(file_write_binary(path, damaged.view).type, file_error_none);
+    TEST_REQUIRE_TRUE(!cache_lookup(&cache, key, src.num, &arena).data);
+    TEST_REQUIRE_TRUE(!cache_lookup(&cache, key, src.num, &arena).data);
+    cache_store(&cache, key, src.num, compressed, scratch);
+
+    // Eviction keeps the cache within its size
+    cache_evict(&cache, scratch);
+    TEST_REQUIRE_TRUE(cache_lookup(&cache, key, src.num, &arena).data != 0);
+    cache.max_size = 0;
+    cache_evict(&cache, scratch);
+    TEST_REQUIRE_TRUE(!cache_lookup(&cache, key, src.num, &arena).data);
+
+    // The cache is now empty
+    remove("cache_test");
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+typedef struct test_library_context_t {
+    byte_array_view_t src;
+    bool same[4];
+    richcrunch_context_t *shared;
+    size_t expected_sizes[2];
+} test_library_context_t;
+
+
+static void test_library_job(void *context, uint32_t job, uint32_t worker) {
+    test_library_context_t *test = context;
+    richcrunch_context_t *richcrunch = richcrunch_create(0);
+    richcrunch_output_t compressed = {0};
+    richcrunch_output_t expanded = {0};
+    test->same[job] = richcrunch &&
+        richcrunch_compress(richcrunch, richcrunch_codec_lz, test->src.data, test->src.num, &compressed) == richcrunch_error_none &&
+        richcrunch_decompress(richcrunch, richcrunch_codec_lz, compressed.data, compressed.size, &expanded) == richcrunch_error_none &&
+        expanded.size == test->src.num &&
+        memcmp(expanded.data, test->src.data, test->src.num) == 0;
+    richcrunch_destroy(richcrunch);
+}
+
+
+static void test_library_shared_job(void *context, uint32_t job, uint32_t worker) {
+    test_library_context_t *test = context;
+    richcrunch_codec_t codecs[] = {richcrunch_codec_lz, richcrunch_codec_huffman};
+    test->same[job] = true;
+    for (uint32_t n = 0; n < 8; n++) {
+        size_t size = 0;
+        richcrunch_codec_t codec = codecs[(job + n) % 2];
+        test->same[job] &= richcrunch_estimate(test->shared, codec, test->src.data, test->src.num, &size) == richcrunch_error_none &&
+            size == test->expected_sizes[(job + n) % 2];
+    }
+}
+
+
+// A simple generator, so that the corrupt data is the same on every run
+static uint32_t test_random(uint32_t *seed) {
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+
+int test_library_corrupt(void) {
+    arena_t arena = arena_make(0x800000);
+
+    file_read_result_t file_result = file_read_binary("titlescreen.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+    byte_array_view_t src = file_result.contents;
+
+    richcrunch_context_t *context = richcrunch_create(0);
+    TEST_REQUIRE_TRUE(context != 0);
+
+    // Truncated, damaged and made up data should be reported as corrupt, or at worst decompress to something else,
+    // but never assert, crash or take long to give up
+    richcrunch_codec_t codecs[] = {richcrunch_codec_lz, richcrunch_codec_huffman};
+    uint32_t seed = 1;
+    for (uint32_t c = 0; c < 2; c++) {
+        richcrunch_output_t output = {0};
+        TEST_REQUIRE_EQUAL(richcrunch_compress(context, codecs[c], src.data, src.num, &output), richcrunch_error_none);
+        byte_array_span_t compressed = byte_array_span_make((uint32_t)output.size, &arena);
+        memcpy(compressed.data, output.data, output.size);
+
+        for (uint32_t size = 1; size < compressed.num; size++) {
+            TEST_REQUIRE_EQUAL(richcrunch_decompress(context, codecs[c], compressed.data, size, &output), richcrunch_error_corrupt);
+        }
+
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t i = test_random(&seed) % compressed.num;
+            uint8_t bit = (uint8_t)(1 << (test_random(&seed) % 8));
+            compressed.data[i] ^= bit;
+            richcrunch_error_t error = richcrunch_decompress(context, codecs[c], compressed.data, compressed.num, &output);
+            TEST_REQUIRE_TRUE(error == richcrunch_error_none || error == richcrunch_error_corrupt);
+            compressed.data[i] ^= bit;
+        }
+
+        uint8_t garbage[256];
+        for (uint32_t n = 0; n < 1024; n++) {
+            uint32_t size = 1 + n % sizeof(garbage);
+            for (uint32_t i = 0; i < size; i++) {
+                garbage[i] = (uint8_t)((n & 256) ? test_random(&seed) : (test_random(&seed) % 4 == 0) * 0xFF);
+            }
+            richcrunch_error_t error = richcrunch_decompress(context, codecs[c], garbage, size, &output);
+            TEST_REQUIRE_TRUE(error == richcrunch_error_none || error == richcrunch_error_corrupt);
+        }
+    }
+
+    richcrunch_destroy(context);
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+int test_library(void) {
+    arena_t arena = arena_make(0x800000);
+
+    file_read_result_t file_result = file_read_binary("titlescreen.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+    byte_array_view_t src = file_result.contents;
+
+    richcrunch_options_t options = {.finder = richcrunch_finder_suffix_array};
+    richcrunch_context_t *context = richcrunch_create(&options);
+    TEST_REQUIRE_TRUE(context != 0);
+
+    // Each codec which can be serialised should give back the input, with its exact size estimated beforehand
+    richcrunch_codec_t codecs[] = {richcrunch_codec_lz, richcrunch_codec_huffman, richcrunch_codec_auto};
+    for (uint32_t c = 0; c < 3; c++) {
+        size_t estimated_size = 0;
+        TEST_REQUIRE_EQUAL(richcrunch_estimate(context, codecs[c], src.data, src.num, &estimated_size), richcrunch_error_none);
+
+        richcrunch_output_t compressed = {0};
+        TEST_REQUIRE_EQUAL(richcrunch_compress(context, codecs[c], src.data, src.num, &compressed), richcrunch_error_none);
+        TEST_REQUIRE_EQUAL((uint32_t)compressed.size, (uint32_t)estimated_size);
+        TEST_REQUIRE_TRUE(compressed.codec == richcrunch_codec_lz || compressed.codec == richcrunch_codec_huffman);
+
+        // The output belongs to the context, so it has to be copied before the next call
+        byte_array_span_t copy = byte_array_span_make((uint32_t)compressed.size, &arena);
+        memcpy(copy.data, compressed.data, compressed.size);
+
+        richcrunch_output_t expanded = {0};
+        TEST_REQUIRE_EQUAL(richcrunch_decompress(context, compressed.codec, copy.data, copy.num, &expanded), richcrunch_error_none);
+        TEST_REQUIRE_EQUAL((uint32_t)expanded.size, src.num);
+        TEST_REQUIRE_TRUE(memcmp(expanded.data, src.data, src.num) == 0);
+
+        // Truncated lz data should be caught
+        if (compressed.codec == richcrunch_codec_lz) {
+            TEST_REQUIRE_EQUAL(richcrunch_decompress(context, richcrunch_codec_lz, copy.data, copy.num / 2, &expanded), richcrunch_error_corrupt);
+        }
+    }
+
+    // lzhuff can only be estimated
+    size_t lzhuff_size = 0;
+    richcrunch_output_t output = {0};
+    TEST_REQUIRE_EQUAL(richcrunch_estimate(context, richcrunch_codec_lzhuff, src.data, src.num, &lzhuff_size), richcrunch_error_none);
+    TEST_REQUIRE_TRUE(lzhuff_size > 0 && lzhuff_size < src.num);
+    TEST_REQUIRE_EQUAL(richcrunch_compress(context, richcrunch_codec_lzhuff, src.data, src.num, &output), richcrunch_error_unsupported);
+    TEST_REQUIRE_EQUAL(richcrunch_decompress(context, richcrunch_codec_auto, src.data, src.num, &output), richcrunch_error_unsupported);
+
+    // Bad arguments are reported rather than asserted on
+    TEST_REQUIRE_EQUAL(richcrunch_compress(0, richcrunch_codec_lz, src.data, src.num, &output), richcrunch_error_invalid_argument);
+    TEST_REQUIRE_EQUAL(richcrunch_compress(context, richcrunch_codec_lz, 0, src.num, &output), richcrunch_error_invalid_argument);
+    TEST_REQUIRE_EQUAL(richcrunch_compress(context, richcrunch_codec_lz, src.data, 0, &output), richcrunch_error_invalid_argument);
+    TEST_REQUIRE_EQUAL(richcrunch_compress(context, richcrunch_codec_huffman, src.data, 0x10000, &output), richcrunch_error_too_large);
+
+    TEST_REQUIRE_EQUAL(richcrunch_compress(context, richcrunch_codec_lz, src.data, (size_t)UINT32_MAX, &output), richcrunch_error_too_large);
+
+    // Calls on a shared context run one at a time, so each thread still gets the right answer
+    test_library_context_t shared_test = {.src = src, .shared = context};
+    TEST_REQUIRE_EQUAL(richcrunch_estimate(context, richcrunch_codec_lz, src.data, src.num, &shared_test.expected_sizes[0]), richcrunch_error_none);
+    TEST_REQUIRE_EQUAL(richcrunch_estimate(context, richcrunch_codec_huffman, src.data, src.num, &shared_test.expected_sizes[1]), richcrunch_error_none);
+    thread_pool_run(4, 4, test_library_shared_job, &shared_test);
+    TEST_REQUIRE_TRUE(shared_test.same[0] && shared_test.same[1] && shared_test.same[2] && shared_test.same[3]);
+
+    richcrunch_destroy(context);
+
+    // The quicker parse levels should give the same sizes as lz_parse does with them, and decompress
+    size_t optimal_size = shared_test.expected_sizes[0];
+    richcrunch_parser_t parsers[] = {richcrunch_parser_lazy, richcrunch_parser_greedy};
+    lz_parser_t lz_parsers[] = {lz_parser_lazy, lz_parser_greedy};
+    arena_t scratch = arena_make(0x800000);
+    for (uint32_t p = 0; p < 2; p++) {
+        richcrunch_options_t level_options = {.finder = richcrunch_finder_suffix_array, .parser = parsers[p]};
+        richcrunch_context_t *level_context = richcrunch_create(&level_options);
+        TEST_REQUIRE_TRUE(level_context != 0);
+
+        richcrunch_output_t compressed = {0};
+        TEST_REQUIRE_EQUAL(richcrunch_compress(level_context, richcrunch_codec_lz, src.data, src.num, &compressed), richcrunch_error_none);
+        TEST_REQUIRE_TRUE(compressed.size >= optimal_size);
+        lz_options_t lz_options = {.finder = refs_finder_suffix_array, .parser = lz_parsers[p]};
+        lz_parse_result_t lz = lz_parse(src, &lz_options, &arena, scratch);
+        TEST_REQUIRE_EQUAL((uint32_t)compressed.size, lz_get_serialised_size(&lz));
+
+        byte_array_span_t copy = byte_array_span_make((uint32_t)compressed.size, &arena);
+        memcpy(copy.data, compressed.data, compressed.size);
+        richcrunch_output_t expanded = {0};
+        TEST_REQUIRE_EQUAL(richcrunch_decompress(level_context, richcrunch_codec_lz, copy.data, copy.num, &expanded), richcrunch_error_none);
+        TEST_REQUIRE_TRUE(expanded.size == src.num && memcmp(expanded.data, src.data, src.num) == 0);
+
+        richcrunch_destroy(level_context);
+    }
+    arena_deinit(&scratch);
+
+    // Contexts are independent, so they can be used on different threads at once
+    test_library_context_t test = {.src = src};
+    thread_pool_run(2, 2, test_library_job, &test);
+    TEST_REQUIRE_TRUE(test.same[0] && test.same[1]);
+
+    arena_deinit(&arena);
+
+    return 0;
+}
+
+
+#if defined(__unix__) || defined(__APPLE__)
+static int test_serve_main(void *arg) {
+    serve_options_t options = {0};
+    return serve_run(arg, &options) ? 0 : 1;
+}
+
+
+int test_serve(void) {
+    arena_t arena = arena_make(0x800000);
+    const char *socket_path = "serve_test.sock";
+
+    thread_handle_t server;
+    TEST_REQUIRE_TRUE(thread_start(&server, test_serve_main, (void *)socket_path));
+
+    // Wait for the server to start listening
+    char reply[SERVE_MAX_LINE];
+    bool reached = false;
+    for (uint32_t attempt = 0; attempt < 1000 && !reached; attempt++) {
+        reached = serve_send(socket_path, "ping", reply, sizeof(reply));
+        if (!reached) {
+            thread_sleep_ms(1);
+        }
+    }
+    TEST_REQUIRE_TRUE(reached);
+    TEST_REQUIRE_TRUE(strncmp(reply, "error", 5) == 0);
+
+    // The socket is only for our user, and a second server mustn't take it over
+    struct stat socket_stat;
+    TEST_REQUIRE_EQUAL(stat(socket_path, &socket_stat), 0);
+    TEST_REQUIRE_EQUAL(socket_stat.st_mode & 077, 0);
+    TEST_REQUIRE_EQUAL(test_serve_main((void *)socket_path), 1);
+    TEST_REQUIRE_TRUE(serve_send(socket_path, "ping", reply, sizeof(reply)));
+
+    // The same request twice should give the same output, which should decompress to the input
+    file_read_result_t src = file_read_binary("titlescreen.bin", &arena);
+    TEST_REQUIRE_EQUAL(src.error.type, file_error_none);
+    for (uint32_t n = 0; n < 2; n++) {
+        TEST_REQUIRE_TRUE(serve_send_job(socket_path, "lz", true, "titlescreen.bin", "titlescreen.served", reply, sizeof(reply)));
+        TEST_REQUIRE_TRUE(strncmp(reply, "ok lz 8320 ", 11) == 0);
+
+        file_read_result_t served = file_read_binary("titlescreen.served", &arena);
+        TEST_REQUIRE_EQUAL(served.error.type, file_error_none);
+        byte_array_view_t expanded = lz_deserialise(served.contents, &arena);
+        TEST_REQUIRE_EQUAL(expanded.num, src.contents.num);
+        TEST_REQUIRE_TRUE(memcmp(expanded.data, src.contents.data, expanded.num) == 0);
+    }
+    remove("titlescreen.served");
+
+    // Failures are reported in the reply
+    TEST_REQUIRE_TRUE(serve_send_job(socket_path, "lz", false, "missing.bin", "missing.served", reply, sizeof(reply)));
+    TEST_REQUIRE_TRUE(strcmp(reply, "error can't read input") == 0);
+    TEST_REQUIRE_TRUE(serve_send_job(socket_path, "lzhuff", false, "titlescreen.bin", "titlescreen.served", reply, sizeof(reply)));
+    TEST_REQUIRE_TRUE(strcmp(reply, "error unknown type") == 0);
+
+    // A client which keeps its connection open, with no request in progress, shouldn't stop the server from stopping
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, socket_path);
+    int idle = socket(AF_UNIX, SOCK_STREAM, 0);
+    TEST_REQUIRE_TRUE(idle >= 0);
+    TEST_REQUIRE_EQUAL(connect(idle, (const struct sockaddr *)&address, sizeof(address)), 0);
+    TEST_REQUIRE_EQUAL((int)send(idle, "ping\n", 5, 0), 5);
+    TEST_REQUIRE_TRUE(recv(idle, reply, sizeof(reply), 0) > 0);
+
+    TEST_REQUIRE_TRUE(serve_send(socket_path, "shutdown", reply, sizeof(reply)));
+    TEST_REQUIRE_TRUE(strcmp(reply, "ok") == 0);
+    TEST_REQUIRE_EQUAL(thread_join(&server), 0);
+    TEST_REQUIRE_EQUAL((int)recv(idle, reply, sizeof(reply), 0), 0);
+    close(idle);
+    TEST_REQUIRE_FALSE(serve_send(socket_path, "ping", reply, sizeof(reply)));
+
+    // Something at the path which isn't a socket is left alone
+    TEST_REQUIRE_EQUAL(file_write_binary(socket_path, (byte_array_view_t) {.data = (const uint8_t *)"keep", .num = 4}).type, file_error_none);
+    TEST_REQUIRE_EQUAL(test_serve_main((void *)socket_path), 1);
+    file_read_result_t kept = file_read_binary(socket_path, &arena);
+    TEST_REQUIRE_EQUAL(kept.error.type, file_error_none);
+    TEST_REQUIRE_EQUAL(kept.contents.num, 4);
+    remove(socket_path);
+
+    arena_deinit(&arena);
+
+    return 0;
+}
+#endif
+
+
+#ifdef STATS_ENABLED
+int test_stats(void) {
+    arena_t arena = arena_make(0x800000);
+    arena_t scratch = arena_make(0x800000);
+
+    file_read_result_t file_result = file_read_binary("test_0.bin", &arena);
+    TEST_REQUIRE_EQUAL(file_result.error.type, file_error_none);
+    uint32_t num = file_result.contents.num;
+
+    stats_reset();
+    lz_parse_result_t lz = lz_parse(file_result.contents, 0, &arena, scratch);
+    byte_array_view_t compressed = lz_serialise(&lz, &arena);
+
+    // Every index has at least its literal examined, and every pair but the last is found in the sequence cache
+    uint64_t num_tokens = stats_get_counter(stats_counter_tokens_examined);
+    uint64_t num_relaxations = stats_get_counter(stats_counter_relaxations);
+    uint64_t num_pairs_scanned = stats_get_counter(stats_counter_pairs_scanned);
+    uint64_t num_bits = stats_get_counter(stats_counter_bits_written);
+    TEST_REQUIRE_TRUE(num_tokens >= num);
+    TEST_REQUIRE_TRUE(num_relaxations >= num);
+    TEST_REQUIRE_TRUE(num_pairs_scanned >= num - 1);
+    TEST_REQUIRE_TRUE(num_bits > (uint64_t)compressed.num * 8 - 8 && num_bits <= (uint64_t)compressed.num * 8);
+
+    // Only the timers which were used are reported
+    char text[4096] = {0};
+    FILE *file = tmpfile();
+    TEST_REQUIRE_TRUE(file);
+    stats_print(file, true);
+    rewind(file);
+    size_t text_length = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    TEST_REQUIRE_TRUE(text_length > 0);
+    TEST_REQUIRE_TRUE(strstr(text, "\"refs_make\": {") != 0);
+    TEST_REQUIRE_TRUE(strstr(text, "\"lz_sweeps\": {") != 0);
+    TEST_REQUIRE_TRUE(strstr(text, "\"huffman_serialise\"") == 0);
+
+    arena_deinit(&scratch);
+    arena_deinit(&arena);
+
+    return 0;
+}
+#endif
+
+
 int test_compare_methods(void) {
     arena_t arena = arena_make(0x800000);
     arena_t scratch = arena_make(0x800000);
@@ -473,7 +1796,7 @@ int test_compare_methods(void) {
 
     // Do lz compression
     {
-        lz_parse_result_t lz = lz_parse(file_result.contents, &arena, scratch);
+        lz_parse_result_t lz = lz_parse(file_result.contents, 0, &arena, scratch);
         lz_dump(&lz, "test_0.txt");
         byte_array_view_t compressed = lz_serialise(&lz, &arena);
         byte_array_view_t expanded = lz_deserialise(compressed, &arena);
@@ -504,7 +1827,7 @@ int test_compare_methods(void) {
 
     // Do lzhuff compression
     {
-        lzhuff_result_t lzhuff = lzhuff_parse(file_result.contents, &arena, scratch);
+        lzhuff_result_t lzhuff = lzhuff_parse(file_result.contents, 0, &arena, scratch);
         printf("lzhuff %d\n",
             (lzhuff_item_array_view_get(lzhuff.items, 0).total_cost + 7) / 8
         );
@@ -519,13 +1842,41 @@ int test_compare_methods(void) {
 
 
 int test_run(void) {
-    return test_refs()
+    return test_arena_virtual()
+        || test_arena_checkpoint()
+        || test_arena_stats()
+        || test_thread_pool()
+        || test_refs()
+        || test_refs_suffix_array()
+        || test_refs_threaded()
+        || test_refs_pruned()
+        || test_refs_large()
+        || test_parse_threaded()
+        || test_parse_lengths()
+        || test_parse_levels()
+        || test_match_length()
         || test_lz_simple()
         || test_lz_file()
+        || test_lz_file_mapped()
+        || test_lz_analysis()
+        || test_lz_decompress()
         || test_bitstream()
+        || test_bitstream64()
         || test_sort()
         || test_huffman_simple()
         || test_huffman_file()
+        || test_huffman_table()
         || test_lzhuff_simple()
+        || test_method()
+        || test_batch()
+        || test_cache()
+        || test_library()
+        || test_library_corrupt()
+#if defined(__unix__) || defined(__APPLE__)
+        || test_serve()
+#endif
+#ifdef STATS_ENABLED
+        || test_stats()
+#endif
         || test_compare_methods();
 }
@@ -0,0 +1,224 @@
+// For nanosleep under strict C
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "thread_pool.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdbool.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+typedef struct thread_pool_t {
+    thread_pool_job_fn_t fn;
+    void *context;
+    uint32_t num_jobs;
+    thread_atomic_uint32_t next_job;
+} thread_pool_t;
+
+
+typedef struct thread_pool_worker_t {
+    thread_pool_t *pool;
+    uint32_t index;
+    thread_handle_t thread;
+} thread_pool_worker_t;
+
+
+static void thread_pool_work(thread_pool_t *pool, uint32_t worker) {
+    while (true) {
+        uint32_t job = thread_atomic_add_uint32(&pool->next_job, 1);
+        if (job >= pool->num_jobs) {
+            break;
+        }
+        pool->fn(pool->context, job, worker);
+    }
+}
+
+
+static int thread_pool_thread_main(void *arg) {
+    thread_pool_worker_t *worker = arg;
+    thread_pool_work(worker->pool, worker->index);
+    return 0;
+}
+
+
+void thread_pool_run(uint32_t num_threads, uint32_t num_jobs, thread_pool_job_fn_t fn, void *context) {
+    assert(fn);
+
+    uint32_t num_workers = min_uint32(min_uint32(max_uint32(num_threads, 1), num_jobs), THREAD_POOL_MAX_THREADS);
+
+    thread_pool_t pool = {
+        .fn = fn,
+        .context = context,
+        .num_jobs = num_jobs
+    };
+
+    // The calling thread is worker 0.
+    // If we can't start as many threads as we'd like, just carry on with the ones we have.
+    thread_pool_worker_t workers[THREAD_POOL_MAX_THREADS];
+    uint32_t num_started = 1;
+    for (uint32_t w = 1; w < num_workers; w++) {
+        workers[w] = (thread_pool_worker_t) {
+            .pool = &pool,
+            .index = w
+        };
+        if (!thread_start(&workers[w].thread, thread_pool_thread_main, &workers[w])) {
+            break;
+        }
+        num_started++;
+    }
+
+    thread_pool_work(&pool, 0);
+
+    for (uint32_t w = 1; w < num_started; w++) {
+        thread_join(&workers[w].thread);
+    }
+}
+
+
+// Threads
+
+#if defined(_WIN32)
+static DWORD WINAPI thread_main(LPVOID arg) {
+    thread_handle_t *thread = arg;
+    thread->result = thread->fn(thread->arg);
+    return 0;
+}
+#else
+static void *thread_main(void *arg) {
+    thread_handle_t *thread = arg;
+    thread->result = thread->fn(thread->arg);
+    return 0;
+}
+#endif
+
+
+bool thread_start(thread_handle_t *thread, thread_fn_t fn, void *arg) {
+    assert(thread && fn);
+    thread->fn = fn;
+    thread->arg = arg;
+    thread->result = 0;
+#if defined(_WIN32)
+    thread->handle = CreateThread(0, 0, thread_main, thread, 0, 0);
+    return thread->handle != 0;
+#else
+    return pthread_create(&thread->handle, 0, thread_main, thread) == 0;
+#endif
+}
+
+
+int thread_join(thread_handle_t *thread) {
+    assert(thread);
+#if defined(_WIN32)
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, 0);
+#endif
+    return thread->result;
+}
+
+
+void thread_sleep_ms(uint32_t ms) {
+#if defined(_WIN32)
+    Sleep(ms);
+#else
+    struct timespec duration = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    nanosleep(&duration, 0);
+#endif
+}
+
+
+// Mutexes and condition variables.
+// On Windows, these are slim reader/writer locks and condition variables, which need no freeing, and fit in the
+// pointer each wrapper holds.
+
+#if defined(_WIN32)
+_Static_assert(sizeof(SRWLOCK) == sizeof(void *), "SRWLOCK should fit in thread_mutex_t");
+_Static_assert(sizeof(CONDITION_VARIABLE) == sizeof(void *), "CONDITION_VARIABLE should fit in thread_condition_t");
+#endif
+
+
+bool thread_mutex_init(thread_mutex_t *mutex) {
+    assert(mutex);
+#if defined(_WIN32)
+    InitializeSRWLock((PSRWLOCK)&mutex->lock);
+    return true;
+#else
+    return pthread_mutex_init(&mutex->lock, 0) == 0;
+#endif
+}
+
+
+void thread_mutex_deinit(thread_mutex_t *mutex) {
+    assert(mutex);
+#if !defined(_WIN32)
+    pthread_mutex_destroy(&mutex->lock);
+#endif
+}
+
+
+void thread_mutex_lock(thread_mutex_t *mutex) {
+    assert(mutex);
+#if defined(_WIN32)
+    AcquireSRWLockExclusive((PSRWLOCK)&mutex->lock);
+#else
+    pthread_mutex_lock(&mutex->lock);
+#endif
+}
+
+
+void thread_mutex_unlock(thread_mutex_t *mutex) {
+    assert(mutex);
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive((PSRWLOCK)&mutex->lock);
+#else
+    pthread_mutex_unlock(&mutex->lock);
+#endif
+}
+
+
+bool thread_condition_init(thread_condition_t *condition) {
+    assert(condition);
+#if defined(_WIN32)
+    InitializeConditionVariable((PCONDITION_VARIABLE)&condition->condition);
+    return true;
+#else
+    return pthread_cond_init(&condition->condition, 0) == 0;
+#endif
+}
+
+
+void thread_condition_deinit(thread_condition_t *condition) {
+    assert(condition);
+#if !defined(_WIN32)
+    pthread_cond_destroy(&condition->condition);
+#endif
+}
+
+
+void thread_condition_wait(thread_condition_t *condition, thread_mutex_t *mutex) {
+    assert(condition && mutex);
+#if defined(_WIN32)
+    SleepConditionVariableSRW((PCONDITION_VARIABLE)&condition->condition, (PSRWLOCK)&mutex->lock, INFINITE, 0);
+#else
+    pthread_cond_wait(&condition->condition, &mutex->lock);
+#endif
+}
+
+
+void thread_condition_broadcast(thread_condition_t *condition) {
+    assert(condition);
+#if defined(_WIN32)
+    WakeAllConditionVariable((PCONDITION_VARIABLE)&condition->condition);
+#else
+    pthread_cond_broadcast(&condition->condition);
+#endif
+}
@@ -0,0 +1,155 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+// The maximum number of threads which will be used to run jobs
+#define THREAD_POOL_MAX_THREADS 64
+
+
+// A job function: job is the index of the job being run, in [0, num_jobs),
+// and worker is the index of the thread running it, in [0, num_threads).
+// Jobs run by the same worker never run concurrently, so worker can be used to index per-thread resources.
+typedef void (*thread_pool_job_fn_t)(void *context, uint32_t job, uint32_t worker);
+
+
+// Run num_jobs jobs across up to num_threads threads (including the calling thread), returning when they are all done.
+// Jobs are started in index order, each by whichever thread becomes free first.
+void thread_pool_run(uint32_t num_threads, uint32_t num_jobs, thread_pool_job_fn_t fn, void *context);
+
+
+// Threads, locks and atomics.
+// C11's <threads.h> and <stdatomic.h> aren't everywhere - macOS has no <threads.h>, and MSVC only has them in recent
+// toolsets, and behind a flag - so these wrap pthreads on POSIX, and Win32 threads and Interlocked intrinsics on
+// Windows.
+
+typedef int (*thread_fn_t)(void *arg);
+
+// A thread started with thread_start. It must stay where it is until it's joined.
+typedef struct thread_handle_t {
+#if defined(_WIN32)
+    void *handle;
+#else
+    pthread_t handle;
+#endif
+    thread_fn_t fn;
+    void *arg;
+    int result;
+} thread_handle_t;
+
+// Start a thread running fn(arg), returning false if it couldn't be started
+bool thread_start(thread_handle_t *thread, thread_fn_t fn, void *arg);
+
+// Wait for a thread to finish, returning what its function returned
+int thread_join(thread_handle_t *thread);
+
+// Sleep the calling thread for at least the given time
+void thread_sleep_ms(uint32_t ms);
+
+
+typedef struct thread_mutex_t {
+#if defined(_WIN32)
+    void *lock;             // an SRWLOCK, which is the size of a pointer
+#else
+    pthread_mutex_t lock;
+#endif
+} thread_mutex_t;
+
+// Returns false if the mutex couldn't be made
+bool thread_mutex_init(thread_mutex_t *mutex);
+void thread_mutex_deinit(thread_mutex_t *mutex);
+void thread_mutex_lock(thread_mutex_t *mutex);
+void thread_mutex_unlock(thread_mutex_t *mutex);
+
+
+typedef struct thread_condition_t {
+#if defined(_WIN32)
+    void *condition;        // a CONDITION_VARIABLE, which is the size of a pointer
+#else
+    pthread_cond_t condition;
+#endif
+} thread_condition_t;
+
+// Returns false if the condition variable couldn't be made
+bool thread_condition_init(thread_condition_t *condition);
+void thread_condition_deinit(thread_condition_t *condition);
+
+// Release the mutex and wait to be woken, taking the mutex again before returning. Wakes can be spurious.
+void thread_condition_wait(thread_condition_t *condition, thread_mutex_t *mutex);
+void thread_condition_broadcast(thread_condition_t *condition);
+
+
+// Atomic counters. A zero-initialised one holds 0. Every operation is sequentially consistent.
+typedef struct thread_atomic_uint32_t {
+    volatile uint32_t value;
+} thread_atomic_uint32_t;
+
+typedef struct thread_atomic_uint64_t {
+    volatile uint64_t value;
+} thread_atomic_uint64_t;
+
+// Add to an atomic, returning the value it had before
+static inline uint32_t thread_atomic_add_uint32(thread_atomic_uint32_t *atomic, uint32_t n) {
+#ifdef _MSC_VER
+    return (uint32_t)_InterlockedExchangeAdd((volatile long *)&atomic->value, (long)n);
+#else
+    return __atomic_fetch_add(&atomic->value, n, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint32_t thread_atomic_load_uint32(thread_atomic_uint32_t *atomic) {
+#ifdef _MSC_VER
+    return (uint32_t)_InterlockedCompareExchange((volatile long *)&atomic->value, 0, 0);
+#else
+    return __atomic_load_n(&atomic->value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void thread_atomic_store_uint32(thread_atomic_uint32_t *atomic, uint32_t value) {
+#ifdef _MSC_VER
+    _InterlockedExchange((volatile long *)&atomic->value, (long)value);
+#else
+    __atomic_store_n(&atomic->value, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Add to an atomic, returning the value it had before
+static inline uint64_t thread_atomic_add_uint64(thread_atomic_uint64_t *atomic, uint64_t n) {
+#ifdef _MSC_VER
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)&atomic->value, (__int64)n);
+#else
+    return __atomic_fetch_add(&atomic->value, n, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint64_t thread_atomic_load_uint64(thread_atomic_uint64_t *atomic) {
+#ifdef _MSC_VER
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)&atomic->value, 0, 0);
+#else
+    return __atomic_load_n(&atomic->value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void thread_atomic_store_uint64(thread_atomic_uint64_t *atomic, uint64_t value) {
+#ifdef _MSC_VER
+    // 32 bit x86 has no 64 bit exchange intrinsic, but it does have compare and exchange
+    __int64 expected = (__int64)atomic->value;
+    __int64 previous;
+    while ((previous = _InterlockedCompareExchange64((volatile __int64 *)&atomic->value, (__int64)value, expected)) != expected) {
+        expected = previous;
+    }
+#else
+    __atomic_store_n(&atomic->value, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+
+#endif // ifndef THREAD_POOL_H_
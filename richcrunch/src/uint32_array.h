@@ -0,0 +1,10 @@
+#ifndef UINT32_ARRAY_H_
+#define UINT32_ARRAY_H_
+
+#include <stdint.h>
+
+#define TEMPLATE_ARRAY_NAME uint32_array
+#define TEMPLATE_ARRAY_TYPE uint32_t
+#include "array.template.h"
+
+#endif // ifndef UINT32_ARRAY_H_
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
 // Return the minimum of two int32s
@@ -28,6 +31,65 @@ static inline uint32_t max_uint32(uint32_t a, uint32_t b) {
 // Returns the minimum number of bits required to represent the argument
 uint32_t get_bit_width(uint32_t x);
 
+// Returns the time in milliseconds from a monotonic clock where there is one, for timing
+double get_time_ms(void);
+
+// Returns the number of trailing zero bits in a non-zero uint32
+static inline uint32_t get_trailing_zeros_uint32(uint32_t x) {
+    assert(x != 0);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return index;
+#else
+    return (uint32_t)__builtin_ctz(x);
+#endif
+}
+
+// Returns the number of trailing zero bits in a non-zero uint64
+static inline uint32_t get_trailing_zeros_uint64(uint64_t x) {
+    assert(x != 0);
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return index;
+#elif defined(_MSC_VER)
+    return ((uint32_t)x != 0) ? get_trailing_zeros_uint32((uint32_t)x) : 32 + get_trailing_zeros_uint32((uint32_t)(x >> 32));
+#else
+    return (uint32_t)__builtin_ctzll(x);
+#endif
+}
+
+// Returns the number of leading zero bits in a non-zero uint64
+static inline uint32_t get_leading_zeros_uint64(uint64_t x) {
+    assert(x != 0);
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (x >> 32) {
+        _BitScanReverse(&index, (uint32_t)(x >> 32));
+        return 31 - index;
+    }
+    _BitScanReverse(&index, (uint32_t)x);
+    return 63 - index;
+#else
+    return (uint32_t)__builtin_clzll(x);
+#endif
+}
+
+// Reverses the order of the bits in a uint64
+static inline uint64_t reverse_bits_uint64(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+    x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+    return (x >> 32) | (x << 32);
+}
+
 
 static inline uint32_t get_elias_gamma_cost(uint32_t value) {
     assert(value > 0 && value <= 256);  // 256 will be read as 0
@@ -0,0 +1,13 @@
+#ifndef VERSION_H_
+#define VERSION_H_
+
+
+#define VERSION "0.1"
+
+// The revision of what the compressors output.
+// Bump it with any change which can change the output for the same input and options, whether to a parser, a
+// serialiser or a format, so that outputs cached by earlier builds are never used.
+#define OUTPUT_REVISION 2
+
+
+#endif // ifndef VERSION_H_